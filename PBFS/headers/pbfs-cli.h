@@ -22,16 +22,20 @@
 "\t\t\tdir, file, res (reserve), sys (system), symlink (symbolic link)\n" \
 "\t\tTypes for Kernel -\n" \
 "\t\t\tchainloaded, connector (data points to a PBFS Connector)\n" \
+"\t--long: Lists with permissions, uid, gid, size and modified time of each entry (LIST Only)\n" \
+"\t--sorted: Keeps the added dir sorted by name (B+tree) from the start (ADD DIR Only)\n" \
+"\t--compress: Stores the added file or kernel compressed, it is unpacked as it is read (ADD FILE and ADD KERNEL Only)\n" \
 "\t-f/--format: Format the disk\n" \
 "\t-c/--create: Create the disk\n" \
-"\t-a/--add <filepath>: Adds a file to the image. (use --name for the file name or file path will be used)\n" \
+"\t-a/--add <filepath>: Adds a file to the image, - reads stdin. (use --name for the file name or file path will be used, required for stdin)\n" \
 "\t-ad/--add_dir <path>: Adds a dir to the image at the specified path.\n" \
-"\t-cpy/--copy <from path> <to path>: Copies a file from one path to another.\n" \
+"\t-cpy/--copy <from path> <to path>: Copies a file from one path to another. (the copy shares data blocks with the original until either is written)\n" \
 "\t-rn/--rename <from path> <to path>: Renames a file from one path to another. (just like move)\n" \
 "\t-chp/--change_permissions <path>: Changes the file permissions. (use --permissions)\n" \
-"\t-mv/--move <from path> <to path>: Moves a file from one path to another.\n" \
+"\t-mv/--move <from path> <to path>: Moves a file or directory from one path to another.\n" \
 "\t-r/--remove <file>: Removes the provided file from the image. (use --name for the file name or file path will be used)\n" \
 "\t-u/--update <filepath>: Updates a file on the image. (use --name for the file name or file path will be used)\n" \
+"\t-ap/--append <filepath>: Appends the contents of a file to a file on the image. (use --name for the file name)\n" \
 "\t-btl/--bootloader <filepath>: Adds a bootloader to the image.\n" \
 "\t-rbp/--reserve_boot_partition <Start LBA (Aligned to 4096)> <Number of Blocks>: Reserves the specified number of blocks before the PBFS Header (MAX: 511)\n" \
 "\t-rkt/--reserve_kernel_table: Reserves a Kernel Table Block (Extendable).\n" \
@@ -39,6 +43,7 @@
 "\t-rk/--remove_kernel <path>: Removes a kernel from the kernel table.\n" \
 "\t-t/--test: Tests and shows information about the disk.\n" \
 "\t-l/--list <path>: Lists a dir or shows file path if file exists.\n" \
+"\t-cd/--compact_dir <path>: Packs a dir into the fewest DMM blocks and frees the empty ones.\n" \
 "\t-rf/--read_file <path>: Reads a file from within the image.\n" \
 "\t-rfb/--read_file_binary <path>: Reads a file from within the image. (binary)\n" \
 "\t-gpt/--gpt: Adds GPT Headers, NOTE: Requires Bootloader Parition to be atleast 30 blocks (BTL ONLY)\n" \
@@ -6,6 +6,7 @@
 #include "pbfs_structs.h"
 #include "pbfs_structs_64.h"
 #include <stdbool.h>
+#include <stdatomic.h>
 
 #define PBFS_DEF_BLOCK_SIZE 512
 #define PBFS_HDR_START_LBA 512
@@ -61,6 +62,69 @@ struct block_device {
     int (*flush)(
         struct block_device *dev
     );
+
+    // Optional (may be NULL), tells the device that blocks no longer hold live data (TRIM/UNMAP/hole punch)
+    int (*discard)(
+        struct block_device *dev,
+        uint64_t lba,
+        uint64_t count
+    );
+};
+
+#define PBFS_DCACHE_ENTRIES 256
+
+// Cached result of looking name up in the directory whose first DMM block is dir_lba
+struct pbfs_dcache_entry {
+    uint64_t dir_lba; // 0 = Unused
+    char name[PBFS_MAX_NAME_LEN];
+    bool negative; // name doesn't exist in the directory
+
+    PBFS_DMM_Entry entry;
+    uint64_t dmm_lba; // DMM block holding the entry
+    uint64_t child_lba; // First DMM block if the entry is a directory (0 = not resolved yet)
+};
+
+// Seqlocked dcache slot: seq is odd while a writer fills entry, a reader whose copy saw seq move treats it as a miss
+struct pbfs_dcache_slot {
+    _Atomic uint32_t seq;
+    struct pbfs_dcache_entry entry;
+};
+
+#define PBFS_BLOOM_DIRS 32
+#define PBFS_BLOOM_HASHES 4
+
+// Bloom filter over the names of one directory, built on the first miss in it and updated by every add.
+// Removes never clear bits, a "maybe" just falls back to the normal lookup.
+// Seqlocked like pbfs_dcache_slot, a test that saw seq move answers "no filter".
+struct pbfs_dir_bloom {
+    _Atomic uint32_t seq;
+    uint64_t dir_lba; // 0 = Unused
+    _Atomic(uint64_t*) words; // [0] = bit count (power of two), then the bits. Only swapped for a larger array.
+    uint64_t cap; // Bits words has room for
+    uint64_t names; // Names in it, rebuilt larger once it passes the bit count / 8
+};
+
+#define PBFS_SYMLINK_CACHE 16
+#define PBFS_SYMLINK_HOPS 8 // Default pbfs_mount.symlink_hops
+#define PBFS_MAX_SYMLINK_HOPS 40
+
+// Target of the symlink whose metadata is at link_lba, and for absolute targets what it resolved to
+// while the namespace was at generation gen
+struct pbfs_symlink_entry {
+    uint64_t link_lba; // 0 = Unused
+    char target[PBFS_MAX_PATH_LEN];
+
+    bool resolved;
+    uint64_t gen;
+    PBFS_DMM_Entry entry;
+    uint64_t dmm_lba;
+    uint64_t dir_lba;
+};
+
+// Seqlocked like pbfs_dcache_slot
+struct pbfs_symlink_slot {
+    _Atomic uint32_t seq;
+    struct pbfs_symlink_entry entry;
 };
 
 struct pbfs_mount {
@@ -86,33 +150,173 @@ struct pbfs_mount {
 	PBFS_Bitmap64* bitmaps;
     uint64_t bitmap_count;
 	uint64_t bitmap_cap;
+
+    _Atomic(struct pbfs_dcache_slot*) dcache; // Lookups never wait, writers only wait on the slot they change
+
+    _Atomic(struct pbfs_dir_bloom*) blooms; // Tests never wait, like the dcache
+    _Atomic(uint64_t*) bloom_retired; // Filter arrays swapped out while a test may still read them, chained through word 1, freed by pbfs_unmount
+
+    _Atomic uint64_t ns_gen; // Bumped by every change to a directory
+    _Atomic(struct pbfs_symlink_slot*) symlinks; // Hits never wait, like the dcache
+    uint32_t symlink_hops; // Most symlinks one lookup follows, set to PBFS_SYMLINK_HOPS by pbfs_mount (at most PBFS_MAX_SYMLINK_HOPS)
+
+    // Shared block table (PBFS_FEATURE_REFLINK), loaded by pbfs_mount and written back when dirty at the end of a free batch
+    PBFS_Refcount* refcounts;
+    uint64_t refcount_count;
+    uint64_t* refcount_blocks; // Blocks the table is stored in, in chain order
+    uint64_t refcount_block_count;
+    bool refcount_dirty;
 };
 
+// Resume point of a directory listing: the next entry is entry index of the DMM block at dmm_lba (0 = end)
+struct pbfs_dir_cookie {
+    uint64_t dmm_lba;
+    uint32_t index;
+};
+
+// Directory entry together with its metadata (pbfs_readdir_plus)
+struct pbfs_dirent_plus {
+    PBFS_DMM_Entry entry;
+    PBFS_Metadata md;
+    uint64_t size; // Logical size, md.data_size is the packed size for compressed files
+};
+
+// Open directory, caller owned. Holds no allocations, pbfs_closedir just ends it.
+// Also a handle the *_at calls resolve relative names against.
+struct pbfs_dir {
+    struct pbfs_mount* mnt;
+    uint64_t dir_lba; // First DMM block of the directory
+    PBFS_Permission_Flags perms; // Of the directory itself
+    struct pbfs_dir_cookie cookie;
+};
+
+// One contiguous piece of a file: the metadata block at md_lba (the head or an extender) and the data it points to
+struct pbfs_file_extent {
+    uint64_t md_lba;
+    uint64_t data_lba;
+    uint64_t file_offset; // Of its first byte within the file
+    uint64_t size;
+};
+
+// Open file, caller owned. Keeps the metadata and extent map so positional I/O only touches the blocks it needs,
+// pbfs_close frees the map. Replacing or removing the file by path while it is open leaves the handle stale.
+struct pbfs_file {
+    struct pbfs_mount* mnt;
+    PBFS_DMM_Entry entry;
+    PBFS_Metadata md; // Of the head extent
+    uint64_t size;
+    struct pbfs_file_extent* extents;
+    uint64_t extent_count;
+
+    // METADATA_FLAG_COMPRESSED: size is the unpacked size, reads unpack the chunks they touch
+    uint64_t stored_size;
+    uint64_t* chunks; // Stored offset of every chunk, then of the zero header after them
+    uint64_t chunk_count;
+    uint32_t chunk_size;
+    uint8_t* chunk_cache; // Last chunk read, unpacked (cached_chunk = its index + 1, 0 = none), and room to read one
+    uint64_t cached_chunk;
+};
+
+// File being created by pbfs_create, caller owned until pbfs_finish or pbfs_cancel releases it. Data is written
+// as it comes in, whole blocks at a time, to blocks taken as they are needed (size_hint worth up front);
+// the entry only shows up in its directory at pbfs_finish.
+struct pbfs_writer {
+    struct pbfs_mount* mnt;
+    uint64_t dir_lba;
+    char name[PBFS_MAX_NAME_LEN];
+    PBFS_Metadata md;
+    uint64_t md_lba;
+    uint64_t size; // Bytes written so far
+    uint64_t hint_blocks;
+    PBFS_Extent* runs; // Blocks taken, in file order
+    uint64_t run_count;
+    uint64_t run_cap;
+    uint64_t reserved; // Blocks in runs
+    uint64_t written; // Of them, written
+    uint64_t pos_run; // Next block to write: pos_off into runs[pos_run]
+    uint64_t pos_off;
+    uint8_t* tail; // Partial last block
+    size_t tail_len;
+    int error; // First failed write, every later call returns it and pbfs_finish drops the file
+
+    // METADATA_FLAG_COMPRESSED: data gathers in zbuf a chunk at a time and goes on packed, size counts it packed
+    uint8_t* zbuf;
+    size_t zlen;
+    uint64_t* zoffsets; // Stored offset of every chunk packed so far
+    uint64_t zcount;
+    uint64_t zcap;
+    uint64_t zsize; // Bytes taken in
+};
+
+// Receives a streamed read chunk by chunk, anything but PBFS_RES_SUCCESS stops the read and is returned by it
+typedef int (*pbfs_sink)(void* ctx, const uint8_t* data, size_t len);
+
+// Scratch a read of packed data needs next to its read buffer: a stream buffer at least this plus a block
+// bigger doesn't allocate it (pbfs_*_into always do)
+#define PBFS_COMPRESS_SCRATCH (2 * PBFS_COMPRESS_CHUNK + sizeof(PBFS_Compressed_Chunk))
 
 int pbfs_init(struct pbfs_funcs* functions) __attribute__((used));
 int pbfs_format(struct block_device* dev, uint8_t reserve_kernel_table, uint64_t boot_part_lba, uint64_t boot_part_size, uint64_t volume_id) __attribute__((used));
 int pbfs_mount(struct block_device* dev, struct pbfs_mount* mnt) __attribute__((used));
+int pbfs_unmount(struct pbfs_mount* mnt) __attribute__((used));
 int pbfs_read_block(struct pbfs_mount* mnt, uint64_t fs_block, void* buffer) __attribute__((used));
 int pbfs_write_block(struct pbfs_mount* mnt, uint64_t fs_block, void* buffer) __attribute__((used));
 int pbfs_read(struct pbfs_mount* mnt, uint64_t fs_block, size_t size, void* buffer) __attribute__((used));
 int pbfs_write(struct pbfs_mount* mnt, uint64_t fs_block, size_t size, void* buffer) __attribute__((used));
 int pbfs_flush(struct pbfs_mount* mnt) __attribute__((used));
+// METADATA_FLAG_COMPRESSED in type stores a file packed (also for pbfs_create), such files are only ever rewritten whole
 int pbfs_add(struct pbfs_mount* mnt, char* path, uint32_t uid, uint32_t gid, PBFS_Metadata_Flags type, PBFS_Permission_Flags permissions, uint8_t* data, size_t data_size) __attribute__((used));
+// Streaming pbfs_add: create, write the data in chunks of any size, then finish (links the entry) or cancel
+int pbfs_create(struct pbfs_mount* mnt, char* path, uint32_t uid, uint32_t gid, PBFS_Metadata_Flags type, PBFS_Permission_Flags permissions, uint64_t size_hint, struct pbfs_writer* w) __attribute__((used));
+int pbfs_write_chunk(struct pbfs_writer* w, const void* data, size_t len) __attribute__((used));
+int pbfs_finish(struct pbfs_writer* w) __attribute__((used));
+int pbfs_cancel(struct pbfs_writer* w) __attribute__((used));
 int pbfs_add_dir(struct pbfs_mount* mnt, char* path, uint32_t uid, uint32_t gid, PBFS_Permission_Flags permissions) __attribute__((used));
+int pbfs_add_dir_ex(struct pbfs_mount* mnt, char* path, uint32_t uid, uint32_t gid, PBFS_Permission_Flags permissions, PBFS_Dir_Flags flags) __attribute__((used));
 int pbfs_remove(struct pbfs_mount* mnt, char* path) __attribute__((used));
 int pbfs_update_file(struct pbfs_mount* mnt, char* path, uint8_t* data, size_t data_size) __attribute__((used));
+// Grows the file by data_size bytes: into its tail block, the free blocks after it, then a new extender extent
+int pbfs_append(struct pbfs_mount* mnt, char* path, uint8_t* data, size_t data_size) __attribute__((used));
 int pbfs_change_permissions(struct pbfs_mount* mnt, char* path, PBFS_Permission_Flags new_permissions) __attribute__((used));
 int pbfs_read_file(struct pbfs_mount* mnt, char* path, uint8_t** data_out, size_t* data_size) __attribute__((used));
+// Reads the file into buf without allocating, *data_size = the file size (PBFS_ERR_Buffer_Too_Small if it is over buf_size)
+int pbfs_read_file_into(struct pbfs_mount* mnt, const char* path, void* buf, size_t buf_size, size_t* data_size) __attribute__((used));
+// Hands the file to sink in order, buf is the scratch space chunks are read into (no allocation)
+int pbfs_read_file_stream(struct pbfs_mount* mnt, const char* path, void* buf, size_t buf_size, pbfs_sink sink, void* ctx) __attribute__((used));
 int pbfs_copy(struct pbfs_mount* mnt, char* path, char* new_path) __attribute__((used));
 int pbfs_move(struct pbfs_mount* mnt, char* path, char* new_path) __attribute__((used));
 int pbfs_rename(struct pbfs_mount* mnt, char* path, char* new_path) __attribute__((used));
 int pbfs_find_entry(const char* path, PBFS_DMM_Entry* out, uint64_t* out_lba, struct pbfs_mount* mnt) __attribute__((used));
+// Kernels are one run of blocks (lba, count), zero blocks are stored like any others
 int pbfs_add_kernel(struct pbfs_mount* mnt, const char* name, PBFS_Kernel_Flags flags, uint8_t* data, size_t data_size) __attribute__((used));
 int pbfs_find_kernel(struct pbfs_mount* mnt, const char* name, PBFS_Kernel_Entry* kernel_e) __attribute__((used));
 int pbfs_get_kernel(struct pbfs_mount* mnt, PBFS_Kernel_Entry* kernel_e, uint8_t** data, size_t* data_size) __attribute__((used));
+int pbfs_get_kernel_into(struct pbfs_mount* mnt, PBFS_Kernel_Entry* kernel_e, void* buf, size_t buf_size, size_t* data_size) __attribute__((used));
+int pbfs_get_kernel_stream(struct pbfs_mount* mnt, PBFS_Kernel_Entry* kernel_e, void* buf, size_t buf_size, pbfs_sink sink, void* ctx) __attribute__((used));
 int pbfs_remove_kernel(struct pbfs_mount* mnt, char* name) __attribute__((used));
 int pbfs_list_kernels(struct pbfs_mount* mnt, PBFS_Kernel_Entry* out, size_t max_out_len, size_t* out_len) __attribute__((used));
 int pbfs_list_items(struct pbfs_mount* mnt, char* path, PBFS_DMM_Entry* out, size_t max_out_len, size_t* out_len) __attribute__((used));
+// Entries >= from in name order (DIR_FLAG_SORTED or converted directories only), a prefix scan stops at the first non match
+int pbfs_list_range(struct pbfs_mount* mnt, char* path, const char* from, PBFS_DMM_Entry* out, size_t max_out_len, size_t* out_len) __attribute__((used));
+// Packs the directory into the fewest DMM blocks and frees the rest (B+tree directories are rebuilt)
+int pbfs_compact_dir(struct pbfs_mount* mnt, char* path) __attribute__((used));
+int pbfs_opendir(struct pbfs_mount* mnt, const char* path, struct pbfs_dir* dir) __attribute__((used));
+int pbfs_readdir(struct pbfs_dir* dir, PBFS_DMM_Entry* out, size_t max_out_len, size_t* out_len) __attribute__((used));
+int pbfs_readdir_plus(struct pbfs_dir* dir, struct pbfs_dirent_plus* out, size_t max_out_len, size_t* out_len) __attribute__((used));
+int pbfs_telldir(struct pbfs_dir* dir, struct pbfs_dir_cookie* cookie) __attribute__((used));
+int pbfs_seekdir(struct pbfs_dir* dir, const struct pbfs_dir_cookie* cookie) __attribute__((used));
+int pbfs_closedir(struct pbfs_dir* dir) __attribute__((used));
+// Relative paths start at dir (".." never leaves it), absolute ones at the root. add/remove take a single name.
+int pbfs_find_entry_at(struct pbfs_dir* dir, const char* path, PBFS_DMM_Entry* out, uint64_t* out_lba) __attribute__((used));
+int pbfs_opendir_at(struct pbfs_dir* dir, const char* path, struct pbfs_dir* out) __attribute__((used));
+int pbfs_add_at(struct pbfs_dir* dir, char* name, uint32_t uid, uint32_t gid, PBFS_Metadata_Flags type, PBFS_Permission_Flags permissions, uint8_t* data, size_t data_size) __attribute__((used));
+int pbfs_remove_at(struct pbfs_dir* dir, char* name) __attribute__((used));
+int pbfs_open(struct pbfs_mount* mnt, const char* path, struct pbfs_file* file) __attribute__((used));
+// Reads up to len bytes at offset, *out_len = bytes read (short at the end of the file)
+int pbfs_pread(struct pbfs_file* file, uint64_t offset, size_t len, void* buf, size_t* out_len) __attribute__((used));
+// Writes len bytes at offset (<= the file size), whatever goes past the end is appended like pbfs_append
+int pbfs_pwrite(struct pbfs_file* file, uint64_t offset, size_t len, const void* buf) __attribute__((used));
+int pbfs_close(struct pbfs_file* file) __attribute__((used));
 int pbfs_add_bootloader(struct pbfs_mount* mnt, uint8_t* data, size_t data_size, uint8_t boot_part_type) __attribute__((used));
 #endif
 
@@ -157,6 +361,10 @@ enum PBFS_Result {
     PBFS_ERR_DMM_Corrupted,
     PBFS_ERR_Bitmap_Corrupted,
     PBFS_ERR_Sysinfo_Corrupted,
+
+    PBFS_ERR_Too_Many_Symlinks,
+
+    PBFS_ERR_Buffer_Too_Small,
 };
 
 const char* pbfs_get_err_str(enum PBFS_Result return_code) __attribute__((used));
\ No newline at end of file
@@ -27,6 +27,7 @@ void path_normalize(char* path, char* out, int out_size) __attribute__((used));
 void path_dirname(char* path, char* out, int out_size) __attribute__((used));
 void path_basename(char* path, char* out, int out_size) __attribute__((used));
 void path_part(char* path, int index, char* out, int out_size) __attribute__((used));
+int path_next(char* path, int* pos, char* out, int out_size) __attribute__((used));
 void path_join(char* out, char* p1, char* p2, int out_size) __attribute__((used));
 
 static const uint128_t zero128 = {{0, 0, 0, 0}};
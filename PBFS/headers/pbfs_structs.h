@@ -11,10 +11,14 @@
 #define PBFS_DMM_ENTRIES 4
 
 #define PBFS_MAX_DMM_CHAIN 2048
+#define PBFS_DMM_INDEX_THRESHOLD 4 // DMM blocks in a directory before it gets a hashed index
+#define PBFS_DMM_BTREE_THRESHOLD 64 // DMM blocks in a directory before it is converted to a B+tree
+#define PBFS_MAX_BTREE_DEPTH 16
 #define PBFS_MAX_KERNEL_CHAIN 2
 
 #define PBFS_MAX_NAME_LEN 64
 #define PBFS_MAX_PATH_LEN 4096
+#define PBFS_MAX_PATH_DEPTH 256
 
 typedef struct {
     uint32_t part[4]; // [0] = LSB, [3] = MSB
@@ -36,8 +40,27 @@ typedef struct {
     uint32_t block_size;
 
     char disk_name[32];
+
+    uint32_t features; // PBFS_FEATURE_*, 0 on volumes formatted before feature flags existed
+    uint32_t dmm_entries; // Entries per DMM block with PBFS_FEATURE_DMM_FILL
+    uint64_t refcount_lba; // First block of the shared block table with PBFS_FEATURE_REFLINK (0 = nothing is shared)
 } PBFS_Header __attribute__((packed));
 
+#define PBFS_FEATURE_DMM_FILL (1 << 0) // DMM blocks hold as many entries as the block size allows
+#define PBFS_FEATURE_DIR_ADJACENT (1 << 1) // A directory's first DMM block is the block after its metadata (entry lba + 1)
+#define PBFS_FEATURE_NAME_TAGS (1 << 2) // DMM blocks and kernel tables keep name_tags up to date
+#define PBFS_FEATURE_EXTENTS (1 << 3) // Files that don't fit one free run keep their data in an extent list (PBFS_DATA_OFFSET_EXTENTS)
+#define PBFS_FEATURE_REFLINK (1 << 4) // Extent list files can share data blocks, counted in the shared block table (refcount_lba)
+#define PBFS_FEATURE_INLINE_DATA (1 << 5) // Files that fit in the rest of their metadata block are kept there (METADATA_FLAG_INLINE)
+#define PBFS_FEATURE_SPARSE (1 << 6) // Extent lists can hold holes (PBFS_EXTENT_HOLE), zero blocks with nothing allocated
+#define PBFS_FEATURE_COMPRESSION (1 << 7) // Files and kernels can be stored packed (METADATA_FLAG_COMPRESSED, KERNEL_FLAG_COMPRESSED)
+#define PBFS_FEATURE_DIR_INDEX (1 << 8) // First DMM blocks keep index_lba/index_blocks/index_used, reserved bytes on older volumes
+#define PBFS_FEATURE_DIR_BTREE (1 << 9) // First DMM blocks keep btree_root/btree_depth/dir_flags, reserved bytes on older volumes
+#define PBFS_FEATURES_SUPPORTED (PBFS_FEATURE_DMM_FILL | PBFS_FEATURE_DIR_ADJACENT | PBFS_FEATURE_NAME_TAGS | PBFS_FEATURE_EXTENTS | PBFS_FEATURE_REFLINK | PBFS_FEATURE_INLINE_DATA | PBFS_FEATURE_SPARSE | PBFS_FEATURE_COMPRESSION | PBFS_FEATURE_DIR_INDEX | PBFS_FEATURE_DIR_BTREE)
+
+#define PBFS_DMM_NAME_TAGS 40 // Entries of a DMM block that get a name tag, the rest are always compared in full
+#define PBFS_NAME_TAG(hash) ((uint8_t)((hash) >> 24)) // Top byte of a name's CRC32
+
 typedef struct {
     uint8_t bytes[PBFS_BITMAP_LIMIT];
     uint128_t extender_lba;
@@ -46,6 +69,7 @@ typedef struct {
 typedef enum {
     KERNEL_FLAG_CHAINLOADED = 1 << 0,
 	KERNEL_FLAG_CONNECTOR = 1 << 1,
+    KERNEL_FLAG_COMPRESSED = 1 << 2, // Stored packed (PBFS_FEATURE_COMPRESSION), the trailer ends the last block
 } PBFS_Kernel_Flags;
 
 typedef struct {
@@ -59,7 +83,8 @@ typedef struct {
     PBFS_Kernel_Entry entries[PBFS_KERNEL_TABLE_ENTRIES];
     uint64_t entry_count;
 
-    uint8_t reserved[12];
+    uint8_t name_tags[PBFS_KERNEL_TABLE_ENTRIES]; // PBFS_NAME_TAG of each entry's name (PBFS_FEATURE_NAME_TAGS)
+    uint8_t reserved[12 - PBFS_KERNEL_TABLE_ENTRIES];
     uint128_t extender_lba;
 } PBFS_Kernel_Table __attribute__((packed));
 
@@ -72,14 +97,67 @@ typedef struct {
     uint64_t modified_timestamp;
 } PBFS_DMM_Entry __attribute__((packed));
 
+// Legacy DMM block, also the layout of a PBFS_FEATURE_DMM_FILL block on 512 byte volumes.
+// Filled blocks keep header.dmm_entries entries followed by a PBFS_DMM_Trailer.
 typedef struct {
     PBFS_DMM_Entry entries[PBFS_DMM_ENTRIES];
 
     uint64_t entry_count;
-    uint8_t reserved[72];
+
+    // Hashed name index, only valid in the first DMM block of a directory (index_lba <= 1 [Not Present], PBFS_FEATURE_DIR_INDEX)
+    uint64_t index_lba;
+    uint32_t index_blocks;
+    uint32_t index_used; // Used + deleted slots
+
+    // B+tree, only valid in the first DMM block of a directory (btree_root <= 1 [Not Present], PBFS_FEATURE_DIR_BTREE).
+    // That block then holds no entries, its extender is the leftmost leaf and the leaves are chained in name order.
+    uint64_t btree_root;
+    uint32_t btree_depth; // Internal levels, 0 = btree_root is the only leaf
+    uint32_t dir_flags; // PBFS_Dir_Flags
+
+    uint8_t name_tags[PBFS_DMM_NAME_TAGS]; // PBFS_NAME_TAG of each entry's name, compared before the name itself (PBFS_FEATURE_NAME_TAGS)
     uint128_t extender_lba;
 } PBFS_DMM __attribute__((packed));
 
+// Everything in a DMM block after its entries, same fields as PBFS_DMM
+typedef struct {
+    uint64_t entry_count;
+
+    uint64_t index_lba;
+    uint32_t index_blocks;
+    uint32_t index_used;
+
+    uint64_t btree_root;
+    uint32_t btree_depth;
+    uint32_t dir_flags;
+
+    uint8_t name_tags[PBFS_DMM_NAME_TAGS];
+    uint128_t extender_lba;
+} PBFS_DMM_Trailer __attribute__((packed));
+
+typedef enum {
+    DIR_FLAG_SORTED = 1 << 0, // B+tree from creation instead of once it grows (PBFS_FEATURE_DIR_BTREE)
+} PBFS_Dir_Flags;
+
+// Internal B+tree node: a PBFS_DMM_Node header followed by key_count keys.
+// Names below keys[0] live under first_child, names >= keys[i] (and below keys[i + 1]) under keys[i].child.
+typedef struct {
+    uint64_t key_count;
+    uint64_t first_child;
+} PBFS_DMM_Node __attribute__((packed));
+
+typedef struct {
+    char name[PBFS_MAX_NAME_LEN];
+    uint64_t child;
+} PBFS_DMM_Node_Key __attribute__((packed));
+
+// Slot of a directory's hashed index, points at the DMM block that holds the name
+typedef struct {
+    uint32_t hash;
+    uint32_t reserved;
+    uint64_t dmm_lba; // 0 = Empty, 1 = Deleted
+} PBFS_DMM_Index_Slot __attribute__((packed));
+
 typedef struct {
     uint128_t ext_id;
     uint128_t next_lba;
@@ -103,6 +181,8 @@ typedef enum {
     METADATA_FLAG_FILE = 1 << 3,
     METADATA_FLAG_DIR = 1 << 4,
 	METADATA_FLAG_SYMLINK = 1 << 5,
+    METADATA_FLAG_INLINE = 1 << 6, // Metadata only: data_offset is 0, the data follows in the metadata block (PBFS_FEATURE_INLINE_DATA)
+    METADATA_FLAG_COMPRESSED = 1 << 7, // Metadata only: the data is stored packed and data_size counts it packed (PBFS_FEATURE_COMPRESSION), inline data is kept as is
 } PBFS_Metadata_Flags;
 
 typedef struct {
@@ -124,6 +204,58 @@ typedef struct {
     uint128_t extender_lba;
 } PBFS_Metadata __attribute__((packed));
 
+#define PBFS_DATA_OFFSET_EXTENTS 0xFFFFFFFFu // data_offset of a file whose data blocks are listed in its extent list
+
+// Run of data blocks of an extent list file
+typedef struct {
+    uint64_t lba; // PBFS_EXTENT_HOLE = count blocks of zeros that aren't stored anywhere
+    uint64_t count;
+} PBFS_Extent __attribute__((packed));
+
+#define PBFS_EXTENT_HOLE 0 // Block 0 is never file data
+
+// Extent list: in the metadata block at PBFS_EXTENT_LIST_OFFSET, continued at the start of overflow blocks
+typedef struct {
+    uint32_t count; // Extents following this header in the block
+    uint32_t reserved;
+    uint64_t next_lba; // Overflow block holding the rest of the list (0 = none)
+} PBFS_Extent_List __attribute__((packed));
+
+#define PBFS_EXTENT_LIST_OFFSET ((sizeof(PBFS_Metadata) + 15) & ~(size_t)15)
+#define PBFS_INLINE_DATA_OFFSET PBFS_EXTENT_LIST_OFFSET // Inline data starts where an extent list would
+
+// Packed data (PBFS_FEATURE_COMPRESSION): chunks of PBFS_COMPRESS_CHUNK bytes (the last one shorter), each a header and
+// its bytes in LZ4 block format, or as they are when stored == size. A zero header ends them, then comes the stored
+// offset (uint64_t) of every chunk and the trailer (kernels pad before the offsets so the trailer ends the last block).
+#define PBFS_COMPRESS_CHUNK 65536
+#define PBFS_COMPRESS_MAGIC 0x5A534250 // "PBSZ"
+
+typedef struct {
+    uint32_t stored; // Bytes following the header
+    uint32_t size; // Bytes they unpack to
+} PBFS_Compressed_Chunk __attribute__((packed));
+
+typedef struct {
+    uint64_t size; // Unpacked
+    uint64_t chunk_count;
+    uint32_t chunk_size;
+    uint32_t magic;
+} PBFS_Compressed_Trailer __attribute__((packed));
+
+// Shared block table: runs of blocks referenced by more than one file, sorted by lba.
+// A block that isn't listed belongs to one file (or none).
+typedef struct {
+    uint64_t lba;
+    uint64_t count;
+    uint64_t refs; // Files referencing every block of the run, >= 2
+} PBFS_Refcount __attribute__((packed));
+
+typedef struct {
+    uint32_t count; // Runs following this header in the block
+    uint32_t reserved;
+    uint64_t next_lba; // Next block of the table (0 = none)
+} PBFS_Refcount_Block __attribute__((packed));
+
 typedef struct {
     uint128_t hardware_bound_low;
     uint128_t hardware_bound_high;
@@ -19,6 +19,10 @@ typedef struct {
     uint32_t block_size;
 
     char disk_name[PBFS_DISK_NAME_LEN];
+
+    uint32_t features;
+    uint32_t dmm_entries; // Entries per DMM block in use on this volume (PBFS_DMM_ENTRIES on legacy volumes)
+    uint64_t refcount_lba;
 } PBFS_Header64 __attribute__((packed));
 
 typedef struct {
@@ -37,7 +41,8 @@ typedef struct {
     PBFS_Kernel_Entry64 entries[PBFS_KERNEL_TABLE_ENTRIES];
     uint64_t entry_count;
 
-    uint8_t reserved[12];
+    uint8_t name_tags[PBFS_KERNEL_TABLE_ENTRIES];
+    uint8_t reserved[12 - PBFS_KERNEL_TABLE_ENTRIES];
     uint64_t extender_lba;
 } PBFS_Kernel_Table64 __attribute__((packed));
 
@@ -54,7 +59,17 @@ typedef struct {
     PBFS_DMM_Entry64 entries[PBFS_DMM_ENTRIES];
 
     uint64_t entry_count;
-    uint8_t reserved[88];
+
+    uint64_t index_lba;
+    uint32_t index_blocks;
+    uint32_t index_used;
+
+    uint64_t btree_root;
+    uint32_t btree_depth;
+    uint32_t dir_flags;
+
+    uint8_t name_tags[PBFS_DMM_NAME_TAGS];
+    uint8_t reserved[56 - PBFS_DMM_NAME_TAGS];
     uint64_t extender_lba;
 } PBFS_DMM64 __attribute__((packed));
 
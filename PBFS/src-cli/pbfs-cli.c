@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // fallocate
 #define PBFS_CLI
 #include <pbfs.h>
 #include <pbfs-cli.h>
@@ -16,6 +17,7 @@
 #include <time.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
 
 // Util Funcs for parsing perms and types
 static PBFS_Metadata_Flags parse_file_type(char* str) {
@@ -65,7 +67,7 @@ static PBFS_Kernel_Flags parse_kernel_type(char* str) {
 }
 
 static const char* kernel_flags_to_str(PBFS_Kernel_Flags flags) {
-	switch (flags) {
+	switch (flags & ~KERNEL_FLAG_COMPRESSED) {
 		case KERNEL_FLAG_CHAINLOADED: return "Chainloaded";
 		case KERNEL_FLAG_CONNECTOR: return "Connected via PBFS Connector";
 		default: return "None";
@@ -148,16 +150,70 @@ static const char* get_size_unit(unsigned long long int size) {
 }
 
 // Lists a dir from the disk
-int pbfs_list_dir(struct pbfs_mount* mnt, const char* path) {
+// Long listing, metadata for each batch comes from one pbfs_readdir_plus call
+int pbfs_list_dir_long(struct pbfs_mount* mnt, const char* path) {
     if (!mnt->active) {
         fprintf(stderr, "Mount inactive!\n");
         return PBFS_ERR_Mount_Inactive;
     }
 
-    PBFS_DMM_Entry entries[256];
+    struct pbfs_dir dir;
+    int out = pbfs_opendir(mnt, path, &dir);
+
+    if (out != PBFS_RES_SUCCESS) {
+        fprintf(stderr, "Failed to list directory: %s\n", pbfs_get_err_str(out));
+        return out;
+    }
+
+    printf("Listing: %s\n", path);
+
+    struct pbfs_dirent_plus* entries = malloc(sizeof(struct pbfs_dirent_plus) * 256);
+    if (!entries) {
+        perror("Failed to allocate memory!\n");
+        pbfs_closedir(&dir);
+        return PBFS_ERR_Allocation_Failed;
+    }
+
     size_t out_len = 0;
+    do {
+        out = pbfs_readdir_plus(&dir, entries, 256, &out_len);
+        if (out != PBFS_RES_SUCCESS) {
+            fprintf(stderr, "Failed to list directory: %s\n", pbfs_get_err_str(out));
+            free(entries);
+            pbfs_closedir(&dir);
+            return out;
+        }
+
+        for (size_t i = 0; i < out_len; i++) {
+            char perms[10];
+            file_perms_to_str(entries[i].md.ex_flags, perms, sizeof(perms));
+
+            printf(
+                "\t%-7s %5u %5u %12llu %llu %.64s [%s]\n",
+                perms,
+                entries[i].md.uid,
+                entries[i].md.gid,
+                (unsigned long long int)entries[i].size,
+                (unsigned long long int)entries[i].md.modified_timestamp,
+                entries[i].entry.name,
+                file_type_to_str(entries[i].entry.type)
+            );
+        }
+    } while (out_len > 0);
 
-    int out = pbfs_list_items(mnt, (char*)path, entries, 256, &out_len);
+    free(entries);
+    pbfs_closedir(&dir);
+    return PBFS_RES_SUCCESS;
+}
+
+int pbfs_list_dir(struct pbfs_mount* mnt, const char* path) {
+    if (!mnt->active) {
+        fprintf(stderr, "Mount inactive!\n");
+        return PBFS_ERR_Mount_Inactive;
+    }
+
+    struct pbfs_dir dir;
+    int out = pbfs_opendir(mnt, path, &dir);
 
     if (out != PBFS_RES_SUCCESS) {
         fprintf(stderr, "Failed to list directory: %s\n", pbfs_get_err_str(out));
@@ -166,19 +222,32 @@ int pbfs_list_dir(struct pbfs_mount* mnt, const char* path) {
 
     printf("Listing: %s\n", path);
 
-    for (size_t i = 0; i < out_len; i++) {
-        char perms[10];
-        file_perms_to_str(entries[i].perms, perms, sizeof(perms));
-
-        printf(
-            "\t%.64s [%s] (%s / at lba %lld)\n",
-            entries[i].name,
-            file_type_to_str(entries[i].type),
-            perms,
-            uint128_to_u64(entries[i].lba)
-        );
-    }
+    // Page through, only one batch is held at a time
+    PBFS_DMM_Entry entries[64];
+    size_t out_len = 0;
+    do {
+        out = pbfs_readdir(&dir, entries, 64, &out_len);
+        if (out != PBFS_RES_SUCCESS) {
+            fprintf(stderr, "Failed to list directory: %s\n", pbfs_get_err_str(out));
+            pbfs_closedir(&dir);
+            return out;
+        }
+
+        for (size_t i = 0; i < out_len; i++) {
+            char perms[10];
+            file_perms_to_str(entries[i].perms, perms, sizeof(perms));
+
+            printf(
+                "\t%.64s [%s] (%s / at lba %lld)\n",
+                entries[i].name,
+                file_type_to_str(entries[i].type),
+                perms,
+                uint128_to_u64(entries[i].lba)
+            );
+        }
+    } while (out_len > 0);
 
+    pbfs_closedir(&dir);
     return PBFS_RES_SUCCESS;
 }
 
@@ -214,12 +283,16 @@ int pbfs_test(struct pbfs_mount* mnt, FILE* f, uint8_t debug) {
         "Disk Name: %s\nVolume ID: %lld\n"
         "DMM Root LBA: %lld\nBitmap Root LBA: %lld\n"
         "Kernel Table Root LBA: %lld\nData LBA: %lld\n"
-        "Boot Partition LBA: %lld\nBoot Partition Size: %lld\n",
+        "Boot Partition LBA: %lld\nBoot Partition Size: %lld\n"
+        "Features: 0x%x\nDMM Entries per Block: %u\n"
+        "Shared Block Table LBA: %llu\n",
         hdr->magic,
         (unsigned int)hdr->block_size, (unsigned long long int)uint128_to_u64(hdr->total_blocks),
         (char*)hdr->disk_name, (unsigned long long int)uint128_to_u64(hdr->volume_id),
         hdr->dmm_root_lba, hdr->bitmap_lba, hdr->kernel_table_lba, hdr->data_start_lba,
-        hdr->boot_partition_lba, hdr->boot_partition_size
+        hdr->boot_partition_lba, hdr->boot_partition_size,
+        hdr->features, (hdr->features & PBFS_FEATURE_DMM_FILL) ? hdr->dmm_entries : PBFS_DMM_ENTRIES,
+        (unsigned long long int)((hdr->features & PBFS_FEATURE_REFLINK) ? hdr->refcount_lba : 0)
     );
 
     if (hdr->bitmap_lba <= 1) {
@@ -282,6 +355,32 @@ int pbfs_test(struct pbfs_mount* mnt, FILE* f, uint8_t debug) {
     return EXIT_SUCCESS;
 }
 
+// -a, -ap and -rf/-rfb stream files through a fixed buffer, whatever their size (with room to unpack compressed ones in)
+#define CLI_STREAM_BUF_SIZE (65536 + PBFS_COMPRESS_SCRATCH)
+static uint8_t stream_buf[CLI_STREAM_BUF_SIZE];
+
+struct print_sink {
+    size_t printed;
+    int stopped; // -rf prints up to the first NUL
+};
+
+static int print_text(void* ctx, const uint8_t* data, size_t len) {
+    struct print_sink* p = ctx;
+    for (size_t i = 0; i < len && !p->stopped; i++) {
+        if (data[i] == '\0') p->stopped = 1;
+        else printf("%c", (char)data[i]);
+    }
+    return PBFS_RES_SUCCESS;
+}
+
+static int print_hex(void* ctx, const uint8_t* data, size_t len) {
+    struct print_sink* p = ctx;
+    for (size_t i = 0; i < len; i++) {
+        printf(p->printed++ > 0 ? " %02X" : "%02X", data[i]);
+    }
+    return PBFS_RES_SUCCESS;
+}
+
 static int read_blk(struct block_device* dev, uint64_t lba, void* out) {
     fseek((FILE*)dev->driver_data, lba * dev->block_size, SEEK_SET);
     fread(out, dev->block_size, 1, (FILE*)dev->driver_data);
@@ -311,6 +410,18 @@ static int flush_ex(struct block_device* dev) {
     return 1;
 }
 
+// Punches a hole over freed blocks so sparse images shrink, size is kept
+static int discard_ex(struct block_device* dev, uint64_t lba, uint64_t count) {
+#ifdef FALLOC_FL_PUNCH_HOLE
+    FILE* f = (FILE*)dev->driver_data;
+    fflush(f);
+    if (fallocate(fileno(f), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)(lba * dev->block_size), (off_t)(count * dev->block_size)) != 0) return 0;
+    return 1;
+#else
+    return 0;
+#endif
+}
+
 // Main function
 int main(int argc, char** argv) {
     if (argc < 2) {
@@ -327,11 +438,14 @@ int main(int argc, char** argv) {
     uint64_t volume_id = 0;
     char disk_name[32];
 
-    char name[64];
+    char name[64] = {0};
     uint32_t gid = 0;
     uint32_t uid = 0;
-    char perms[6];
-    char type[6];
+    char perms[6] = {0};
+    char type[6] = {0};
+    PBFS_Dir_Flags dir_flags = 0;
+    uint8_t list_long = 0;
+    uint8_t compress = 0;
 
     if (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0) {
       printf(PBFS_CLI_HELP);
@@ -367,7 +481,8 @@ int main(int argc, char** argv) {
         .read = read_ex,
         .write_block = write_blk,
         .write = write_ex,
-        .flush = flush_ex
+        .flush = flush_ex,
+        .discard = discard_ex
     };
     struct pbfs_funcs funcs = {
         .free=free,
@@ -484,28 +599,46 @@ int main(int argc, char** argv) {
             if (strlen(filepath) < 1 || strlen(name) < 1) {
                 strcpy(name, filepath);
             }
+            // "-" reads stdin, which has no name of its own
+            int from_stdin = strcmp(filepath, "-") == 0;
+            if (from_stdin && strcmp(name, filepath) == 0) {
+                printf("Usage: pbfs-cli <image> --name <path> %s -\n", argv[i - 1]);
+                fclose(fp);
+                return InvalidUsage;
+            }
             printf("Adding File [%s] to Image...\n", name);
-            FILE* f = fopen(filepath, "rb");
+            FILE* f = from_stdin ? stdin : fopen(filepath, "rb");
             if (!f) {
                 perror("Failed to open file!\n");
                 fclose(fp);
                 return PBFS_ERR_UNKNOWN;
             }
-            fseek(f, 0, SEEK_END);
-            uint64_t data_size = ftell(f);
-            rewind(f);
-            uint8_t* data = (uint8_t*)malloc(data_size);
-            if (!data) {
-                perror("Failed to allocate memory!\n");
-                fclose(fp);
-                fclose(f);
-                return PBFS_ERR_UNKNOWN;
+
+            // The size is only a hint, files are copied through a fixed buffer whatever their size
+            uint64_t size_hint = 0;
+            if (!from_stdin && fseek(f, 0, SEEK_END) == 0) {
+                long end = ftell(f);
+                if (end > 0) size_hint = (uint64_t)end;
+                rewind(f);
             }
-            fread(data, 1, data_size, f);
-            fclose(f);
 
-            int out = pbfs_add(&mnt, name, uid, gid, parse_file_type(type), parse_file_perms(perms), data, data_size);
-            free(data);
+            struct pbfs_writer w = {0};
+            int out = pbfs_create(&mnt, name, uid, gid, parse_file_type(type) | (compress ? METADATA_FLAG_COMPRESSED : 0), parse_file_perms(perms), size_hint, &w);
+            size_t got = 0;
+            while (out == PBFS_RES_SUCCESS && (got = fread(stream_buf, 1, sizeof(stream_buf), f)) > 0) {
+                out = pbfs_write_chunk(&w, stream_buf, got);
+            }
+            if (out == PBFS_RES_SUCCESS && ferror(f)) {
+                perror("Failed to read file!\n");
+                out = PBFS_ERR_UNKNOWN;
+            }
+            if (!from_stdin) fclose(f);
+
+            if (out == PBFS_RES_SUCCESS) {
+                out = pbfs_finish(&w);
+            } else if (w.mnt) {
+                pbfs_cancel(&w);
+            }
             if (out != PBFS_RES_SUCCESS) {
                 fprintf(stderr, "Error: %s\n", pbfs_get_err_str(out));
                 fclose(fp);
@@ -586,6 +719,55 @@ int main(int argc, char** argv) {
 
             int out = pbfs_update_file(&mnt, name, data, data_size);
             free(data);
+            if (out != PBFS_RES_SUCCESS) {
+                fprintf(stderr, "Error: %s\n", pbfs_get_err_str(out));
+                fclose(fp);
+                return out;
+            }
+            printf("Done!\n");
+        } else if (strcmp(argv[i], "-ap") == 0 || strcmp(argv[i], "--append") == 0) {
+            // Append to a file
+            if (mnt.active != true) {
+                int out = pbfs_mount(&block_dev, &mnt);
+                if (out != PBFS_RES_SUCCESS) {
+                    fprintf(stderr, "Failed to mount, Error: %s\n", pbfs_get_err_str(out));
+                    fclose(fp);
+                    return PBFS_ERR_UNKNOWN;
+                }
+            }
+
+            if (i + 2 > argc) {
+                printf("Usage: pbfs-cli <image> %s <filepath>\n", argv[i]);
+                fclose(fp);
+                return InvalidUsage;
+            }
+            char* filepath = argv[i + 1];
+            i++;
+            if (strlen(filepath) < 1 || strlen(name) < 1) {
+                fclose(fp);
+                fprintf(stderr, "No path specified, use --name!\n");
+                return InvalidArgument;
+            }
+            printf("Appending [%s] to File [%s] in Image...\n", filepath, name);
+            FILE* f = fopen(filepath, "rb");
+            if (!f) {
+                perror("Failed to open file!\n");
+                fclose(fp);
+                return PBFS_ERR_UNKNOWN;
+            }
+
+            // One append per buffer full, the file grows as it is read
+            int out = PBFS_RES_SUCCESS;
+            size_t got = 0;
+            while (out == PBFS_RES_SUCCESS && (got = fread(stream_buf, 1, sizeof(stream_buf), f)) > 0) {
+                out = pbfs_append(&mnt, name, stream_buf, got);
+            }
+            if (out == PBFS_RES_SUCCESS && ferror(f)) {
+                perror("Failed to read file!\n");
+                out = PBFS_ERR_UNKNOWN;
+            }
+            fclose(f);
+
             if (out != PBFS_RES_SUCCESS) {
                 fprintf(stderr, "Error: %s\n", pbfs_get_err_str(out));
                 fclose(fp);
@@ -611,7 +793,7 @@ int main(int argc, char** argv) {
             char* filepath = argv[i + 1];
             i++;
             printf("Adding Dir [%s] to Image...\n", filepath);
-            int out = pbfs_add_dir(&mnt, filepath, uid, gid, parse_file_perms(perms));
+            int out = pbfs_add_dir_ex(&mnt, filepath, uid, gid, parse_file_perms(perms), dir_flags);
             if (out != PBFS_RES_SUCCESS) {
                 fprintf(stderr, "Error: %s\n", pbfs_get_err_str(out));
                 fclose(fp);
@@ -637,7 +819,32 @@ int main(int argc, char** argv) {
             char* filepath = argv[i + 1];
             i++;
             printf("Listing [%s] from Image...\n", filepath);
-            int out = pbfs_list_dir(&mnt, filepath);
+            int out = list_long ? pbfs_list_dir_long(&mnt, filepath) : pbfs_list_dir(&mnt, filepath);
+            if (out != PBFS_RES_SUCCESS) {
+                fprintf(stderr, "Error: %s\n", pbfs_get_err_str(out));
+                fclose(fp);
+                return out;
+            }
+            printf("Done!\n");
+        } else if (strcmp(argv[i], "-cd") == 0 || strcmp(argv[i], "--compact_dir") == 0) {
+            if (mnt.active != true) {
+                int out = pbfs_mount(&block_dev, &mnt);
+                if (out != PBFS_RES_SUCCESS) {
+                    fprintf(stderr, "Failed to mount, Error: %s\n", pbfs_get_err_str(out));
+                    fclose(fp);
+                    return PBFS_ERR_UNKNOWN;
+                }
+            }
+
+            if (i + 2 > argc) {
+                printf("Usage: pbfs-cli <image> %s <path>\n", argv[i]);
+                fclose(fp);
+                return InvalidUsage;
+            }
+            char* filepath = argv[i + 1];
+            i++;
+            printf("Compacting [%s]...\n", filepath);
+            int out = pbfs_compact_dir(&mnt, filepath);
             if (out != PBFS_RES_SUCCESS) {
                 fprintf(stderr, "Error: %s\n", pbfs_get_err_str(out));
                 fclose(fp);
@@ -663,20 +870,13 @@ int main(int argc, char** argv) {
             char* filepath = argv[i + 1];
             i++;
             printf("Reading [%s] from Image...\n", filepath);
-            uint8_t* data = NULL;
-            size_t data_size = 0;
-            int out = pbfs_read_file(&mnt, filepath, &data, &data_size);
+            struct print_sink sink = {0};
+            int out = pbfs_read_file_stream(&mnt, filepath, stream_buf, sizeof(stream_buf), print_text, &sink);
             if (out != PBFS_RES_SUCCESS) {
-                if (data) free(data);
                 fprintf(stderr, "Error: %s\n", pbfs_get_err_str(out));
                 fclose(fp);
                 return out;
             }
-            for (size_t i = 0; i < data_size; i++) {
-                if (data[i] == '\0') break;
-                printf("%c", (char)data[i]);
-            }
-            free(data);
             printf("\nDone!\n");
         } else if (strcmp(argv[i], "-rfb") == 0 || strcmp(argv[i], "--read_file_binary") == 0) {
             if (mnt.active != true) {
@@ -697,23 +897,20 @@ int main(int argc, char** argv) {
             char* filepath = argv[i + 1];
             i++;
             printf("Reading [%s] from Image...\n", filepath);
-            uint8_t* data = NULL;
-            size_t data_size = 0;
-            int out = pbfs_read_file(&mnt, filepath, &data, &data_size);
+            struct print_sink sink = {0};
+            int out = pbfs_read_file_stream(&mnt, filepath, stream_buf, sizeof(stream_buf), print_hex, &sink);
             if (out != PBFS_RES_SUCCESS) {
-                if (data) free(data);
                 fprintf(stderr, "Error: %s\n", pbfs_get_err_str(out));
                 fclose(fp);
                 return out;
             }
-            for (size_t i = 0; i < data_size; i++) {
-                printf("%02X", data[i]);
-                if (i < data_size - 1) {
-                    printf(" ");
-                }
-            }
-            free(data);
             printf("\nDone!\n");
+        } else if (strcmp(argv[i], "--long") == 0) {
+            list_long = 1;
+        } else if (strcmp(argv[i], "--sorted") == 0) {
+            dir_flags |= DIR_FLAG_SORTED;
+        } else if (strcmp(argv[i], "--compress") == 0) {
+            compress = 1;
         } else if (strcmp(argv[i], "--gid") == 0) {
             if (i + 2 > argc) {
                 printf("Usage: pbfs-cli <image> %s <gid>\n", argv[i]);
@@ -1024,7 +1221,7 @@ int main(int argc, char** argv) {
             fread(data, 1, data_size, f);
             fclose(f);
 
-            int out = pbfs_add_kernel(&mnt, name_path, parse_kernel_type(type), data, data_size);
+            int out = pbfs_add_kernel(&mnt, name_path, parse_kernel_type(type) | (compress ? KERNEL_FLAG_COMPRESSED : 0), data, data_size);
             if (out != PBFS_RES_SUCCESS) {
                 fprintf(stderr, "Error: %s\n", pbfs_get_err_str(out));
                 free(data);
@@ -1041,6 +1238,7 @@ int main(int argc, char** argv) {
         }
     }
 
+    if (mnt.active) pbfs_unmount(&mnt);
     fflush(fp);
     fclose(fp);
     return EXIT_SUCCESS;
@@ -74,6 +74,15 @@ struct guid {
     uint8_t data4[8];
 } __attribute__((packed));
 
+#define PBFS_DISCARD_BATCH 16
+
+// Freed extents, merged while adjacent and handed to dev->discard in as few calls as possible
+struct discard_batch {
+    uint64_t lba[PBFS_DISCARD_BATCH];
+    uint64_t count[PBFS_DISCARD_BATCH];
+    uint32_t used;
+};
+
 static struct pbfs_funcs funcs = {0};
 
 static atomic_flag pbfs_funcs_lock = ATOMIC_FLAG_INIT;
@@ -84,9 +93,6 @@ static uint64_t guid_seed = 0x123456789ABCDEF0;
 
 static atomic_flag pbfs_crc32_lock = ATOMIC_FLAG_INIT;
 
-static uint64_t dmm_cache[PBFS_MAX_DMM_CHAIN];
-static atomic_flag dmm_cache_lock = ATOMIC_FLAG_INIT;
-
 // static funcs
 static void lock_spinlock(atomic_flag* lock) {
 	while (atomic_flag_test_and_set(lock)) {
@@ -172,6 +178,10 @@ static void hdr_to_hdr64(PBFS_Header* src, PBFS_Header64* dst) {
     dst->block_size = src->block_size;
 
     memcpy(&dst->disk_name, &src->disk_name, PBFS_DISK_NAME_LEN);
+
+    dst->features = src->features;
+    dst->dmm_entries = (src->features & PBFS_FEATURE_DMM_FILL) ? src->dmm_entries : PBFS_DMM_ENTRIES;
+    dst->refcount_lba = (src->features & PBFS_FEATURE_REFLINK) ? src->refcount_lba : 0;
 }
 
 static void bitmap_to_bitmap64(PBFS_Bitmap* src, PBFS_Bitmap64* dst) {
@@ -193,12 +203,21 @@ static void dmm_to_dmm64(PBFS_DMM* src, PBFS_DMM64* dst) {
         dmmentry_to_dmmentry64(&src->entries[i], &dst->entries[i]);
     }
     dst->entry_count = src->entry_count;
+    dst->index_lba = src->index_lba;
+    dst->index_blocks = src->index_blocks;
+    dst->index_used = src->index_used;
+    dst->btree_root = src->btree_root;
+    dst->btree_depth = src->btree_depth;
+    dst->dir_flags = src->dir_flags;
+    memcpy(dst->name_tags, src->name_tags, sizeof(dst->name_tags));
     dst->extender_lba = uint128_to_u64(src->extender_lba);
 }
 
 static void kernelentry_to_kernelentry64(PBFS_Kernel_Entry* src, PBFS_Kernel_Entry64* dst) {
-    memcpy(&dst->name, &src->name, PBFS_MAX_NAME_LEN);
+    memcpy(&dst->name, &src->name, sizeof(dst->name));
+    dst->flags = src->flags;
     dst->lba = uint128_to_u64(src->lba);
+    dst->count = uint128_to_u64(src->count);
 }
 
 static void kernel_table_to_kernel_table64(PBFS_Kernel_Table* src, PBFS_Kernel_Table64* dst) {
@@ -206,6 +225,7 @@ static void kernel_table_to_kernel_table64(PBFS_Kernel_Table* src, PBFS_Kernel_T
         kernelentry_to_kernelentry64(&src->entries[i], &dst->entries[i]);
     }
     dst->entry_count = src->entry_count;
+    memcpy(dst->name_tags, src->name_tags, sizeof(dst->name_tags));
     dst->extender_lba = uint128_to_u64(src->extender_lba);
 }
 
@@ -226,6 +246,18 @@ static int bitmap_test_recursive(PBFS_Bitmap64* current, uint64_t lba, uint64_t
     return bitmap_test_recursive(&next64, lba, bitmap_idx + 1, mnt);
 }
 
+// 1 = lba is in use, 0 = free, -1 = no bitmap covers it. Bitmaps already loaded are tested without I/O.
+static int bitmap_test(struct pbfs_mount* mnt, uint64_t lba) {
+    if (lba >= mnt->header64.total_blocks) return -1;
+
+    uint64_t idx = lba / (PBFS_BITMAP_LIMIT * 8);
+    if (idx < mnt->bitmap_count) return bitmap_bit_test(mnt->bitmaps[idx].bytes, lba % (PBFS_BITMAP_LIMIT * 8));
+
+    PBFS_Bitmap64 first;
+    bitmap_to_bitmap64(&mnt->root_bitmap, &first);
+    return bitmap_test_recursive(&first, lba, 0, mnt);
+}
+
 static uint64_t bitmap_find_blocks(PBFS_Bitmap64* start, uint64_t start_lba, uint64_t blocks, struct pbfs_mount* mnt) {
     if (blocks == 0) return 0;
     
@@ -394,366 +426,2954 @@ static uint64_t bitmap_set(PBFS_Bitmap* current, uint64_t lba, uint64_t bitmap_l
     return 0;
 }
 
-static int add_dmm_entry(struct pbfs_mount* mnt, PBFS_DMM* cur_dmm, uint64_t cur_dmm_lba, uint64_t lba, char* name, PBFS_Metadata_Flags type, PBFS_Permission_Flags perms, uint64_t created_ts, uint64_t modified_ts) {
-    PBFS_DMM dmm = *cur_dmm;
-    PBFS_DMM64 dmm64 = {0};
-    dmm_to_dmm64(&dmm, &dmm64);
-    PBFS_DMM* current = &dmm;
-    PBFS_DMM64* current64 = &dmm64;
-    uint64_t cur_lba = cur_dmm_lba;
-
-    for (int depth = 0; depth < PBFS_MAX_DMM_CHAIN; depth++) {
-        // If there is space in current DMM, add the entry
-        if (current->entry_count < PBFS_DMM_ENTRIES) {
-            PBFS_DMM_Entry* entry = &current->entries[current->entry_count];
-            entry->lba = uint128_from_u64(lba);
-            entry->type = type;
-            entry->created_timestamp = created_ts;
-            entry->modified_timestamp = modified_ts;
-            entry->perms = perms;
-            strncpy(entry->name, name, sizeof(entry->name) - 1);
-            entry->name[sizeof(entry->name) - 1] = '\0';
-            current->entry_count++;
+// Shared block table (PBFS_FEATURE_REFLINK): mnt->refcounts is sorted by lba, neighbouring runs with the same refs merged
 
-            return pbfs_write(mnt, cur_lba, sizeof(PBFS_DMM), current);
-        }
+// Index of the first run ending after lba
+static uint64_t refcount_find(struct pbfs_mount* mnt, uint64_t lba) {
+    uint64_t lo = 0;
+    uint64_t hi = mnt->refcount_count;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (mnt->refcounts[mid].lba + mnt->refcounts[mid].count <= lba) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
 
-        // If current DMM is full, check for extender
-        if (current64->extender_lba > 0) {
-            cur_lba = current64->extender_lba;
-            int out = pbfs_read(mnt, cur_lba, sizeof(PBFS_DMM), &dmm);
-            if (out != PBFS_RES_SUCCESS) return out;
-            continue;
-        }
+// Length of the start of [lba, lba + count) that is either all shared (*shared = true) or not shared at all
+static uint64_t refcount_span(struct pbfs_mount* mnt, uint64_t lba, uint64_t count, bool* shared) {
+    *shared = false;
+    uint64_t i = refcount_find(mnt, lba);
+    if (i >= mnt->refcount_count) return count;
 
-        // Need to allocate a new extender block
-        PBFS_DMM new_extender = {0};
-        new_extender.entry_count = 1;
-        PBFS_DMM_Entry* entry = &new_extender.entries[0];
-        entry->lba = uint128_from_u64(lba);
-        entry->type = type;
-        entry->created_timestamp = created_ts;
-        entry->modified_timestamp = modified_ts;
-        entry->perms = perms;
-        strncpy(entry->name, name, sizeof(entry->name) - 1);
-        entry->name[sizeof(entry->name) - 1] = '\0';
+    PBFS_Refcount* r = &mnt->refcounts[i];
+    *shared = r->lba <= lba;
+    uint64_t len = *shared ? r->lba + r->count - lba : r->lba - lba;
+    return len < count ? len : count;
+}
 
-        uint64_t new_ext_lba = bitmap_find_blocks(&mnt->root_bitmap64, mnt->header64.data_start_lba, 1, mnt);
-        if (new_ext_lba == 0) return PBFS_ERR_No_Space_Left;
+static void refcount_push(PBFS_Refcount* runs, uint64_t* n, uint64_t lba, uint64_t count, uint64_t refs) {
+    if (count == 0 || refs < 2) return;
+    if (*n > 0 && runs[*n - 1].lba + runs[*n - 1].count == lba && runs[*n - 1].refs == refs) {
+        runs[*n - 1].count += count;
+        return;
+    }
+    runs[*n].lba = lba;
+    runs[*n].count = count;
+    runs[*n].refs = refs;
+    (*n)++;
+}
 
-        // Write new extender to disk
-        int out = pbfs_write(mnt, new_ext_lba, sizeof(PBFS_DMM), &new_extender);
-        if (out != PBFS_RES_SUCCESS) return out;
-        bitmap_set(&mnt->root_bitmap, new_ext_lba, mnt->header64.bitmap_lba, 0, mnt, 1);
+// Adds delta to the references of every block in [lba, lba + count), blocks that aren't listed have one.
+// Only the table in memory changes, refcount_sync writes it.
+static int refcount_adjust(struct pbfs_mount* mnt, uint64_t lba, uint64_t count, int delta) {
+    uint64_t end = lba + count;
+    uint64_t first = refcount_find(mnt, lba);
+    uint64_t last = first;
+    while (last < mnt->refcount_count && mnt->refcounts[last].lba < end) last++;
+
+    // Every overlapping run can turn into itself and the gap before it, plus the parts sticking out at both ends
+    PBFS_Refcount* runs = funcs.malloc((mnt->refcount_count + (last - first) + 3) * sizeof(PBFS_Refcount));
+    if (!runs) return PBFS_ERR_Allocation_Failed;
+
+    uint64_t n = first;
+    if (n > 0) memcpy(runs, mnt->refcounts, n * sizeof(PBFS_Refcount));
+
+    uint64_t pos = lba;
+    for (uint64_t i = first; i < last; i++) {
+        PBFS_Refcount r = mnt->refcounts[i];
+        uint64_t r_end = r.lba + r.count;
+        if (r.lba < lba) refcount_push(runs, &n, r.lba, lba - r.lba, r.refs);
+        else refcount_push(runs, &n, pos, r.lba - pos, (uint64_t)(1 + delta));
+
+        uint64_t from = r.lba > lba ? r.lba : lba;
+        uint64_t to = r_end < end ? r_end : end;
+        refcount_push(runs, &n, from, to - from, (uint64_t)((int64_t)r.refs + delta));
+        if (r_end > end) refcount_push(runs, &n, end, r_end - end, r.refs);
+        pos = to;
+    }
+    refcount_push(runs, &n, pos, end - pos, (uint64_t)(1 + delta));
+    for (uint64_t i = last; i < mnt->refcount_count; i++) {
+        refcount_push(runs, &n, mnt->refcounts[i].lba, mnt->refcounts[i].count, mnt->refcounts[i].refs);
+    }
 
-        // Link current DMM to extender
-        current->extender_lba = uint128_from_u64(new_ext_lba);
+    if (mnt->refcounts) funcs.free(mnt->refcounts);
+    if (n == 0) {
+        funcs.free(runs);
+        runs = NULL;
+    }
+    mnt->refcounts = runs;
+    mnt->refcount_count = n;
+    mnt->refcount_dirty = true;
+    return PBFS_RES_SUCCESS;
+}
 
-        out = pbfs_write(mnt, cur_lba, sizeof(PBFS_DMM), &current);
-        if (out != PBFS_RES_SUCCESS) return out;
+static int refcount_load(struct pbfs_mount* mnt) {
+    uint32_t bs = mnt->header64.block_size;
+    uint64_t per_block = (bs - sizeof(PBFS_Refcount_Block)) / sizeof(PBFS_Refcount);
+    uint8_t block[bs];
+    PBFS_Refcount_Block* rb = (PBFS_Refcount_Block*)block;
 
-        return PBFS_RES_SUCCESS;
+    uint64_t lba = mnt->header64.refcount_lba;
+    while (lba != 0) {
+        if (lba <= 1 || lba >= mnt->header64.total_blocks || mnt->refcount_block_count >= mnt->header64.total_blocks) return PBFS_ERR_Invalid_Header;
+        int res = pbfs_read_block(mnt, lba, block);
+        if (res != PBFS_RES_SUCCESS) return res;
+        if (rb->count > per_block) return PBFS_ERR_Invalid_Header;
+
+        void* nptr = funcs.realloc(mnt->refcount_blocks, (mnt->refcount_block_count + 1) * sizeof(uint64_t));
+        if (!nptr) return PBFS_ERR_Allocation_Failed;
+        mnt->refcount_blocks = nptr;
+        mnt->refcount_blocks[mnt->refcount_block_count++] = lba;
+
+        if (rb->count > 0) {
+            nptr = funcs.realloc(mnt->refcounts, (mnt->refcount_count + rb->count) * sizeof(PBFS_Refcount));
+            if (!nptr) return PBFS_ERR_Allocation_Failed;
+            mnt->refcounts = nptr;
+            memcpy(mnt->refcounts + mnt->refcount_count, block + sizeof(PBFS_Refcount_Block), rb->count * sizeof(PBFS_Refcount));
+            mnt->refcount_count += rb->count;
+        }
+        lba = rb->next_lba;
     }
-
-    return PBFS_ERR_No_Space_Left;
+    return PBFS_RES_SUCCESS;
 }
 
-static int remove_dmm_entry(struct pbfs_mount* mnt, char* name_, uint64_t cur_dmm_lba) {
-    PBFS_DMM dmm = {0};
+// Writes the shared block table back if it changed. Blocks it is already in are reused, missing ones allocated and
+// surplus ones freed; every block is written before the one pointing at it, the header (when the first block changes) last.
+static int refcount_sync(struct pbfs_mount* mnt) {
+    if (!mnt->refcount_dirty) return PBFS_RES_SUCCESS;
+
+    uint32_t bs = mnt->header64.block_size;
+    uint64_t per_block = (bs - sizeof(PBFS_Refcount_Block)) / sizeof(PBFS_Refcount);
+    uint64_t need = (mnt->refcount_count + per_block - 1) / per_block;
+
+    if (need > mnt->refcount_block_count) {
+        void* nptr = funcs.realloc(mnt->refcount_blocks, need * sizeof(uint64_t));
+        if (!nptr) return PBFS_ERR_Allocation_Failed;
+        mnt->refcount_blocks = nptr;
+
+        while (mnt->refcount_block_count < need) {
+            uint64_t lba = bitmap_find_blocks(&mnt->root_bitmap64, mnt->header64.data_start_lba, 1, mnt);
+            if (lba <= 1) return PBFS_ERR_No_Space_Left;
+            bitmap_set(&mnt->root_bitmap, lba, mnt->header64.bitmap_lba, 0, mnt, 1);
+            mnt->refcount_blocks[mnt->refcount_block_count++] = lba;
+        }
+    }
 
-    uint64_t current_lba = cur_dmm_lba;
-    char name[PBFS_MAX_NAME_LEN];
-    path_basename(name_, name, PBFS_MAX_NAME_LEN);
+    uint8_t block[bs];
+    PBFS_Refcount_Block* rb = (PBFS_Refcount_Block*)block;
+    for (uint64_t i = need; i > 0; i--) {
+        uint64_t start = (i - 1) * per_block;
+        memset(block, 0, bs);
+        rb->count = mnt->refcount_count - start < per_block ? mnt->refcount_count - start : per_block;
+        rb->next_lba = i < need ? mnt->refcount_blocks[i] : 0;
+        memcpy(block + sizeof(PBFS_Refcount_Block), mnt->refcounts + start, rb->count * sizeof(PBFS_Refcount));
+        int res = pbfs_write_block(mnt, mnt->refcount_blocks[i - 1], block);
+        if (res != PBFS_RES_SUCCESS) return res;
+    }
 
-    for (int depth = 0; depth < PBFS_MAX_DMM_CHAIN; depth++) {
-        int out = pbfs_read(mnt, current_lba, sizeof(PBFS_DMM), &dmm);
-        if (out != PBFS_RES_SUCCESS) return out;
+    uint64_t head = need > 0 ? mnt->refcount_blocks[0] : 0;
+    if (head != mnt->header64.refcount_lba) {
+        int res = pbfs_read_block(mnt, PBFS_HDR_START_LBA, block);
+        if (res != PBFS_RES_SUCCESS) return res;
+        mnt->header.refcount_lba = head;
+        mnt->header64.refcount_lba = head;
+        memcpy(block, &mnt->header, sizeof(PBFS_Header));
+        res = pbfs_write_block(mnt, PBFS_HDR_START_LBA, block);
+        if (res != PBFS_RES_SUCCESS) return res;
+    }
 
-        int found_idx = -1;
-        for (uint32_t i = 0; i < dmm.entry_count; i++) {
-            if (strcmp(dmm.entries[i].name, name) == 0) {
-                found_idx = i;
-                break;
-            }
+    for (uint64_t i = need; i < mnt->refcount_block_count; i++) {
+        bitmap_set(&mnt->root_bitmap, mnt->refcount_blocks[i], mnt->header64.bitmap_lba, 0, mnt, 0);
+    }
+    mnt->refcount_block_count = need;
+    mnt->refcount_dirty = false;
+    return PBFS_RES_SUCCESS;
+}
+
+// Ends a batch of frees: the shared block table is written back (on failure it stays dirty for the next batch),
+// then the queued ranges are discarded
+static void discard_flush(struct pbfs_mount* mnt, struct discard_batch* batch) {
+    refcount_sync(mnt);
+    if (mnt->dev->discard) {
+        for (uint32_t i = 0; i < batch->used; i++) {
+            mnt->dev->discard(mnt->dev, mnt->partition_start_lba + batch->lba[i], batch->count[i]);
         }
+    }
+    batch->used = 0;
+}
 
-        if (found_idx != -1 && dmm.entry_count > 0) {
-            // Shift entries left to fill the gap
-            for (uint32_t i = found_idx; i < dmm.entry_count - 1; i++) {
-                dmm.entries[i] = dmm.entries[i + 1];
-            }
-            dmm.entry_count--;
-			memset(&dmm.entries[dmm.entry_count], 0, sizeof(PBFS_DMM_Entry));
+static void discard_queue(struct pbfs_mount* mnt, struct discard_batch* batch, uint64_t lba, uint64_t count) {
+    if (!mnt->dev->discard || count == 0) return;
 
-            // Write updated DMM block
-            return pbfs_write(mnt, current_lba, sizeof(PBFS_DMM), &dmm);
+    for (uint32_t i = 0; i < batch->used; i++) {
+        if (batch->lba[i] + batch->count[i] == lba) {
+            batch->count[i] += count;
+            return;
+        }
+        if (lba + count == batch->lba[i]) {
+            batch->lba[i] = lba;
+            batch->count[i] += count;
+            return;
         }
+    }
+
+    if (batch->used == PBFS_DISCARD_BATCH) discard_flush(mnt, batch);
+    batch->lba[batch->used] = lba;
+    batch->count[batch->used] = count;
+    batch->used++;
+}
 
-        if (UINT128_GT(dmm.extender_lba, UINT128_ZERO)) {
-            current_lba = uint128_to_u64(dmm.extender_lba);
+// Clears the bitmap bits of [lba, lba + count) and queues the range for discard.
+// Blocks other files still share (PBFS_FEATURE_REFLINK) only lose a reference, holes have none to free.
+static void free_blocks(struct pbfs_mount* mnt, uint64_t lba, uint64_t count, struct discard_batch* batch) {
+    if (lba == PBFS_EXTENT_HOLE) return;
+    while (count > 0) {
+        bool shared = false;
+        uint64_t len = refcount_span(mnt, lba, count, &shared);
+        if (shared) {
+            // Out of memory the blocks keep the reference: leaked, but never handed out while in use
+            refcount_adjust(mnt, lba, len, -1);
         } else {
-            break;
+            for (uint64_t i = 0; i < len; i++) {
+                bitmap_set(&mnt->root_bitmap, lba + i, mnt->header64.bitmap_lba, 0, mnt, 0);
+            }
+            discard_queue(mnt, batch, lba, len);
         }
+        lba += len;
+        count -= len;
     }
+}
 
-    return PBFS_ERR_File_Not_Found;
+// Extent list files (PBFS_FEATURE_EXTENTS): extents that fit in one block of the list, the first one shares the metadata block
+static uint64_t extent_list_cap(struct pbfs_mount* mnt, bool md_block) {
+    uint64_t off = md_block ? PBFS_EXTENT_LIST_OFFSET : 0;
+    return (mnt->header64.block_size - off - sizeof(PBFS_Extent_List)) / sizeof(PBFS_Extent);
 }
 
-static int find_dmm_entry(const char* path, PBFS_DMM_Entry* out, uint64_t* out_lba, struct pbfs_mount* mnt) {
-    char normalized[PBFS_MAX_PATH_LEN];
-    path_normalize((char*)path, normalized, PBFS_MAX_PATH_LEN);
+// Reads the extent list of the file at md_lba. *overflow (optional) = the overflow blocks holding it.
+// Both arrays are funcs.malloc'd for the caller, nothing is left allocated on failure.
+static int extents_load(struct pbfs_mount* mnt, uint64_t md_lba, PBFS_Extent** out, uint64_t* count, uint64_t** overflow, uint64_t* overflow_count) {
+    uint8_t block[mnt->header64.block_size];
+    PBFS_Extent* exts = NULL;
+    uint64_t* ovf = NULL;
+    uint64_t n = 0;
+    uint64_t ovf_n = 0;
+    int res = PBFS_RES_SUCCESS;
+
+    uint64_t lba = md_lba;
+    while (lba != 0 && res == PBFS_RES_SUCCESS) {
+        if (ovf_n > mnt->header64.total_blocks) { res = PBFS_ERR_Invalid_File_Or_Directory; break; }
+        res = pbfs_read_block(mnt, lba, block);
+        if (res != PBFS_RES_SUCCESS) break;
+
+        bool first = lba == md_lba;
+        PBFS_Extent_List* list = (PBFS_Extent_List*)(block + (first ? PBFS_EXTENT_LIST_OFFSET : 0));
+        if (list->count > extent_list_cap(mnt, first)) { res = PBFS_ERR_Invalid_File_Or_Directory; break; }
+
+        if (list->count > 0) {
+            void* nptr = funcs.realloc(exts, (n + list->count) * sizeof(PBFS_Extent));
+            if (!nptr) { res = PBFS_ERR_Allocation_Failed; break; }
+            exts = nptr;
+            memcpy(exts + n, (uint8_t*)list + sizeof(PBFS_Extent_List), list->count * sizeof(PBFS_Extent));
+            n += list->count;
+        }
 
-    // Root
-    if (strcmp(normalized, "/") == 0) {
-        return -1; // Root dmm
+        lba = list->next_lba;
+        if (lba != 0 && overflow) {
+            void* nptr = funcs.realloc(ovf, (ovf_n + 1) * sizeof(uint64_t));
+            if (!nptr) { res = PBFS_ERR_Allocation_Failed; break; }
+            ovf = nptr;
+            ovf[ovf_n++] = lba;
+        }
     }
 
-	lock_spinlock(&dmm_cache_lock);
-
-	dmm_cache[0] = mnt->header64.dmm_root_lba;
-    uint64_t current_dmm_lba = dmm_cache[0];
-    char part[PBFS_MAX_NAME_LEN];
-    int depth = 0;
-	int path_idx = 0;
-    int found = 0;
-
-    while (path_idx < PBFS_MAX_DMM_CHAIN) {
-        path_part(normalized, path_idx++, part, PBFS_MAX_NAME_LEN);
-        if (strlen(part) == 0) break;
+    if (res != PBFS_RES_SUCCESS) {
+        if (exts) funcs.free(exts);
+        if (ovf) funcs.free(ovf);
+        return res;
+    }
+    *out = exts;
+    *count = n;
+    if (overflow) {
+        *overflow = ovf;
+        *overflow_count = ovf_n;
+    }
+    return PBFS_RES_SUCCESS;
+}
 
-		if (strcmp(part, ".") == 0) {
-			continue;
-		} else if (strcmp(part, "..") == 0) {
-			if (depth > 0) depth--;
-			current_dmm_lba = dmm_cache[depth];
-			continue;
-		}
+// Gives back runs taken for data that never became part of a file, count 0 runs are skipped
+static void release_runs(struct pbfs_mount* mnt, const PBFS_Extent* runs, uint64_t n) {
+    for (uint64_t i = 0; i < n; i++) {
+        for (uint64_t j = 0; j < runs[i].count; j++) bitmap_set(&mnt->root_bitmap, runs[i].lba + j, mnt->header64.bitmap_lba, 0, mnt, 0);
+    }
+}
 
-        found = 0;
-        uint64_t iter_lba = current_dmm_lba;
-        for (int chain = 0; chain < PBFS_MAX_DMM_CHAIN && iter_lba > 0; chain++) {
-            PBFS_DMM dmm;
-            int out_res = pbfs_read(mnt, iter_lba, sizeof(PBFS_DMM), &dmm);
-            if (out_res != PBFS_RES_SUCCESS) {unlock_spinlock(&dmm_cache_lock); return out_res;}
-
-            for (uint32_t i = 0; i < dmm.entry_count; i++) {
-                if (strcmp(dmm.entries[i].name, part) == 0) {
-                    *out = dmm.entries[i];
-                    *out_lba = iter_lba;
-                    found = 1;
-                    break;
-                }
-            }
-            if (found) break;
-            iter_lba = uint128_to_u64(dmm.extender_lba);
+// Takes blocks free blocks in as few runs as it can find: the longest run that fits is halved until one is free,
+// and no later run is longer than the one before. *out is funcs.malloc'd, no bits stay set on failure.
+static int alloc_extents(struct pbfs_mount* mnt, uint64_t blocks, PBFS_Extent** out, uint64_t* count) {
+    PBFS_Extent* exts = NULL;
+    uint64_t n = 0;
+    uint64_t want = blocks;
+
+    while (blocks > 0) {
+        uint64_t len = want < blocks ? want : blocks;
+        uint64_t lba = 0;
+        while (len > 0 && (lba = bitmap_find_blocks(&mnt->root_bitmap64, mnt->header64.data_start_lba, len, mnt)) <= 1) len /= 2;
+
+        void* nptr = len > 0 ? funcs.realloc(exts, (n + 1) * sizeof(PBFS_Extent)) : NULL;
+        if (!nptr) {
+            if (exts) release_runs(mnt, exts, n);
+            if (exts) funcs.free(exts);
+            return len > 0 ? PBFS_ERR_Allocation_Failed : PBFS_ERR_No_Space_Left;
         }
-		if (!found && iter_lba > 0) {
-			unlock_spinlock(&dmm_cache_lock);
-			return PBFS_ERR_DMM_Corrupted;
-		}
+        exts = nptr;
+
+        for (uint64_t j = 0; j < len; j++) bitmap_set(&mnt->root_bitmap, lba + j, mnt->header64.bitmap_lba, 0, mnt, 1);
+        exts[n].lba = lba;
+        exts[n].count = len;
+        n++;
+        blocks -= len;
+        want = len;
+    }
 
-        if (!found) {unlock_spinlock(&dmm_cache_lock); return PBFS_ERR_File_Not_Found;}
+    *out = exts;
+    *count = n;
+    return PBFS_RES_SUCCESS;
+}
 
-        // If we have more parts to go, this must be a directory
-        char next_part[PBFS_MAX_NAME_LEN];
-        path_part(normalized, path_idx, next_part, PBFS_MAX_NAME_LEN);
-        if (strlen(next_part) > 0) {
-            if (!(out->type & METADATA_FLAG_DIR)) {unlock_spinlock(&dmm_cache_lock); return PBFS_ERR_Invalid_Path;}
-            PBFS_Metadata md = {0};
-            int out_res = pbfs_read(mnt, uint128_to_u64(out->lba), sizeof(PBFS_Metadata), &md);
-            if (out_res != PBFS_RES_SUCCESS) {unlock_spinlock(&dmm_cache_lock); return out_res;}
-            if (md.data_offset < 1) {
-				unlock_spinlock(&dmm_cache_lock);
-                return PBFS_ERR_Invalid_File_Or_Directory;
-            }
+// Writes md and the extent list into the metadata block at md_lba, the part that doesn't fit into overflow blocks.
+// Overflow blocks the file already has are reused (fresh = it has none yet), missing ones allocated, surplus ones freed.
+// Overflow blocks are written before the metadata block that points at them.
+static int extents_store(struct pbfs_mount* mnt, uint64_t md_lba, PBFS_Metadata* md, const PBFS_Extent* exts, uint64_t count, bool fresh, struct discard_batch* batch) {
+    uint64_t* ovf = NULL;
+    uint64_t ovf_n = 0;
+    if (!fresh) {
+        PBFS_Extent* old = NULL;
+        uint64_t old_n = 0;
+        int res = extents_load(mnt, md_lba, &old, &old_n, &ovf, &ovf_n);
+        if (res != PBFS_RES_SUCCESS) return res;
+        if (old) funcs.free(old);
+    }
 
-            current_dmm_lba = uint128_to_u64(out->lba) + md.data_offset;
-			dmm_cache[++depth] = current_dmm_lba;
+    uint64_t first_cap = extent_list_cap(mnt, true);
+    uint64_t cap = extent_list_cap(mnt, false);
+    uint64_t need = count > first_cap ? (count - first_cap + cap - 1) / cap : 0;
+
+    int res = PBFS_RES_SUCCESS;
+    uint64_t had = ovf_n;
+    if (need > ovf_n) {
+        void* nptr = funcs.realloc(ovf, need * sizeof(uint64_t));
+        if (!nptr) res = PBFS_ERR_Allocation_Failed;
+        else ovf = nptr;
+        for (uint64_t i = ovf_n; i < need && res == PBFS_RES_SUCCESS; i++) {
+            uint64_t lba = bitmap_find_blocks(&mnt->root_bitmap64, mnt->header64.data_start_lba, 1, mnt);
+            if (lba <= 1) { res = PBFS_ERR_No_Space_Left; break; }
+            bitmap_set(&mnt->root_bitmap, lba, mnt->header64.bitmap_lba, 0, mnt, 1);
+            ovf[ovf_n++] = lba;
         }
     }
 
-	unlock_spinlock(&dmm_cache_lock);
-    
-	if (out->type & METADATA_FLAG_SYMLINK) {
-		uint128_t psize = UINT128_ZERO;
-		int o = pbfs_read(mnt, *out_lba, sizeof(uint128_t), &psize);
-		if (o != PBFS_RES_SUCCESS) return o;
+    uint8_t block[mnt->header64.block_size];
+    for (uint64_t i = need; i > 0 && res == PBFS_RES_SUCCESS; i--) {
+        uint64_t start = first_cap + (i - 1) * cap;
+        PBFS_Extent_List* list = (PBFS_Extent_List*)block;
+        memset(block, 0, sizeof(block));
+        list->count = count - start < cap ? count - start : cap;
+        list->next_lba = i < need ? ovf[i] : 0;
+        memcpy(block + sizeof(PBFS_Extent_List), exts + start, list->count * sizeof(PBFS_Extent));
+        res = pbfs_write_block(mnt, ovf[i - 1], block);
+    }
 
-		char* buf = (char*)funcs.malloc(uint128_to_u64(psize) + sizeof(uint128_t));
-		if (!buf) return PBFS_ERR_Allocation_Failed;
+    if (res == PBFS_RES_SUCCESS) {
+        PBFS_Extent_List* list = (PBFS_Extent_List*)(block + PBFS_EXTENT_LIST_OFFSET);
+        memset(block, 0, sizeof(block));
+        memcpy(block, md, sizeof(PBFS_Metadata));
+        list->count = count < first_cap ? count : first_cap;
+        list->next_lba = need > 0 ? ovf[0] : 0;
+        memcpy((uint8_t*)list + sizeof(PBFS_Extent_List), exts, list->count * sizeof(PBFS_Extent));
+        res = pbfs_write_block(mnt, md_lba, block);
+    }
 
-		o = pbfs_read(mnt, *out_lba, sizeof(uint128_t) + uint128_to_u64(psize), buf);
-		char* data = buf + sizeof(uint128_t);
+    if (res == PBFS_RES_SUCCESS) {
+        for (uint64_t i = need; i < ovf_n; i++) free_blocks(mnt, ovf[i], 1, batch);
+    } else {
+        // The list on disk still ends where it did, overflow blocks taken for it go back
+        for (uint64_t i = had; i < ovf_n; i++) bitmap_set(&mnt->root_bitmap, ovf[i], mnt->header64.bitmap_lba, 0, mnt, 0);
+    }
+    if (ovf) funcs.free(ovf);
+    return res;
+}
 
-		o = find_dmm_entry((const char*)data, out, out_lba, mnt);
-		funcs.free(buf);
+// Metadata writes keep an extent list or inline data that shares the block
+static int md_write(struct pbfs_mount* mnt, uint64_t md_lba, PBFS_Metadata* md) {
+    if (md->data_offset != PBFS_DATA_OFFSET_EXTENTS && !(md->flags & METADATA_FLAG_INLINE)) {
+        return pbfs_write(mnt, md_lba, sizeof(PBFS_Metadata), md);
+    }
 
-		return o;
-	}
-	return PBFS_RES_SUCCESS;
+    uint8_t block[mnt->header64.block_size];
+    int res = pbfs_read_block(mnt, md_lba, block);
+    if (res != PBFS_RES_SUCCESS) return res;
+    memcpy(block, md, sizeof(PBFS_Metadata));
+    return pbfs_write_block(mnt, md_lba, block);
 }
 
-static int add_kernel_entry(struct pbfs_mount* mnt, PBFS_Kernel_Table* cur_kt, uint64_t cur_kt_lba, uint64_t lba, uint64_t blocks, const char* name, PBFS_Kernel_Flags flags) {
-    PBFS_Kernel_Table kt = *cur_kt;
-    PBFS_Kernel_Table64 kt64 = {0};
-    kernel_table_to_kernel_table64(&kt, &kt64);
-    PBFS_Kernel_Table* current = &kt;
-    PBFS_Kernel_Table64* current64 = &kt64;
-    uint64_t cur_lba = cur_kt_lba;
+// Bytes of data a file can keep in its metadata block, 0 = none
+static size_t inline_cap(struct pbfs_mount* mnt) {
+    if (!(mnt->header64.features & PBFS_FEATURE_INLINE_DATA)) return 0;
+    return mnt->header64.block_size - PBFS_INLINE_DATA_OFFSET;
+}
 
-    for (int depth = 0; depth < PBFS_MAX_KERNEL_CHAIN; depth++) {
-        // If there is space in current KT, add the entry
-        if (current->entry_count < PBFS_KERNEL_TABLE_ENTRIES) {
-            PBFS_Kernel_Entry* entry = &current->entries[current->entry_count];
-            entry->lba = uint128_from_u64(lba);
-            entry->count = uint128_from_u64(blocks);
-			entry->flags = flags;
-            strncpy(entry->name, name, sizeof(entry->name) - 1);
-            entry->name[sizeof(entry->name) - 1] = '\0';
-            current->entry_count++;
+// Writes md with data_size bytes of inline data as the whole metadata block at md_lba
+static int inline_store(struct pbfs_mount* mnt, uint64_t md_lba, PBFS_Metadata* md, const uint8_t* data, size_t data_size) {
+    uint8_t block[mnt->header64.block_size];
+    memset(block, 0, sizeof(block));
+    md->flags |= METADATA_FLAG_INLINE;
+    md->data_offset = 0;
+    md->data_size = uint128_from_u64(data_size);
+    md->extender_lba = UINT128_ZERO;
+    memcpy(block, md, sizeof(PBFS_Metadata));
+    memcpy(block + PBFS_INLINE_DATA_OFFSET, data, data_size);
+    return pbfs_write_block(mnt, md_lba, block);
+}
+
+// Frees a file's metadata + data blocks, following the metadata extender chain (or its extent list)
+static int free_file_blocks(struct pbfs_mount* mnt, uint64_t md_lba, struct discard_batch* batch) {
+    PBFS_Metadata md = {0};
+
+    while (md_lba != 0) {
+        int out = pbfs_read(mnt, md_lba, sizeof(PBFS_Metadata), &md);
+        if (out != PBFS_RES_SUCCESS) return out;
 
-            return pbfs_write(mnt, cur_lba, sizeof(PBFS_Kernel_Table), current);
+        if (md.flags & METADATA_FLAG_INLINE) {
+            free_blocks(mnt, md_lba, 1, batch);
+            return PBFS_RES_SUCCESS;
         }
 
-        // If current KT is full, check for extender
-        if (current64->extender_lba > 0) {
-            cur_lba = current64->extender_lba;
-            int out = pbfs_read(mnt, cur_lba, sizeof(PBFS_Kernel_Table), &kt);
+        if (md.data_offset == PBFS_DATA_OFFSET_EXTENTS) {
+            PBFS_Extent* exts = NULL;
+            uint64_t count = 0;
+            uint64_t* ovf = NULL;
+            uint64_t ovf_n = 0;
+            out = extents_load(mnt, md_lba, &exts, &count, &ovf, &ovf_n);
             if (out != PBFS_RES_SUCCESS) return out;
-            continue;
-        }
 
-        // Need to allocate a new extender block
-        PBFS_Kernel_Table new_extender = {0};
-        new_extender.entry_count = 1;
-        PBFS_Kernel_Entry* entry = &new_extender.entries[0];
-        entry->lba = uint128_from_u64(lba);
-        entry->count = uint128_from_u64(blocks);
-		entry->flags = flags;
-        strncpy(entry->name, name, sizeof(entry->name) - 1);
-        entry->name[sizeof(entry->name) - 1] = '\0';
+            for (uint64_t i = 0; i < count; i++) free_blocks(mnt, exts[i].lba, exts[i].count, batch);
+            for (uint64_t i = 0; i < ovf_n; i++) free_blocks(mnt, ovf[i], 1, batch);
+            free_blocks(mnt, md_lba, 1, batch);
+            if (exts) funcs.free(exts);
+            if (ovf) funcs.free(ovf);
+            return PBFS_RES_SUCCESS;
+        }
 
-        uint64_t new_ext_lba = bitmap_find_blocks(&mnt->root_bitmap64, mnt->header64.data_start_lba, 1, mnt);
-        if (new_ext_lba == 0) return PBFS_ERR_No_Space_Left;
+        uint64_t md_data_size = uint128_to_u64(md.data_size);
+        if (md.data_offset < 1 && md_data_size > 0) return PBFS_ERR_Invalid_File_Or_Directory;
 
-        // Write new extender to disk
-        int out = pbfs_write(mnt, new_ext_lba, sizeof(PBFS_Kernel_Table), &new_extender);
-        if (out != PBFS_RES_SUCCESS) return out;
-        bitmap_set(&mnt->root_bitmap, new_ext_lba, mnt->header64.bitmap_lba, 0, mnt, 1);
+        uint64_t data_blocks = ALIGN_UP(md_data_size, mnt->header64.block_size) / mnt->header64.block_size;
+        free_blocks(mnt, md_lba, (md.data_offset > 0 ? md.data_offset : 1) + data_blocks, batch);
 
-        // Link current DMM to extender
-        current->extender_lba = uint128_from_u64(new_ext_lba);
+        md_lba = uint128_to_u64(md.extender_lba);
+    }
+    return PBFS_RES_SUCCESS;
+}
 
-        out = pbfs_write(mnt, cur_lba, sizeof(PBFS_Kernel_Table), &current);
-        if (out != PBFS_RES_SUCCESS) return out;
+// count consecutive blocks in one device request when the driver has one
+static int read_span(struct pbfs_mount* mnt, uint64_t lba, uint64_t count, void* buffer) {
+    if (count > 1 && mnt->dev->read) {
+        mnt->dev->read(mnt->dev, mnt->partition_start_lba + lba, count, buffer);
+        return PBFS_RES_SUCCESS;
+    }
+    return pbfs_read(mnt, lba, count * mnt->header64.block_size, buffer);
+}
 
+static int write_span(struct pbfs_mount* mnt, uint64_t lba, uint64_t count, const void* buffer) {
+    if (count > 1 && mnt->dev->write) {
+        mnt->dev->write(mnt->dev, mnt->partition_start_lba + lba, count, buffer);
         return PBFS_RES_SUCCESS;
     }
+    return pbfs_write(mnt, lba, count * mnt->header64.block_size, (void*)buffer);
+}
 
-    return PBFS_ERR_No_Space_Left;
+// Whole blocks straight from data, the last partial one zero padded
+static int write_new_blocks(struct pbfs_mount* mnt, uint64_t lba, const uint8_t* data, size_t len) {
+    uint32_t bs = mnt->header64.block_size;
+    uint64_t full = len / bs;
+    if (full > 0) {
+        int res = write_span(mnt, lba, full, data);
+        if (res != PBFS_RES_SUCCESS) return res;
+    }
+    if (len % bs == 0) return PBFS_RES_SUCCESS;
+    return pbfs_write(mnt, lba + full, len % bs, (void*)(data + full * bs));
 }
 
-static int remove_kernel_entry(struct pbfs_mount* mnt, char* name_, uint64_t cur_kt_lba) {
-    PBFS_Kernel_Table kt = {0};
+// Replaces file->extents with the runs of an extent list file of size bytes (every run is full but the last one)
+static int file_set_runs(struct pbfs_mount* mnt, uint64_t md_lba, const PBFS_Extent* exts, uint64_t count, uint64_t size, struct pbfs_file* file) {
+    struct pbfs_file_extent* map = count ? funcs.malloc(count * sizeof(struct pbfs_file_extent)) : NULL;
+    if (count && !map) return PBFS_ERR_Allocation_Failed;
+
+    uint64_t offset = 0;
+    for (uint64_t i = 0; i < count; i++) {
+        uint64_t bytes = exts[i].count * mnt->header64.block_size;
+        map[i].md_lba = md_lba;
+        map[i].data_lba = exts[i].lba;
+        map[i].file_offset = offset;
+        map[i].size = bytes < size - offset ? bytes : size - offset;
+        offset += map[i].size;
+    }
 
-    uint64_t current_lba = cur_kt_lba;
-    char name[PBFS_MAX_NAME_LEN];
-    path_basename(name_, name, PBFS_MAX_NAME_LEN);
+    if (file->extents) funcs.free(file->extents);
+    file->extents = map;
+    file->extent_count = count;
+    file->size = offset;
+    return PBFS_RES_SUCCESS;
+}
 
-    for (int depth = 0; depth < PBFS_MAX_KERNEL_CHAIN; depth++) {
-        int out = pbfs_read(mnt, current_lba, sizeof(PBFS_Kernel_Table), &kt);
-        if (out != PBFS_RES_SUCCESS) return out;
+// Walks the metadata extender chain (or the extent list) of the file whose head metadata is md into file->extents
+static int file_map(struct pbfs_mount* mnt, uint64_t md_lba, PBFS_Metadata* md, struct pbfs_file* file) {
+    uint64_t cap = 0;
+    file->extents = NULL;
+    file->extent_count = 0;
+    file->size = 0;
+
+    // Inline data is one extent inside the metadata block (data_lba == md_lba)
+    if (md->flags & METADATA_FLAG_INLINE) {
+        uint64_t size = uint128_to_u64(md->data_size);
+        if (size > mnt->header64.block_size - PBFS_INLINE_DATA_OFFSET) return PBFS_ERR_Invalid_File_Or_Directory;
+
+        file->extents = funcs.malloc(sizeof(struct pbfs_file_extent));
+        if (!file->extents) return PBFS_ERR_Allocation_Failed;
+        file->extents[0].md_lba = md_lba;
+        file->extents[0].data_lba = md_lba;
+        file->extents[0].file_offset = 0;
+        file->extents[0].size = size;
+        file->extent_count = 1;
+        file->size = size;
+        return PBFS_RES_SUCCESS;
+    }
 
-        int found_idx = -1;
-        for (uint32_t i = 0; i < kt.entry_count; i++) {
-            if (strcmp(kt.entries[i].name, name) == 0) {
-                found_idx = i;
-                break;
-            }
-        }
+    if (md->data_offset == PBFS_DATA_OFFSET_EXTENTS) {
+        PBFS_Extent* exts = NULL;
+        uint64_t count = 0;
+        int res = extents_load(mnt, md_lba, &exts, &count, NULL, NULL);
+        if (res != PBFS_RES_SUCCESS) return res;
 
-        if (found_idx != -1) {
-            // Shift entries left to fill the gap
-            for (uint32_t i = found_idx; i < kt.entry_count - 1; i++) {
-                kt.entries[i] = kt.entries[i + 1];
-            }
-            kt.entry_count--;
+        res = file_set_runs(mnt, md_lba, exts, count, uint128_to_u64(md->data_size), file);
+        if (exts) funcs.free(exts);
+        if (res != PBFS_RES_SUCCESS) return res;
+        return count ? PBFS_RES_SUCCESS : PBFS_ERR_Invalid_File_Or_Directory;
+    }
 
-            // Write updated KT block
-            return pbfs_write(mnt, current_lba, sizeof(PBFS_Kernel_Table), &kt);
+    PBFS_Metadata cur = *md;
+    while (md_lba != 0) {
+        uint64_t size = uint128_to_u64(cur.data_size);
+        if (cur.data_offset < 1 && size > 0) return PBFS_ERR_Invalid_File_Or_Directory;
+        if (file->extent_count >= mnt->header64.total_blocks) return PBFS_ERR_Invalid_File_Or_Directory;
+
+        if (file->extent_count >= cap) {
+            cap = cap ? cap * 2 : 4;
+            void* nptr = funcs.realloc(file->extents, cap * sizeof(struct pbfs_file_extent));
+            if (!nptr) return PBFS_ERR_Allocation_Failed;
+            file->extents = nptr;
         }
 
-        if (UINT128_GT(kt.extender_lba, UINT128_ZERO)) {
-            current_lba = uint128_to_u64(kt.extender_lba);
-        } else {
-            break;
-        }
-    }
+        struct pbfs_file_extent* ext = &file->extents[file->extent_count++];
+        ext->md_lba = md_lba;
+        ext->data_lba = md_lba + cur.data_offset;
+        ext->file_offset = file->size;
+        ext->size = size;
+        file->size += size;
 
-    return PBFS_ERR_File_Not_Found;
+        md_lba = uint128_to_u64(cur.extender_lba);
+        if (md_lba == 0) break;
+        int res = pbfs_read(mnt, md_lba, sizeof(PBFS_Metadata), &cur);
+        if (res != PBFS_RES_SUCCESS) return res;
+    }
+    return PBFS_RES_SUCCESS;
 }
 
-static int find_kernel_entry(const char* path, PBFS_Kernel_Entry* out, uint64_t* out_lba, struct pbfs_mount* mnt) {
-    char normalized[PBFS_MAX_PATH_LEN];
-    path_normalize((char*)path, normalized, PBFS_MAX_PATH_LEN);
-
-    // Root
-    if (strcmp(normalized, "/") == 0) {
-        return -1; // Root dmm
+// Last extent starting at or before offset
+static uint64_t file_extent_at(struct pbfs_file* file, uint64_t offset) {
+    uint64_t lo = 0;
+    uint64_t hi = file->extent_count;
+    while (hi - lo > 1) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (file->extents[mid].file_offset <= offset) lo = mid;
+        else hi = mid;
     }
+    return lo;
+}
 
-    uint64_t current_kt_lba = mnt->header64.kernel_table_lba;
-    char part[PBFS_MAX_NAME_LEN];
-    int depth = 0;
-    int found = 0;
+// Moves len bytes between buf and the extent starting at byte ext_off of it: whole blocks go
+// straight to/from buf, partial ones through a block buffer (read-modify-write for writes)
+static int extent_io(struct pbfs_mount* mnt, struct pbfs_file_extent* ext, uint64_t ext_off, size_t len, uint8_t* buf, bool write) {
+    uint32_t bs = mnt->header64.block_size;
+    uint8_t block[bs];
+    if (ext->data_lba == ext->md_lba) ext_off += PBFS_INLINE_DATA_OFFSET;
+
+    // Holes read as zeros without touching the device, writes need blocks there first (file_unshare)
+    if (ext->data_lba == PBFS_EXTENT_HOLE) {
+        if (write) return PBFS_ERR_Invalid_File_Or_Directory;
+        memset(buf, 0, len);
+        return PBFS_RES_SUCCESS;
+    }
 
-    while (depth < PBFS_MAX_KERNEL_CHAIN) {
-        path_part(normalized, depth++, part, PBFS_MAX_NAME_LEN);
-        if (strlen(part) == 0) break;
+    while (len > 0) {
+        uint64_t lba = ext->data_lba + ext_off / bs;
+        uint32_t in_block = ext_off % bs;
+
+        if (in_block == 0 && len >= bs) {
+            uint64_t count = len / bs;
+            int res = write ? write_span(mnt, lba, count, buf) : read_span(mnt, lba, count, buf);
+            if (res != PBFS_RES_SUCCESS) return res;
+            buf += count * bs;
+            ext_off += count * bs;
+            len -= count * bs;
+            continue;
+        }
 
-        found = 0;
-        uint64_t iter_lba = current_kt_lba;
-        while (iter_lba > 0) {
-            PBFS_Kernel_Table kt;
-            int out_res = pbfs_read(mnt, iter_lba, sizeof(PBFS_Kernel_Table), &kt);
-            if (out_res != PBFS_RES_SUCCESS) return out_res;
+        size_t part = bs - in_block;
+        if (part > len) part = len;
 
-            for (uint32_t i = 0; i < kt.entry_count; i++) {
-                if (strcmp(kt.entries[i].name, part) == 0) {
-                    *out = kt.entries[i];
-                    *out_lba = iter_lba;
-                    found = 1;
-                    break;
-                }
-            }
-            if (found) break;
-            iter_lba = uint128_to_u64(kt.extender_lba);
+        int res = pbfs_read_block(mnt, lba, block);
+        if (res != PBFS_RES_SUCCESS) return res;
+        if (write) {
+            memcpy(block + in_block, buf, part);
+            res = pbfs_write_block(mnt, lba, block);
+            if (res != PBFS_RES_SUCCESS) return res;
+        } else {
+            memcpy(buf, block + in_block, part);
         }
-
-        if (!found) return PBFS_ERR_File_Not_Found;
+        buf += part;
+        ext_off += part;
+        len -= part;
     }
     return PBFS_RES_SUCCESS;
 }
 
-static int retrieve_dir_dmm(int find_res, PBFS_DMM_Entry* dmme, PBFS_DMM* out, uint64_t* out_lba, struct pbfs_mount* mnt) {
-    if (find_res != -1 && find_res != PBFS_RES_SUCCESS) return find_res;
-    if (find_res == -1) {
-        int res = pbfs_read(mnt, mnt->header64.dmm_root_lba, sizeof(PBFS_DMM), out);
-        if (res != PBFS_RES_SUCCESS) return res;
-        *out_lba = mnt->header64.dmm_root_lba;
+// Called per extent by extents_each, data = the extent's bytes when they are already in memory (inline data)
+typedef int (*extent_fn)(struct pbfs_mount* mnt, struct pbfs_file_extent* ext, const uint8_t* data, void* ctx);
+
+// Calls fn for every extent of the file whose metadata block is in block, in file order. Allocates nothing:
+// extender metadata and extent list overflow blocks are read one at a time, block is reused for the latter.
+static int extents_each(struct pbfs_mount* mnt, uint64_t md_lba, uint8_t* block, extent_fn fn, void* ctx) {
+    uint32_t bs = mnt->header64.block_size;
+    PBFS_Metadata md;
+    memcpy(&md, block, sizeof(PBFS_Metadata));
+    uint64_t size = uint128_to_u64(md.data_size);
+    struct pbfs_file_extent ext = {md_lba, md_lba, 0, size};
+
+    if (md.flags & METADATA_FLAG_INLINE) {
+        if (size > bs - PBFS_INLINE_DATA_OFFSET) return PBFS_ERR_Invalid_File_Or_Directory;
+        return fn(mnt, &ext, block + PBFS_INLINE_DATA_OFFSET, ctx);
+    }
+
+    if (md.data_offset == PBFS_DATA_OFFSET_EXTENTS) {
+        uint64_t lba = md_lba;
+        uint64_t blocks = 0;
+        uint64_t runs = 0;
+        while (lba != 0) {
+            if (blocks++ > mnt->header64.total_blocks) return PBFS_ERR_Invalid_File_Or_Directory;
+            bool first = lba == md_lba;
+            if (!first) {
+                int res = pbfs_read_block(mnt, lba, block);
+                if (res != PBFS_RES_SUCCESS) return res;
+            }
+
+            PBFS_Extent_List* list = (PBFS_Extent_List*)(block + (first ? PBFS_EXTENT_LIST_OFFSET : 0));
+            if (list->count > extent_list_cap(mnt, first)) return PBFS_ERR_Invalid_File_Or_Directory;
+            PBFS_Extent* exts = (PBFS_Extent*)((uint8_t*)list + sizeof(PBFS_Extent_List));
+            lba = list->next_lba;
+
+            for (uint32_t i = 0; i < list->count; i++) {
+                uint64_t bytes = exts[i].count * bs;
+                ext.data_lba = exts[i].lba;
+                ext.size = bytes < size - ext.file_offset ? bytes : size - ext.file_offset;
+                int res = fn(mnt, &ext, NULL, ctx);
+                if (res != PBFS_RES_SUCCESS) return res;
+                ext.file_offset += ext.size;
+                runs++;
+            }
+        }
+        return runs ? PBFS_RES_SUCCESS : PBFS_ERR_Invalid_File_Or_Directory;
+    }
+
+    for (uint64_t hops = 0; ; hops++) {
+        if (md.data_offset < 1 && size > 0) return PBFS_ERR_Invalid_File_Or_Directory;
+        if (hops >= mnt->header64.total_blocks) return PBFS_ERR_Invalid_File_Or_Directory;
+
+        ext.md_lba = md_lba;
+        ext.data_lba = md_lba + md.data_offset;
+        ext.size = size;
+        int res = fn(mnt, &ext, NULL, ctx);
+        if (res != PBFS_RES_SUCCESS) return res;
+        ext.file_offset += size;
+
+        md_lba = uint128_to_u64(md.extender_lba);
+        if (md_lba == 0) break;
+        res = pbfs_read(mnt, md_lba, sizeof(PBFS_Metadata), &md);
+        if (res != PBFS_RES_SUCCESS) return res;
+        size = uint128_to_u64(md.data_size);
+    }
+    return PBFS_RES_SUCCESS;
+}
+
+// pbfs_read_file_into: the extents that fit go straight into the caller's buffer, total counts all of them
+struct read_into {
+    uint8_t* buf;
+    size_t buf_size;
+    uint64_t total;
+};
+
+static int read_into_extent(struct pbfs_mount* mnt, struct pbfs_file_extent* ext, const uint8_t* data, void* ctx) {
+    struct read_into* r = ctx;
+    uint64_t off = r->total;
+    r->total += ext->size;
+    if (r->total > r->buf_size) return PBFS_RES_SUCCESS;
+    if (data) {
+        memcpy(r->buf + off, data, ext->size);
+        return PBFS_RES_SUCCESS;
+    }
+    return extent_io(mnt, ext, 0, ext->size, r->buf + off, false);
+}
+
+// pbfs_*_stream: each extent goes to the sink in chunks of the caller's scratch buffer
+struct read_stream {
+    uint8_t* buf;
+    size_t chunk;
+    pbfs_sink sink;
+    void* sink_ctx;
+};
+
+static int read_stream_extent(struct pbfs_mount* mnt, struct pbfs_file_extent* ext, const uint8_t* data, void* ctx) {
+    struct read_stream* s = ctx;
+    if (data) return ext->size ? s->sink(s->sink_ctx, data, ext->size) : PBFS_RES_SUCCESS;
+
+    for (uint64_t off = 0; off < ext->size; ) {
+        size_t part = ext->size - off < s->chunk ? ext->size - off : s->chunk;
+        int res = extent_io(mnt, ext, off, part, s->buf, false);
+        if (res == PBFS_RES_SUCCESS) res = s->sink(s->sink_ctx, s->buf, part);
+        if (res != PBFS_RES_SUCCESS) return res;
+        off += part;
+    }
+    return PBFS_RES_SUCCESS;
+}
+
+// Whole blocks of the scratch buffer when it holds at least one, so chunks stay block aligned
+static size_t stream_chunk(struct pbfs_mount* mnt, size_t buf_size) {
+    uint32_t bs = mnt->header64.block_size;
+    return buf_size >= bs ? buf_size - buf_size % bs : buf_size;
+}
+
+// In-tree LZ4 block format codec for packed data (PBFS_FEATURE_COMPRESSION), nothing but memcpy/memset needed
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_LOG 13
+#define LZ_LAST_LITERALS 5 // A block ends in at least this many literals
+#define LZ_MF_LIMIT 12 // and its last match starts at least this far from the end
+#define LZ_TABLE_SIZE (sizeof(uint16_t) << LZ_HASH_LOG)
+
+static uint32_t lz_read32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t lz_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_LOG);
+}
+
+// Length past the 15 a token holds, 255 a byte
+static uint8_t* lz_put_len(uint8_t* op, size_t len) {
+    for (; len >= 255; len -= 255) *op++ = 255;
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+// Compresses n (<= PBFS_COMPRESS_CHUNK) bytes into at most cap bytes of dst, 0 if they don't fit.
+// table is LZ_TABLE_SIZE bytes of scratch. Misses make it skip ahead faster, so data that doesn't compress costs little.
+static size_t lz_compress(const uint8_t* src, size_t n, uint8_t* dst, size_t cap, uint16_t* table) {
+    const uint8_t* ip = src;
+    const uint8_t* anchor = src;
+    const uint8_t* iend = src + n;
+    uint8_t* op = dst;
+    uint8_t* oend = dst + cap;
+    memset(table, 0, LZ_TABLE_SIZE);
+
+    if (n > LZ_MF_LIMIT) {
+        const uint8_t* mflimit = iend - LZ_MF_LIMIT;
+        const uint8_t* mlimit = iend - LZ_LAST_LITERALS;
+        uint32_t misses = 0;
+        ip++;
+        while (ip < mflimit) {
+            uint32_t h = lz_hash(lz_read32(ip));
+            const uint8_t* ref = src + table[h];
+            table[h] = (uint16_t)(ip - src);
+            if (lz_read32(ref) != lz_read32(ip) || ref >= ip) {
+                ip += 1 + (misses++ >> 6);
+                continue;
+            }
+            misses = 0;
+
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const uint8_t* mp = ip + LZ_MIN_MATCH;
+            const uint8_t* rp = ref + LZ_MIN_MATCH;
+            while (mp < mlimit && *mp == *rp) {
+                mp++;
+                rp++;
+            }
+
+            size_t lit = ip - anchor;
+            size_t ml = mp - ip - LZ_MIN_MATCH;
+            if ((size_t)(oend - op) < 1 + lit / 255 + 1 + lit + 2 + ml / 255 + 1) return 0;
+            uint8_t* token = op++;
+            *token = (uint8_t)((lit >= 15 ? 15 : lit) << 4);
+            if (lit >= 15) op = lz_put_len(op, lit - 15);
+            memcpy(op, anchor, lit);
+            op += lit;
+
+            size_t off = ip - ref;
+            *op++ = (uint8_t)off;
+            *op++ = (uint8_t)(off >> 8);
+            *token |= (uint8_t)(ml >= 15 ? 15 : ml);
+            if (ml >= 15) op = lz_put_len(op, ml - 15);
+
+            ip = anchor = mp;
+            if (ip < mflimit) table[lz_hash(lz_read32(ip - 2))] = (uint16_t)(ip - 2 - src);
+        }
+    }
+
+    size_t lit = iend - anchor;
+    if ((size_t)(oend - op) < 1 + lit / 255 + 1 + lit) return 0;
+    uint8_t* token = op++;
+    *token = (uint8_t)((lit >= 15 ? 15 : lit) << 4);
+    if (lit >= 15) op = lz_put_len(op, lit - 15);
+    memcpy(op, anchor, lit);
+    op += lit;
+    return op - dst;
+}
+
+// Length extension bytes after a token nibble of 15, false if they run past the end
+static bool lz_get_len(const uint8_t** ip, const uint8_t* iend, size_t* len) {
+    uint8_t b;
+    do {
+        if (*ip >= iend) return false;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return true;
+}
+
+// Decompresses n bytes of src into exactly cap bytes of dst, every read and write bounds checked:
+// anything corrupt or short is PBFS_ERR_Invalid_File_Or_Directory
+static int lz_decompress(const uint8_t* src, size_t n, uint8_t* dst, size_t cap) {
+    const uint8_t* ip = src;
+    const uint8_t* iend = src + n;
+    uint8_t* op = dst;
+    uint8_t* oend = dst + cap;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        size_t lit = token >> 4;
+        if (lit == 15 && !lz_get_len(&ip, iend, &lit)) return PBFS_ERR_Invalid_File_Or_Directory;
+        if ((size_t)(iend - ip) < lit || (size_t)(oend - op) < lit) return PBFS_ERR_Invalid_File_Or_Directory;
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == iend) break; // The last sequence has no match
+
+        if (iend - ip < 2) return PBFS_ERR_Invalid_File_Or_Directory;
+        size_t off = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        size_t ml = token & 15;
+        if (ml == 15 && !lz_get_len(&ip, iend, &ml)) return PBFS_ERR_Invalid_File_Or_Directory;
+        ml += LZ_MIN_MATCH;
+        if (off == 0 || off > (size_t)(op - dst) || (size_t)(oend - op) < ml) return PBFS_ERR_Invalid_File_Or_Directory;
+
+        const uint8_t* ref = op - off;
+        if (off >= ml) {
+            memcpy(op, ref, ml);
+            op += ml;
+        } else {
+            // Overlapping: the match repeats the last off bytes
+            for (size_t i = 0; i < ml; i++) *op++ = *ref++;
+        }
+    }
+    return op == oend ? PBFS_RES_SUCCESS : PBFS_ERR_Invalid_File_Or_Directory;
+}
+
+// Packs n (1..PBFS_COMPRESS_CHUNK) bytes as one chunk, header included, into dst (room for n and the header):
+// compressed when that is smaller, as they are otherwise. Returns the bytes written.
+static size_t pack_chunk(const uint8_t* src, size_t n, uint8_t* dst, uint16_t* table) {
+    PBFS_Compressed_Chunk hdr = {0, (uint32_t)n};
+    size_t packed = lz_compress(src, n, dst + sizeof(hdr), n - 1, table);
+    if (packed == 0) {
+        memcpy(dst + sizeof(hdr), src, n);
+        packed = n;
+    }
+    hdr.stored = (uint32_t)packed;
+    memcpy(dst, &hdr, sizeof(hdr));
+    return sizeof(hdr) + packed;
+}
+
+// Checks a trailer against the stored size of the data it ends (or, for kernels, the blocks they take)
+static int trailer_check(const PBFS_Compressed_Trailer* t, uint64_t stored) {
+    if (t->magic != PBFS_COMPRESS_MAGIC || t->chunk_size == 0 || t->chunk_size > PBFS_COMPRESS_CHUNK) return PBFS_ERR_Invalid_File_Or_Directory;
+    if (t->chunk_count != (t->size + t->chunk_size - 1) / t->chunk_size) return PBFS_ERR_Invalid_File_Or_Directory;
+    if (stored < sizeof(PBFS_Compressed_Trailer) + sizeof(PBFS_Compressed_Chunk)) return PBFS_ERR_Invalid_File_Or_Directory;
+    if (t->chunk_count > (stored - sizeof(PBFS_Compressed_Trailer) - sizeof(PBFS_Compressed_Chunk)) / sizeof(uint64_t)) return PBFS_ERR_Invalid_File_Or_Directory;
+    return PBFS_RES_SUCCESS;
+}
+
+// Unpacks packed data handed over in pieces of any size, as the sink of a streamed read: each chunk is gathered
+// in stage, then unpacked to out and handed on to sink, or without a sink to dst at its unpacked offset
+// (chunks past dst_size are only counted). Stops taking data at the zero header.
+struct unpack {
+    uint8_t* stage; // Header and bytes of the chunk being gathered
+    uint8_t* out; // PBFS_COMPRESS_CHUNK bytes
+    uint8_t* dst;
+    size_t dst_size;
+    pbfs_sink sink;
+    void* sink_ctx;
+    PBFS_Compressed_Chunk hdr;
+    size_t have; // Bytes of stage gathered
+    uint64_t size; // Unpacked so far
+    bool done;
+};
+
+static int unpack_chunk(struct unpack* u) {
+    const uint8_t* src = u->stage + sizeof(PBFS_Compressed_Chunk);
+    uint32_t size = u->hdr.size;
+    uint64_t off = u->size;
+    u->size += size;
+    if (!u->sink && u->size > u->dst_size) return PBFS_RES_SUCCESS;
+
+    uint8_t* to = u->sink ? u->out : u->dst + off;
+    if (u->hdr.stored == size) {
+        if (u->sink) return u->sink(u->sink_ctx, src, size);
+        memcpy(to, src, size);
         return PBFS_RES_SUCCESS;
+    }
+    int res = lz_decompress(src, u->hdr.stored, to, size);
+    if (res != PBFS_RES_SUCCESS || !u->sink) return res;
+    return u->sink(u->sink_ctx, to, size);
+}
+
+static int unpack_sink(void* ctx, const uint8_t* data, size_t len) {
+    struct unpack* u = ctx;
+    while (len > 0 && !u->done) {
+        bool header = u->have < sizeof(PBFS_Compressed_Chunk);
+        size_t need = sizeof(PBFS_Compressed_Chunk) + (header ? 0 : u->hdr.stored);
+        size_t part = need - u->have < len ? need - u->have : len;
+        memcpy(u->stage + u->have, data, part);
+        u->have += part;
+        data += part;
+        len -= part;
+        if (u->have < need) break;
+
+        if (header) {
+            memcpy(&u->hdr, u->stage, sizeof(PBFS_Compressed_Chunk));
+            if (u->hdr.stored == 0 && u->hdr.size == 0) u->done = true;
+            else if (u->hdr.size > PBFS_COMPRESS_CHUNK || u->hdr.stored == 0 || u->hdr.stored > u->hdr.size) return PBFS_ERR_Invalid_File_Or_Directory;
+            continue;
+        }
+        int res = unpack_chunk(u);
+        if (res != PBFS_RES_SUCCESS) return res;
+        u->have = 0;
+    }
+    return PBFS_RES_SUCCESS;
+}
+
+// Packs size bytes whole into a new allocation: the chunks, zero padding up to align (1 or the block size for kernels,
+// so the trailer ends the last block), the zero header, the chunk table and the trailer
+static int pack_image(const uint8_t* data, size_t size, uint32_t align, uint8_t** out, size_t* out_size) {
+    uint64_t chunks = (size + PBFS_COMPRESS_CHUNK - 1) / PBFS_COMPRESS_CHUNK;
+    size_t cap = ALIGN_UP(size + chunks * (sizeof(PBFS_Compressed_Chunk) + sizeof(uint64_t)) + sizeof(PBFS_Compressed_Chunk) + sizeof(PBFS_Compressed_Trailer), align);
+    uint8_t* img = funcs.malloc(cap);
+    uint16_t* table = funcs.malloc(LZ_TABLE_SIZE);
+    if (!img || !table) {
+        if (img) funcs.free(img);
+        if (table) funcs.free(table);
+        return PBFS_ERR_Allocation_Failed;
+    }
+
+    size_t pos = 0;
+    for (uint64_t i = 0; i < chunks; i++) {
+        size_t n = size - i * PBFS_COMPRESS_CHUNK < PBFS_COMPRESS_CHUNK ? size - i * PBFS_COMPRESS_CHUNK : PBFS_COMPRESS_CHUNK;
+        pos += pack_chunk(data + i * PBFS_COMPRESS_CHUNK, n, img + pos, table);
+    }
+    funcs.free(table);
+
+    // The table is found again by walking the chunk headers
+    size_t end = ALIGN_UP(pos + sizeof(PBFS_Compressed_Chunk) + chunks * sizeof(uint64_t) + sizeof(PBFS_Compressed_Trailer), align);
+    size_t table_pos = end - sizeof(PBFS_Compressed_Trailer) - chunks * sizeof(uint64_t);
+    memset(img + pos, 0, table_pos - pos);
+    uint64_t off = 0;
+    for (uint64_t i = 0; i < chunks; i++) {
+        PBFS_Compressed_Chunk hdr;
+        memcpy(img + table_pos + i * sizeof(uint64_t), &off, sizeof(uint64_t));
+        memcpy(&hdr, img + off, sizeof(hdr));
+        off += sizeof(hdr) + hdr.stored;
+    }
+    PBFS_Compressed_Trailer t = {size, chunks, PBFS_COMPRESS_CHUNK, PBFS_COMPRESS_MAGIC};
+    memcpy(img + end - sizeof(t), &t, sizeof(t));
+
+    *out = img;
+    *out_size = end;
+    return PBFS_RES_SUCCESS;
+}
+
+// Runs packed data through u: count extents of it, or every extent of the file whose metadata block is in block
+// when exts is NULL. Stage and out come from the end of buf when it has room for them and a block to read into,
+// otherwise they are allocated (and a read buffer with them when there is no buf).
+static int unpack_read(struct pbfs_mount* mnt, struct pbfs_file_extent* exts, uint64_t count, uint64_t md_lba, uint8_t* block, uint8_t* buf, size_t buf_size, struct unpack* u) {
+    uint8_t* mem = NULL;
+    if (buf_size >= PBFS_COMPRESS_SCRATCH + mnt->header64.block_size) {
+        buf_size -= PBFS_COMPRESS_SCRATCH;
+        u->stage = buf + buf_size;
+    } else {
+        size_t extra = buf_size ? 0 : PBFS_COMPRESS_CHUNK;
+        mem = funcs.malloc(PBFS_COMPRESS_SCRATCH + extra);
+        if (!mem) return PBFS_ERR_Allocation_Failed;
+        u->stage = mem;
+        if (!buf_size) {
+            buf = mem + PBFS_COMPRESS_SCRATCH;
+            buf_size = extra;
+        }
+    }
+    u->out = u->stage + sizeof(PBFS_Compressed_Chunk) + PBFS_COMPRESS_CHUNK;
+
+    struct read_stream s = {buf, stream_chunk(mnt, buf_size), unpack_sink, u};
+    int out = PBFS_RES_SUCCESS;
+    if (exts) {
+        for (uint64_t i = 0; i < count && out == PBFS_RES_SUCCESS && !u->done; i++) out = read_stream_extent(mnt, &exts[i], NULL, &s);
+    } else {
+        out = extents_each(mnt, md_lba, block, read_stream_extent, &s);
+    }
+    if (out == PBFS_RES_SUCCESS && !u->done) out = PBFS_ERR_Invalid_File_Or_Directory;
+    if (mem) funcs.free(mem);
+    return out;
+}
+
+// Packed unless inline, inline data is always kept as it is
+static bool md_packed(const PBFS_Metadata* md) {
+    return (md->flags & METADATA_FLAG_COMPRESSED) && !(md->flags & METADATA_FLAG_INLINE);
+}
+
+// Reads len stored bytes at offset of an open file through its extent map, len must not run past the end
+static int file_read_stored(struct pbfs_file* file, uint64_t offset, size_t len, void* buf) {
+    size_t done = 0;
+    for (uint64_t i = file_extent_at(file, offset); i < file->extent_count && done < len; i++) {
+        struct pbfs_file_extent* ext = &file->extents[i];
+        uint64_t pos = offset + done;
+        if (pos >= ext->file_offset + ext->size) continue;
+
+        uint64_t ext_off = pos - ext->file_offset;
+        size_t part = ext->size - ext_off;
+        if (part > len - done) part = len - done;
+
+        int res = extent_io(file->mnt, ext, ext_off, part, (uint8_t*)buf + done, false);
+        if (res != PBFS_RES_SUCCESS) return res;
+        done += part;
+    }
+    return done == len ? PBFS_RES_SUCCESS : PBFS_ERR_Invalid_File_Or_Directory;
+}
+
+// Unpacked size of a packed file, from the trailer that ends its stored data
+static int packed_size(struct pbfs_mount* mnt, uint64_t md_lba, PBFS_Metadata* md, uint64_t* size) {
+    PBFS_Compressed_Trailer t;
+    struct pbfs_file file = {0};
+    file.mnt = mnt;
+    int out = file_map(mnt, md_lba, md, &file);
+    if (out == PBFS_RES_SUCCESS) out = file.size >= sizeof(t) ? file_read_stored(&file, file.size - sizeof(t), sizeof(t), &t) : PBFS_ERR_Invalid_File_Or_Directory;
+    if (out == PBFS_RES_SUCCESS) out = trailer_check(&t, file.size);
+    if (file.extents) funcs.free(file.extents);
+    if (out != PBFS_RES_SUCCESS) return out;
+    *size = t.size;
+    return PBFS_RES_SUCCESS;
+}
+
+// Turns an open file kept in a metadata extender chain into an extent list file over the same data blocks:
+// the head metadata block takes the list, extender metadata blocks are freed. Inline data moves to a block of its own.
+static int file_make_listed(struct pbfs_file* file) {
+    struct pbfs_mount* mnt = file->mnt;
+    uint32_t bs = mnt->header64.block_size;
+    if (file->md.data_offset == PBFS_DATA_OFFSET_EXTENTS) return PBFS_RES_SUCCESS;
+    if (!(mnt->header64.features & PBFS_FEATURE_EXTENTS)) return PBFS_ERR_Wrong_Type;
+    if (file->size == 0) return PBFS_ERR_No_Data;
+
+    // A list has no room for a partly used block before the last one
+    for (uint64_t i = 0; i + 1 < file->extent_count; i++) {
+        if (file->extents[i].size % bs != 0) return PBFS_ERR_Data_Unaligned;
+    }
+
+    PBFS_Extent* exts = funcs.malloc(file->extent_count * sizeof(PBFS_Extent));
+    if (!exts) return PBFS_ERR_Allocation_Failed;
+    uint64_t n = 0;
+    uint64_t md_lba = file->extents[0].md_lba;
+    bool was_inline = file->md.flags & METADATA_FLAG_INLINE;
+
+    if (was_inline) {
+        PBFS_Extent* run = NULL;
+        uint64_t run_n = 0;
+        int res = alloc_extents(mnt, 1, &run, &run_n);
+        if (res != PBFS_RES_SUCCESS) { funcs.free(exts); return res; }
+        exts[n++] = run[0];
+        funcs.free(run);
+
+        uint8_t block[bs];
+        res = pbfs_read_block(mnt, md_lba, block);
+        if (res == PBFS_RES_SUCCESS) res = write_new_blocks(mnt, exts[0].lba, block + PBFS_INLINE_DATA_OFFSET, file->size);
+        if (res != PBFS_RES_SUCCESS) {
+            bitmap_set(&mnt->root_bitmap, exts[0].lba, mnt->header64.bitmap_lba, 0, mnt, 0);
+            funcs.free(exts);
+            return res;
+        }
+    }
+
+    for (uint64_t i = 0; i < file->extent_count && !was_inline; i++) {
+        uint64_t blocks = ALIGN_UP(file->extents[i].size, bs) / bs;
+        if (blocks == 0) continue;
+        if (n > 0 && exts[n - 1].lba + exts[n - 1].count == file->extents[i].data_lba) {
+            exts[n - 1].count += blocks;
+            continue;
+        }
+        exts[n].lba = file->extents[i].data_lba;
+        exts[n].count = blocks;
+        n++;
+    }
+
+    PBFS_Metadata md = file->md;
+    md.flags &= ~METADATA_FLAG_INLINE;
+    md.data_offset = PBFS_DATA_OFFSET_EXTENTS;
+    md.data_size = uint128_from_u64(file->size);
+    md.extender_lba = UINT128_ZERO;
+
+    struct discard_batch batch = {0};
+    int res = extents_store(mnt, md_lba, &md, exts, n, true, &batch);
+    if (res != PBFS_RES_SUCCESS && was_inline) free_blocks(mnt, exts[0].lba, 1, &batch);
+    if (res == PBFS_RES_SUCCESS) {
+        // Everything the chain used besides data: extender metadata blocks and anything between metadata and data
+        for (uint64_t i = 0; i < file->extent_count && !was_inline; i++) {
+            uint64_t from = i == 0 ? md_lba + 1 : file->extents[i].md_lba;
+            free_blocks(mnt, from, file->extents[i].data_lba - from, &batch);
+        }
+        file->md = md;
+        res = file_set_runs(mnt, md_lba, exts, n, file->size, file);
+    }
+    discard_flush(mnt, &batch);
+    funcs.free(exts);
+    return res;
+}
+
+static int extent_push(PBFS_Extent** exts, uint64_t* count, uint64_t* cap, uint64_t lba, uint64_t blocks) {
+    if (blocks == 0) return PBFS_RES_SUCCESS;
+    if (*count > 0) {
+        PBFS_Extent* last = &(*exts)[*count - 1];
+        bool hole = lba == PBFS_EXTENT_HOLE;
+        bool last_hole = last->lba == PBFS_EXTENT_HOLE;
+        if (hole == last_hole && (hole || last->lba + last->count == lba)) {
+            last->count += blocks;
+            return PBFS_RES_SUCCESS;
+        }
+    }
+    if (*count >= *cap) {
+        uint64_t new_cap = *cap ? *cap * 2 : 8;
+        void* nptr = funcs.realloc(*exts, new_cap * sizeof(PBFS_Extent));
+        if (!nptr) return PBFS_ERR_Allocation_Failed;
+        *exts = nptr;
+        *cap = new_cap;
+    }
+    (*exts)[*count].lba = lba;
+    (*exts)[*count].count = blocks;
+    (*count)++;
+    return PBFS_RES_SUCCESS;
+}
+
+#define PBFS_UPDATE_CHUNK 32
+
+// Gives an open extent list file its own copy of the shared blocks (PBFS_FEATURE_REFLINK) that [offset, offset + len)
+// touches, so writing there doesn't show in the files sharing them, and zeroed blocks for the holes it touches.
+// The new list is stored before the old blocks lose the file's reference.
+static int file_unshare(struct pbfs_file* file, uint64_t offset, size_t len) {
+    struct pbfs_mount* mnt = file->mnt;
+    uint32_t bs = mnt->header64.block_size;
+    if (len == 0 || file->md.data_offset != PBFS_DATA_OFFSET_EXTENTS) return PBFS_RES_SUCCESS;
+
+    uint64_t first = offset / bs;
+    uint64_t last = (offset + len - 1) / bs + 1;
+
+    // Nothing to do unless one of the blocks is shared
+    bool any = false;
+    for (uint64_t i = file_extent_at(file, offset); i < file->extent_count && !any; i++) {
+        struct pbfs_file_extent* ext = &file->extents[i];
+        uint64_t start = ext->file_offset / bs;
+        uint64_t blocks = ALIGN_UP(ext->size, bs) / bs;
+        if (start >= last) break;
+        uint64_t from = first > start ? first - start : 0;
+        uint64_t to = last - start < blocks ? last - start : blocks;
+        if (ext->data_lba == PBFS_EXTENT_HOLE) any = from < to;
+        while (from < to && !any) from += refcount_span(mnt, ext->data_lba + from, to - from, &any);
+    }
+    if (!any) return PBFS_RES_SUCCESS;
+
+    PBFS_Extent* runs = NULL; // The file's new list
+    PBFS_Extent* fresh = NULL; // Blocks it gets, freed again on failure
+    PBFS_Extent* dropped = NULL; // Shared blocks it stops referencing
+    uint64_t run_n = 0, run_cap = 0, fresh_n = 0, fresh_cap = 0, dropped_n = 0, dropped_cap = 0;
+    uint8_t* chunk = funcs.malloc(PBFS_UPDATE_CHUNK * bs);
+    int res = chunk ? PBFS_RES_SUCCESS : PBFS_ERR_Allocation_Failed;
+
+    for (uint64_t i = 0; i < file->extent_count && res == PBFS_RES_SUCCESS; i++) {
+        struct pbfs_file_extent* ext = &file->extents[i];
+        uint64_t start = ext->file_offset / bs;
+        uint64_t blocks = ALIGN_UP(ext->size, bs) / bs;
+        uint64_t from = first > start ? first - start : 0;
+        uint64_t to = last > start ? (last - start < blocks ? last - start : blocks) : 0;
+        if (from > to) from = to;
+
+        bool hole = ext->data_lba == PBFS_EXTENT_HOLE;
+        res = extent_push(&runs, &run_n, &run_cap, ext->data_lba, from);
+        for (uint64_t pos = from; pos < to && res == PBFS_RES_SUCCESS; ) {
+            bool shared = hole;
+            uint64_t span = hole ? to - pos : refcount_span(mnt, ext->data_lba + pos, to - pos, &shared);
+            if (!shared) {
+                res = extent_push(&runs, &run_n, &run_cap, ext->data_lba + pos, span);
+                pos += span;
+                continue;
+            }
+
+            PBFS_Extent* copy = NULL;
+            uint64_t copy_n = 0;
+            res = alloc_extents(mnt, span, &copy, &copy_n);
+            if (res != PBFS_RES_SUCCESS) break;
+
+            uint64_t src = ext->data_lba + pos;
+            for (uint64_t c = 0; c < copy_n; c++) {
+                if (res == PBFS_RES_SUCCESS) res = extent_push(&fresh, &fresh_n, &fresh_cap, copy[c].lba, copy[c].count);
+                if (res == PBFS_RES_SUCCESS) res = extent_push(&runs, &run_n, &run_cap, copy[c].lba, copy[c].count);
+                for (uint64_t done = 0; done < copy[c].count && res == PBFS_RES_SUCCESS; done += PBFS_UPDATE_CHUNK) {
+                    uint64_t count = copy[c].count - done < PBFS_UPDATE_CHUNK ? copy[c].count - done : PBFS_UPDATE_CHUNK;
+                    if (hole) memset(chunk, 0, count * bs);
+                    else res = read_span(mnt, src, count, chunk);
+                    if (res == PBFS_RES_SUCCESS) res = write_span(mnt, copy[c].lba + done, count, chunk);
+                    src += count;
+                }
+            }
+            funcs.free(copy);
+            if (res == PBFS_RES_SUCCESS && !hole) res = extent_push(&dropped, &dropped_n, &dropped_cap, ext->data_lba + pos, span);
+            pos += span;
+        }
+        if (res == PBFS_RES_SUCCESS) res = extent_push(&runs, &run_n, &run_cap, hole ? PBFS_EXTENT_HOLE : ext->data_lba + to, blocks - to);
+    }
+
+    struct discard_batch batch = {0};
+    uint64_t md_lba = file->extents[0].md_lba;
+    if (res == PBFS_RES_SUCCESS) res = extents_store(mnt, md_lba, &file->md, runs, run_n, false, &batch);
+    if (res == PBFS_RES_SUCCESS) {
+        for (uint64_t i = 0; i < dropped_n; i++) free_blocks(mnt, dropped[i].lba, dropped[i].count, &batch);
+        res = file_set_runs(mnt, md_lba, runs, run_n, file->size, file);
+    } else {
+        for (uint64_t i = 0; i < fresh_n; i++) free_blocks(mnt, fresh[i].lba, fresh[i].count, &batch);
+    }
+    discard_flush(mnt, &batch);
+
+    if (chunk) funcs.free(chunk);
+    if (runs) funcs.free(runs);
+    if (fresh) funcs.free(fresh);
+    if (dropped) funcs.free(dropped);
+    return res;
+}
+
+// DMM blocks: header64.dmm_entries entries, then the trailer. Buffers are whole blocks (DMM_BLOCK declares one).
+#define DMM_BLOCK(mnt, var) uint64_t var[(mnt)->header64.block_size / sizeof(uint64_t)]
+#define DMM_ENTRIES_OF(block) ((PBFS_DMM_Entry*)(block))
+#define DMM_TRAILER(mnt, block) ((PBFS_DMM_Trailer*)((uint8_t*)(block) + (mnt)->header64.dmm_entries * sizeof(PBFS_DMM_Entry)))
+
+static uint32_t dmm_name_hash(const char* name) {
+    size_t len = 0;
+    while (len < PBFS_MAX_NAME_LEN && name[len]) len++;
+    return crc32(name, len);
+}
+
+// Trailer fields a volume doesn't have the feature for were reserved bytes when it was made, anything can be in them
+static void dmm_trailer_mask(uint32_t features, PBFS_DMM_Trailer* t) {
+    if (!(features & PBFS_FEATURE_DIR_INDEX)) {
+        t->index_lba = 0;
+        t->index_blocks = 0;
+        t->index_used = 0;
+    }
+    if (!(features & PBFS_FEATURE_DIR_BTREE)) {
+        t->btree_root = 0;
+        t->btree_depth = 0;
+        t->dir_flags = 0;
+    }
+}
+
+static int dmm_read(struct pbfs_mount* mnt, uint64_t lba, void* block) {
+    int out = pbfs_read(mnt, lba, mnt->header64.block_size, block);
+    if (out != PBFS_RES_SUCCESS) return out;
+    if (DMM_TRAILER(mnt, block)->entry_count > mnt->header64.dmm_entries) return PBFS_ERR_DMM_Corrupted;
+    dmm_trailer_mask(mnt->header64.features, DMM_TRAILER(mnt, block));
+    return PBFS_RES_SUCCESS;
+}
+
+static int dmm_write(struct pbfs_mount* mnt, uint64_t lba, void* block) {
+    // Tags are rebuilt from the entries on every write, callers never maintain them
+    if (mnt->header64.features & PBFS_FEATURE_NAME_TAGS) {
+        PBFS_DMM_Entry* entries = DMM_ENTRIES_OF(block);
+        PBFS_DMM_Trailer* dmm = DMM_TRAILER(mnt, block);
+        memset(dmm->name_tags, 0, sizeof(dmm->name_tags));
+        for (uint64_t i = 0; i < dmm->entry_count && i < PBFS_DMM_NAME_TAGS; i++) {
+            dmm->name_tags[i] = PBFS_NAME_TAG(dmm_name_hash(entries[i].name));
+        }
+    }
+    return pbfs_write(mnt, lba, mnt->header64.block_size, block);
+}
+
+// Index of name (hash = dmm_name_hash(name)) in one DMM block or -1.
+// With name tags only entries whose tag matches get a strcmp, the tag compare is branch free.
+static int dmm_block_find(struct pbfs_mount* mnt, void* block, const char* name, uint32_t hash) {
+    PBFS_DMM_Entry* entries = DMM_ENTRIES_OF(block);
+    PBFS_DMM_Trailer* dmm = DMM_TRAILER(mnt, block);
+    uint32_t count = dmm->entry_count;
+    uint32_t i = 0;
+
+    if (mnt->header64.features & PBFS_FEATURE_NAME_TAGS) {
+        uint32_t tagged = count < PBFS_DMM_NAME_TAGS ? count : PBFS_DMM_NAME_TAGS;
+        uint8_t tag = PBFS_NAME_TAG(hash);
+        uint64_t match = 0;
+        for (uint32_t t = 0; t < tagged; t++) {
+            match |= (uint64_t)(dmm->name_tags[t] == tag) << t;
+        }
+        while (match) {
+            uint32_t t = __builtin_ctzll(match);
+            if (strcmp(entries[t].name, name) == 0) return t;
+            match &= match - 1;
+        }
+        i = tagged;
+    }
+
+    for (; i < count; i++) {
+        if (strcmp(entries[i].name, name) == 0) return i;
+    }
+    return -1;
+}
+
+// Cache arrays are allocated on first use, another thread may have put its own in first, then that one is used
+static void* cache_array(void* _Atomic* array, size_t size) {
+    void* cur = atomic_load_explicit(array, memory_order_acquire);
+    if (cur) return cur;
+
+    void* fresh = funcs.malloc(size);
+    if (!fresh) return NULL;
+    memset(fresh, 0, size);
+    if (atomic_compare_exchange_strong_explicit(array, &cur, fresh, memory_order_acq_rel, memory_order_acquire)) return fresh;
+    funcs.free(fresh);
+    return cur;
+}
+
+// Writers of one slot take turns, the odd sequence keeps readers from trusting what they copy meanwhile
+static void seq_write_begin(_Atomic uint32_t* seq_p) {
+    uint32_t seq = atomic_load_explicit(seq_p, memory_order_relaxed);
+    for (;;) {
+        if (seq & 1) {
+            __asm__ volatile("pause");
+            seq = atomic_load_explicit(seq_p, memory_order_relaxed);
+        } else if (atomic_compare_exchange_weak_explicit(seq_p, &seq, seq + 1, memory_order_acquire, memory_order_relaxed)) {
+            break;
+        }
+    }
+    atomic_thread_fence(memory_order_release);
+}
+
+static void seq_write_end(_Atomic uint32_t* seq_p) {
+    atomic_fetch_add_explicit(seq_p, 1, memory_order_release);
+}
+
+// Odd = a writer is in the slot, the read is a miss straight away
+static uint32_t seq_read_begin(_Atomic uint32_t* seq_p) {
+    return atomic_load_explicit(seq_p, memory_order_acquire);
+}
+
+// Whether what was read after seq_read_begin returned seq can be trusted
+static bool seq_read_ok(_Atomic uint32_t* seq_p, uint32_t seq) {
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(seq_p, memory_order_relaxed) == seq;
+}
+
+// Dentry cache: direct mapped on (directory DMM LBA, name), allocated on first use.
+// No lock: readers copy a slot out and check its sequence didn't move, writers make it odd while they change the slot.
+static struct pbfs_dcache_slot* dcache_slot(struct pbfs_mount* mnt, uint64_t dir_lba, const char* name) {
+    struct pbfs_dcache_slot* slots = cache_array((void* _Atomic*)&mnt->dcache, PBFS_DCACHE_ENTRIES * sizeof(struct pbfs_dcache_slot));
+    if (!slots) return NULL;
+
+    uint32_t hash = dmm_name_hash(name) ^ (uint32_t)(dir_lba * 0x9E3779B1u);
+    return &slots[hash % PBFS_DCACHE_ENTRIES];
+}
+
+static bool dcache_match(struct pbfs_dcache_entry* de, uint64_t dir_lba, const char* name) {
+    return de && de->dir_lba == dir_lba && strncmp(de->name, name, PBFS_MAX_NAME_LEN) == 0;
+}
+
+// Copies the cached entry out, a slot being written counts as a miss
+static bool dcache_lookup(struct pbfs_mount* mnt, uint64_t dir_lba, const char* name, struct pbfs_dcache_entry* copy) {
+    struct pbfs_dcache_slot* slot = dcache_slot(mnt, dir_lba, name);
+    if (!slot) return false;
+
+    uint32_t seq = seq_read_begin(&slot->seq);
+    if (seq & 1) return false;
+    memcpy(copy, &slot->entry, sizeof(struct pbfs_dcache_entry));
+    if (!seq_read_ok(&slot->seq, seq)) return false;
+
+    copy->name[PBFS_MAX_NAME_LEN - 1] = 0;
+    return dcache_match(copy, dir_lba, name);
+}
+
+static void dcache_store(struct pbfs_mount* mnt, const struct pbfs_dcache_entry* e) {
+    struct pbfs_dcache_slot* slot = dcache_slot(mnt, e->dir_lba, e->name);
+    if (!slot) return;
+    seq_write_begin(&slot->seq);
+    slot->entry = *e;
+    seq_write_end(&slot->seq);
+}
+
+static void dcache_set_child(struct pbfs_mount* mnt, uint64_t dir_lba, const char* name, uint64_t child_lba) {
+    struct pbfs_dcache_slot* slot = dcache_slot(mnt, dir_lba, name);
+    if (!slot) return;
+    seq_write_begin(&slot->seq);
+    if (dcache_match(&slot->entry, dir_lba, name)) slot->entry.child_lba = child_lba;
+    seq_write_end(&slot->seq);
+}
+
+static void dcache_invalidate(struct pbfs_mount* mnt, uint64_t dir_lba, const char* name) {
+    if (atomic_load_explicit(&mnt->dcache, memory_order_acquire)) {
+        struct pbfs_dcache_slot* slot = dcache_slot(mnt, dir_lba, name);
+        seq_write_begin(&slot->seq);
+        if (dcache_match(&slot->entry, dir_lba, name)) slot->entry.dir_lba = 0;
+        seq_write_end(&slot->seq);
+    }
+    atomic_fetch_add_explicit(&mnt->ns_gen, 1, memory_order_acq_rel);
+}
+
+// Drops everything cached under a directory (removed, or its entries moved between blocks)
+static void dcache_invalidate_dir(struct pbfs_mount* mnt, uint64_t dir_lba) {
+    struct pbfs_dcache_slot* slots = atomic_load_explicit(&mnt->dcache, memory_order_acquire);
+    for (uint32_t i = 0; slots && i < PBFS_DCACHE_ENTRIES; i++) {
+        // Only slots that look like they hold the directory are taken, readers of the others keep hitting
+        if (slots[i].entry.dir_lba != dir_lba) continue;
+        seq_write_begin(&slots[i].seq);
+        if (slots[i].entry.dir_lba == dir_lba) slots[i].entry.dir_lba = 0;
+        seq_write_end(&slots[i].seq);
+    }
+    atomic_fetch_add_explicit(&mnt->ns_gen, 1, memory_order_acq_rel);
+}
+
+static uint64_t dcache_gen(struct pbfs_mount* mnt) {
+    return atomic_load_explicit(&mnt->ns_gen, memory_order_acquire);
+}
+
+// Symlink cache: direct mapped on the link's metadata LBA, allocated on first use, seqlocked like the dcache.
+// Targets stay until the link is freed, resolutions only while ns_gen hasn't moved.
+static struct pbfs_symlink_slot* symlink_slot(struct pbfs_mount* mnt, uint64_t link_lba) {
+    struct pbfs_symlink_slot* slots = cache_array((void* _Atomic*)&mnt->symlinks, PBFS_SYMLINK_CACHE * sizeof(struct pbfs_symlink_slot));
+    if (!slots) return NULL;
+    return &slots[(uint32_t)(link_lba * 0x9E3779B1u) % PBFS_SYMLINK_CACHE];
+}
+
+static bool symlink_cached_target(struct pbfs_mount* mnt, uint64_t link_lba, char* target, size_t target_size) {
+    struct pbfs_symlink_slot* slot = symlink_slot(mnt, link_lba);
+    if (!slot) return false;
+
+    uint32_t seq = seq_read_begin(&slot->seq);
+    if ((seq & 1) || slot->entry.link_lba != link_lba) return false;
+
+    // A writer can be halfway through the target, only the last byte is sure to stay 0
+    size_t len = 0;
+    while (len < PBFS_MAX_PATH_LEN - 1 && slot->entry.target[len]) len++;
+    if (len >= target_size) return false;
+    memcpy(target, slot->entry.target, len);
+    target[len] = 0;
+    return seq_read_ok(&slot->seq, seq);
+}
+
+static void symlink_store_target(struct pbfs_mount* mnt, uint64_t link_lba, const char* target) {
+    struct pbfs_symlink_slot* slot = symlink_slot(mnt, link_lba);
+    if (!slot) return;
+
+    seq_write_begin(&slot->seq);
+    slot->entry.link_lba = link_lba;
+    strncpy(slot->entry.target, target, PBFS_MAX_PATH_LEN - 1);
+    slot->entry.target[PBFS_MAX_PATH_LEN - 1] = 0;
+    slot->entry.resolved = false;
+    seq_write_end(&slot->seq);
+}
+
+static bool symlink_cached_final(struct pbfs_mount* mnt, uint64_t link_lba, uint64_t gen, PBFS_DMM_Entry* out, uint64_t* out_lba, uint64_t* out_dir_lba) {
+    struct pbfs_symlink_slot* slot = symlink_slot(mnt, link_lba);
+    if (!slot) return false;
+
+    uint32_t seq = seq_read_begin(&slot->seq);
+    if (seq & 1) return false;
+    struct pbfs_symlink_entry* se = &slot->entry;
+    bool hit = se->link_lba == link_lba && se->resolved && se->gen == gen;
+    PBFS_DMM_Entry entry = se->entry;
+    uint64_t dmm_lba = se->dmm_lba;
+    uint64_t dir_lba = se->dir_lba;
+    if (!hit || !seq_read_ok(&slot->seq, seq)) return false;
+
+    *out = entry;
+    *out_lba = dmm_lba;
+    if (out_dir_lba) *out_dir_lba = dir_lba;
+    return true;
+}
+
+static void symlink_store_final(struct pbfs_mount* mnt, uint64_t link_lba, uint64_t gen, const PBFS_DMM_Entry* e, uint64_t dmm_lba, uint64_t dir_lba) {
+    struct pbfs_symlink_slot* slot = symlink_slot(mnt, link_lba);
+    if (!slot) return;
+
+    seq_write_begin(&slot->seq);
+    struct pbfs_symlink_entry* se = &slot->entry;
+    if (se->link_lba == link_lba) {
+        se->resolved = true;
+        se->gen = gen;
+        se->entry = *e;
+        se->dmm_lba = dmm_lba;
+        se->dir_lba = dir_lba;
+    }
+    seq_write_end(&slot->seq);
+}
+
+// The blocks at link_lba are being freed, whatever gets written there next isn't this link
+static void symlink_forget(struct pbfs_mount* mnt, uint64_t link_lba) {
+    if (!atomic_load_explicit(&mnt->symlinks, memory_order_acquire)) return;
+
+    struct pbfs_symlink_slot* slot = symlink_slot(mnt, link_lba);
+    seq_write_begin(&slot->seq);
+    if (slot->entry.link_lba == link_lba) slot->entry.link_lba = 0;
+    seq_write_end(&slot->seq);
+}
+
+// Directory Bloom filters: direct mapped on the directory DMM LBA, allocated on first use, seqlocked like the dcache.
+// A filter array is never freed while mounted, a test holding an old one reads stale bits and then sees seq move.
+static struct pbfs_dir_bloom* bloom_slot(struct pbfs_mount* mnt, uint64_t dir_lba) {
+    struct pbfs_dir_bloom* slots = cache_array((void* _Atomic*)&mnt->blooms, PBFS_BLOOM_DIRS * sizeof(struct pbfs_dir_bloom));
+    if (!slots) return NULL;
+    return &slots[(uint32_t)(dir_lba * 0x9E3779B1u) % PBFS_BLOOM_DIRS];
+}
+
+static void bloom_set(uint64_t* words, uint32_t hash) {
+    uint64_t nbits = words[0];
+    uint64_t* bits = words + 1;
+    uint32_t step = ((hash >> 17) | (hash << 15)) | 1;
+    for (uint32_t i = 0; i < PBFS_BLOOM_HASHES; i++) {
+        uint64_t bit = (hash + i * step) & (nbits - 1);
+        bits[bit / 64] |= 1ull << (bit % 64);
+    }
+}
+
+// words[0] is read once, whichever bit count a writer left there fits the array
+static bool bloom_has(const uint64_t* words, uint32_t hash) {
+    uint64_t nbits = words[0];
+    const uint64_t* bits = words + 1;
+    uint32_t step = ((hash >> 17) | (hash << 15)) | 1;
+    for (uint32_t i = 0; i < PBFS_BLOOM_HASHES; i++) {
+        uint64_t bit = (hash + i * step) & (nbits - 1);
+        if (!(bits[bit / 64] & (1ull << (bit % 64)))) return false;
+    }
+    return true;
+}
+
+// 0 = name (hash = dmm_name_hash) is definitely not in the directory, 1 = maybe, -1 = no filter for it
+static int bloom_test(struct pbfs_mount* mnt, uint64_t dir_lba, uint32_t hash) {
+    struct pbfs_dir_bloom* b = bloom_slot(mnt, dir_lba);
+    if (!b) return -1;
+
+    uint32_t seq = seq_read_begin(&b->seq);
+    if ((seq & 1) || b->dir_lba != dir_lba) return -1;
+    uint64_t* words = atomic_load_explicit(&b->words, memory_order_acquire);
+    if (!words) return -1;
+    bool has = bloom_has(words, hash);
+    if (!seq_read_ok(&b->seq, seq)) return -1;
+    return has ? 1 : 0;
+}
+
+static void bloom_add(struct pbfs_mount* mnt, uint64_t dir_lba, const char* name) {
+    if (!atomic_load_explicit(&mnt->blooms, memory_order_acquire)) return;
+
+    uint32_t hash = dmm_name_hash(name);
+    struct pbfs_dir_bloom* b = bloom_slot(mnt, dir_lba);
+    seq_write_begin(&b->seq);
+    if (b->dir_lba == dir_lba) {
+        uint64_t* words = atomic_load_explicit(&b->words, memory_order_relaxed);
+        bloom_set(words, hash);
+        // Too full to answer "no" often, the next miss builds a larger one
+        if (++b->names * 8 > words[0]) b->dir_lba = 0;
+    }
+    seq_write_end(&b->seq);
+}
+
+// The directory is gone (or a new one starts at dir_lba)
+static void bloom_drop(struct pbfs_mount* mnt, uint64_t dir_lba) {
+    if (!atomic_load_explicit(&mnt->blooms, memory_order_acquire)) return;
+
+    struct pbfs_dir_bloom* b = bloom_slot(mnt, dir_lba);
+    seq_write_begin(&b->seq);
+    if (b->dir_lba == dir_lba) b->dir_lba = 0;
+    seq_write_end(&b->seq);
+}
+
+// Reads every DMM block of the directory once (plain chain or B+tree leaves) and installs a filter sized for it
+static int bloom_build(struct pbfs_mount* mnt, uint64_t dir_lba) {
+    uint32_t* hashes = NULL;
+    uint64_t count = 0;
+
+    DMM_BLOCK(mnt, block);
+    PBFS_DMM_Entry* entries = DMM_ENTRIES_OF(block);
+    PBFS_DMM_Trailer* dmm = DMM_TRAILER(mnt, block);
+    uint64_t iter_lba = dir_lba;
+    for (uint64_t chain = 0; chain < mnt->header64.total_blocks && iter_lba > 1; chain++) {
+        int out = dmm_read(mnt, iter_lba, block);
+        if (out != PBFS_RES_SUCCESS) { funcs.free(hashes); return out; }
+
+        if (dmm->entry_count > 0) {
+            void* nptr = funcs.realloc(hashes, (count + dmm->entry_count) * sizeof(uint32_t));
+            if (!nptr) { funcs.free(hashes); return PBFS_ERR_Allocation_Failed; }
+            hashes = nptr;
+            for (uint32_t i = 0; i < dmm->entry_count; i++) hashes[count++] = dmm_name_hash(entries[i].name);
+        }
+        iter_lba = uint128_to_u64(dmm->extender_lba);
+    }
+
+    // 16 to 32 bits per name, about 0.1% false positives with 4 hashes
+    uint64_t nbits = 512;
+    while (nbits < count * 16) nbits *= 2;
+    size_t size = (1 + nbits / 64) * sizeof(uint64_t);
+    uint64_t* words = funcs.malloc(size);
+    if (!words) { funcs.free(hashes); return PBFS_ERR_Allocation_Failed; }
+    memset(words, 0, size);
+    words[0] = nbits;
+    for (uint64_t i = 0; i < count; i++) bloom_set(words, hashes[i]);
+    funcs.free(hashes);
+
+    struct pbfs_dir_bloom* b = bloom_slot(mnt, dir_lba);
+    if (!b) { funcs.free(words); return PBFS_RES_SUCCESS; }
+
+    seq_write_begin(&b->seq);
+    uint64_t* old = atomic_load_explicit(&b->words, memory_order_relaxed);
+    if (old && b->cap >= nbits) {
+        // Fits the slot's array, tests still reading it see seq move
+        memcpy(old, words, size);
+        funcs.free(words);
     } else {
-        PBFS_Metadata md = {0};
-        uint64_t dmme_lba = uint128_to_u64(dmme->lba);
-        int res = pbfs_read(mnt, dmme_lba, sizeof(PBFS_Metadata), &md);
+        if (old) {
+            uint64_t* head = atomic_load_explicit(&mnt->bloom_retired, memory_order_relaxed);
+            do old[1] = (uint64_t)(uintptr_t)head;
+            while (!atomic_compare_exchange_weak_explicit(&mnt->bloom_retired, &head, old, memory_order_release, memory_order_relaxed));
+        }
+        atomic_store_explicit(&b->words, words, memory_order_release);
+        b->cap = nbits;
+    }
+    b->dir_lba = dir_lba;
+    b->names = count;
+    seq_write_end(&b->seq);
+    return PBFS_RES_SUCCESS;
+}
+
+static void fill_dmm_entry(PBFS_DMM_Entry* entry, uint64_t lba, const char* name, PBFS_Metadata_Flags type, PBFS_Permission_Flags perms, uint64_t created_ts, uint64_t modified_ts) {
+    entry->lba = uint128_from_u64(lba);
+    entry->type = type;
+    entry->created_timestamp = created_ts;
+    entry->modified_timestamp = modified_ts;
+    entry->perms = perms;
+    strncpy(entry->name, name, sizeof(entry->name) - 1);
+    entry->name[sizeof(entry->name) - 1] = '\0';
+}
+
+// Hashed directory index: an open addressing table (linear probing) of PBFS_DMM_Index_Slot in a contiguous
+// extent, referenced from the directory's first DMM block. A lookup reads one index block and the DMM block it points to.
+#define DMM_INDEX_SLOTS_PER_BLOCK(mnt) ((mnt)->header64.block_size / sizeof(PBFS_DMM_Index_Slot))
+
+static int dmm_index_find(struct pbfs_mount* mnt, PBFS_DMM_Trailer* head, const char* name, PBFS_DMM_Entry* out, uint64_t* out_lba) {
+    uint64_t per_block = DMM_INDEX_SLOTS_PER_BLOCK(mnt);
+    uint64_t total = head->index_blocks * per_block;
+    if (total == 0) return PBFS_ERR_DMM_Corrupted;
+
+    uint32_t hash = dmm_name_hash(name);
+    PBFS_DMM_Index_Slot slots[per_block];
+    uint64_t loaded = UINT64_MAX;
+
+    for (uint64_t probe = 0; probe < total; probe++) {
+        uint64_t slot = (hash + probe) % total;
+        if (slot / per_block != loaded) {
+            loaded = slot / per_block;
+            int res = pbfs_read(mnt, head->index_lba + loaded, sizeof(slots), slots);
+            if (res != PBFS_RES_SUCCESS) return res;
+        }
+
+        PBFS_DMM_Index_Slot* s = &slots[slot % per_block];
+        if (s->dmm_lba == 0) break;
+        if (s->dmm_lba == 1 || s->hash != hash) continue;
+
+        DMM_BLOCK(mnt, block);
+        int res = dmm_read(mnt, s->dmm_lba, block);
         if (res != PBFS_RES_SUCCESS) return res;
 
-        if (md.data_offset < 1) return PBFS_ERR_Invalid_File_Or_Directory;
-        *out_lba = md.data_offset + dmme_lba;
+        int i = dmm_block_find(mnt, block, name, hash);
+        if (i >= 0) {
+            *out = DMM_ENTRIES_OF(block)[i];
+            *out_lba = s->dmm_lba;
+            return PBFS_RES_SUCCESS;
+        }
+    }
+    return PBFS_ERR_File_Not_Found;
+}
+
+// (Re)builds the index of the directory whose first DMM block is at dir_lba, sized for a load of 50%
+static int dmm_index_build(struct pbfs_mount* mnt, uint64_t dir_lba) {
+    // Volumes without PBFS_FEATURE_DIR_INDEX keep plain chains
+    if (!(mnt->header64.features & PBFS_FEATURE_DIR_INDEX)) return PBFS_RES_SUCCESS;
+
+    DMM_BLOCK(mnt, head_block);
+    int out = dmm_read(mnt, dir_lba, head_block);
+    if (out != PBFS_RES_SUCCESS) return out;
+    PBFS_DMM_Trailer* head = DMM_TRAILER(mnt, head_block);
+
+    PBFS_DMM_Index_Slot* found = NULL;
+    uint64_t found_count = 0;
+    uint64_t found_cap = 0;
+
+    DMM_BLOCK(mnt, block);
+    PBFS_DMM_Entry* entries = DMM_ENTRIES_OF(block);
+    PBFS_DMM_Trailer* dmm = DMM_TRAILER(mnt, block);
+    memcpy(block, head_block, mnt->header64.block_size);
+    uint64_t iter_lba = dir_lba;
+    for (int chain = 0; chain < PBFS_MAX_DMM_CHAIN && iter_lba > 1; chain++) {
+        if (chain > 0) {
+            out = dmm_read(mnt, iter_lba, block);
+            if (out != PBFS_RES_SUCCESS) { funcs.free(found); return out; }
+        }
+
+        for (uint32_t i = 0; i < dmm->entry_count; i++) {
+            if (found_count >= found_cap) {
+                void* nptr = funcs.realloc(found, (found_cap + 64) * sizeof(PBFS_DMM_Index_Slot));
+                if (!nptr) { funcs.free(found); return PBFS_ERR_Allocation_Failed; }
+                found = nptr;
+                found_cap += 64;
+            }
+            found[found_count].hash = dmm_name_hash(entries[i].name);
+            found[found_count].reserved = 0;
+            found[found_count].dmm_lba = iter_lba;
+            found_count++;
+        }
+        iter_lba = uint128_to_u64(dmm->extender_lba);
+    }
+
+    uint64_t per_block = DMM_INDEX_SLOTS_PER_BLOCK(mnt);
+    uint64_t blocks = (found_count * 2 + per_block - 1) / per_block;
+    if (blocks < 1) blocks = 1;
+    uint64_t total = blocks * per_block;
+
+    PBFS_DMM_Index_Slot* table = funcs.malloc(blocks * mnt->header64.block_size);
+    if (!table) { funcs.free(found); return PBFS_ERR_Allocation_Failed; }
+    memset(table, 0, blocks * mnt->header64.block_size);
+
+    for (uint64_t i = 0; i < found_count; i++) {
+        uint64_t slot = found[i].hash % total;
+        while (table[slot].dmm_lba != 0) slot = (slot + 1) % total;
+        table[slot] = found[i];
+    }
+    funcs.free(found);
+
+    uint64_t index_lba = bitmap_find_blocks(&mnt->root_bitmap64, mnt->header64.data_start_lba, blocks, mnt);
+    if (index_lba <= 1) { funcs.free(table); return PBFS_ERR_No_Space_Left; }
+
+    out = pbfs_write(mnt, index_lba, blocks * mnt->header64.block_size, table);
+    funcs.free(table);
+    if (out != PBFS_RES_SUCCESS) return out;
+    for (uint64_t i = 0; i < blocks; i++) {
+        bitmap_set(&mnt->root_bitmap, index_lba + i, mnt->header64.bitmap_lba, 0, mnt, 1);
+    }
+
+    if (head->index_lba > 1) {
+        struct discard_batch batch = {0};
+        free_blocks(mnt, head->index_lba, head->index_blocks, &batch);
+        discard_flush(mnt, &batch);
+    }
+
+    head->index_lba = index_lba;
+    head->index_blocks = blocks;
+    head->index_used = found_count;
+    return dmm_write(mnt, dir_lba, head_block);
+}
+
+// Records that name now lives in the DMM block at dmm_lba, builds the index once the chain reaches chain_blocks
+static int dmm_index_insert(struct pbfs_mount* mnt, uint64_t dir_lba, const char* name, uint64_t dmm_lba, uint64_t chain_blocks) {
+    DMM_BLOCK(mnt, head_block);
+    int out = dmm_read(mnt, dir_lba, head_block);
+    if (out != PBFS_RES_SUCCESS) return out;
+    PBFS_DMM_Trailer* head = DMM_TRAILER(mnt, head_block);
+
+    if (head->index_lba <= 1) {
+        if (chain_blocks >= PBFS_DMM_INDEX_THRESHOLD) return dmm_index_build(mnt, dir_lba);
+        return PBFS_RES_SUCCESS;
+    }
+
+    uint64_t per_block = DMM_INDEX_SLOTS_PER_BLOCK(mnt);
+    uint64_t total = head->index_blocks * per_block;
+    if ((head->index_used + 1) * 4 > total * 3) return dmm_index_build(mnt, dir_lba);
+
+    uint32_t hash = dmm_name_hash(name);
+    PBFS_DMM_Index_Slot slots[per_block];
+    uint64_t loaded = UINT64_MAX;
+
+    for (uint64_t probe = 0; probe < total; probe++) {
+        uint64_t slot = (hash + probe) % total;
+        if (slot / per_block != loaded) {
+            loaded = slot / per_block;
+            out = pbfs_read(mnt, head->index_lba + loaded, sizeof(slots), slots);
+            if (out != PBFS_RES_SUCCESS) return out;
+        }
+
+        PBFS_DMM_Index_Slot* s = &slots[slot % per_block];
+        if (s->dmm_lba > 1) continue;
+
+        bool was_empty = s->dmm_lba == 0;
+        s->hash = hash;
+        s->dmm_lba = dmm_lba;
+        out = pbfs_write(mnt, head->index_lba + loaded, sizeof(slots), slots);
+        if (out != PBFS_RES_SUCCESS) return out;
+
+        if (!was_empty) return PBFS_RES_SUCCESS;
+        head->index_used++;
+        return dmm_write(mnt, dir_lba, head_block);
+    }
+    return dmm_index_build(mnt, dir_lba);
+}
+
+static int dmm_index_remove(struct pbfs_mount* mnt, uint64_t dir_lba, const char* name, uint64_t dmm_lba) {
+    DMM_BLOCK(mnt, head_block);
+    int out = dmm_read(mnt, dir_lba, head_block);
+    if (out != PBFS_RES_SUCCESS) return out;
+    PBFS_DMM_Trailer* head = DMM_TRAILER(mnt, head_block);
+    if (head->index_lba <= 1) return PBFS_RES_SUCCESS;
+
+    uint64_t per_block = DMM_INDEX_SLOTS_PER_BLOCK(mnt);
+    uint64_t total = head->index_blocks * per_block;
+    uint32_t hash = dmm_name_hash(name);
+    PBFS_DMM_Index_Slot slots[per_block];
+    uint64_t loaded = UINT64_MAX;
+
+    for (uint64_t probe = 0; probe < total; probe++) {
+        uint64_t slot = (hash + probe) % total;
+        if (slot / per_block != loaded) {
+            loaded = slot / per_block;
+            out = pbfs_read(mnt, head->index_lba + loaded, sizeof(slots), slots);
+            if (out != PBFS_RES_SUCCESS) return out;
+        }
+
+        PBFS_DMM_Index_Slot* s = &slots[slot % per_block];
+        if (s->dmm_lba == 0) break;
+        if (s->hash != hash || s->dmm_lba != dmm_lba) continue;
+
+        s->dmm_lba = 1;
+        return pbfs_write(mnt, head->index_lba + loaded, sizeof(slots), slots);
+    }
+
+    // Index lost track of the name, rebuild it from the chain
+    return dmm_index_build(mnt, dir_lba);
+}
+
+// B+tree directories: leaves are DMM blocks kept sorted by name and chained through extender_lba, internal
+// nodes are PBFS_DMM_Node blocks. Leaves are never merged, one emptied by removes stays linked until the tree is rebuilt.
+#define DMM_NODE_KEYS(mnt) (((mnt)->header64.block_size - sizeof(PBFS_DMM_Node)) / sizeof(PBFS_DMM_Node_Key))
+#define DMM_NODE_KEYS_OF(block) ((PBFS_DMM_Node_Key*)((uint8_t*)(block) + sizeof(PBFS_DMM_Node)))
+
+// First position in a sorted leaf whose name is >= name
+static uint64_t btree_leaf_pos(PBFS_DMM_Entry* entries, uint64_t count, const char* name) {
+    uint64_t lo = 0;
+    uint64_t hi = count;
+    while (lo < hi) {
+        uint64_t mid = (lo + hi) / 2;
+        if (strncmp(entries[mid].name, name, PBFS_MAX_NAME_LEN) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// Number of keys <= name, the child to follow (0 = first_child)
+static uint64_t btree_node_pos(PBFS_DMM_Node_Key* keys, uint64_t count, const char* name) {
+    uint64_t lo = 0;
+    uint64_t hi = count;
+    while (lo < hi) {
+        uint64_t mid = (lo + hi) / 2;
+        if (strncmp(keys[mid].name, name, PBFS_MAX_NAME_LEN) <= 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static uint64_t btree_alloc(struct pbfs_mount* mnt) {
+    uint64_t lba = bitmap_find_blocks(&mnt->root_bitmap64, mnt->header64.data_start_lba, 1, mnt);
+    if (lba > 1) bitmap_set(&mnt->root_bitmap, lba, mnt->header64.bitmap_lba, 0, mnt, 1);
+    return lba;
+}
+
+// Walks down to the leaf that holds (or would hold) name, path (optional) receives the internal nodes on the way
+static int btree_find_leaf(struct pbfs_mount* mnt, PBFS_DMM_Trailer* head, const char* name, uint64_t* path, uint64_t* leaf_lba) {
+    if (head->btree_depth > PBFS_MAX_BTREE_DEPTH) return PBFS_ERR_DMM_Corrupted;
+
+    DMM_BLOCK(mnt, block);
+    PBFS_DMM_Node* node = (PBFS_DMM_Node*)block;
+    uint64_t lba = head->btree_root;
+    for (uint32_t level = 0; level < head->btree_depth; level++) {
+        if (path) path[level] = lba;
+        int out = pbfs_read(mnt, lba, mnt->header64.block_size, block);
+        if (out != PBFS_RES_SUCCESS) return out;
+        if (node->key_count > DMM_NODE_KEYS(mnt)) return PBFS_ERR_DMM_Corrupted;
+
+        uint64_t pos = btree_node_pos(DMM_NODE_KEYS_OF(block), node->key_count, name);
+        lba = pos == 0 ? node->first_child : DMM_NODE_KEYS_OF(block)[pos - 1].child;
+        if (lba <= 1) return PBFS_ERR_DMM_Corrupted;
+    }
+
+    *leaf_lba = lba;
+    return PBFS_RES_SUCCESS;
+}
+
+static int btree_find(struct pbfs_mount* mnt, PBFS_DMM_Trailer* head, const char* name, PBFS_DMM_Entry* out, uint64_t* out_lba) {
+    uint64_t leaf_lba = 0;
+    int res = btree_find_leaf(mnt, head, name, NULL, &leaf_lba);
+    if (res != PBFS_RES_SUCCESS) return res;
+
+    DMM_BLOCK(mnt, block);
+    res = dmm_read(mnt, leaf_lba, block);
+    if (res != PBFS_RES_SUCCESS) return res;
+
+    PBFS_DMM_Entry* entries = DMM_ENTRIES_OF(block);
+    uint64_t count = DMM_TRAILER(mnt, block)->entry_count;
+    uint64_t pos = btree_leaf_pos(entries, count, name);
+    if (pos >= count || strncmp(entries[pos].name, name, PBFS_MAX_NAME_LEN) != 0) return PBFS_ERR_File_Not_Found;
+
+    *out = entries[pos];
+    *out_lba = leaf_lba;
+    return PBFS_RES_SUCCESS;
+}
+
+// head_block = first DMM block of the B+tree directory at dir_lba, rewritten if the root splits
+static int btree_insert(struct pbfs_mount* mnt, uint64_t dir_lba, void* head_block, PBFS_DMM_Entry* entry) {
+    PBFS_DMM_Trailer* head = DMM_TRAILER(mnt, head_block);
+    uint64_t path[PBFS_MAX_BTREE_DEPTH];
+    uint64_t leaf_lba = 0;
+    int out = btree_find_leaf(mnt, head, entry->name, path, &leaf_lba);
+    if (out != PBFS_RES_SUCCESS) return out;
+
+    DMM_BLOCK(mnt, block);
+    out = dmm_read(mnt, leaf_lba, block);
+    if (out != PBFS_RES_SUCCESS) return out;
+
+    PBFS_DMM_Entry* entries = DMM_ENTRIES_OF(block);
+    PBFS_DMM_Trailer* leaf = DMM_TRAILER(mnt, block);
+    uint64_t cap = mnt->header64.dmm_entries;
+    uint64_t pos = btree_leaf_pos(entries, leaf->entry_count, entry->name);
+    if (pos < leaf->entry_count && strncmp(entries[pos].name, entry->name, PBFS_MAX_NAME_LEN) == 0) return PBFS_ERR_File_Already_Exists;
+
+    if (leaf->entry_count < cap) {
+        memmove(&entries[pos + 1], &entries[pos], (leaf->entry_count - pos) * sizeof(PBFS_DMM_Entry));
+        entries[pos] = *entry;
+        leaf->entry_count++;
+        return dmm_write(mnt, leaf_lba, block);
+    }
+
+    // Split the leaf, the upper half moves to a new leaf linked right after it
+    PBFS_DMM_Entry all[cap + 1];
+    memcpy(all, entries, pos * sizeof(PBFS_DMM_Entry));
+    all[pos] = *entry;
+    memcpy(&all[pos + 1], &entries[pos], (cap - pos) * sizeof(PBFS_DMM_Entry));
+    uint64_t left = (cap + 1) / 2;
+
+    uint64_t right_lba = btree_alloc(mnt);
+    if (right_lba <= 1) return PBFS_ERR_No_Space_Left;
+
+    DMM_BLOCK(mnt, right);
+    memset(right, 0, mnt->header64.block_size);
+    memcpy(DMM_ENTRIES_OF(right), &all[left], (cap + 1 - left) * sizeof(PBFS_DMM_Entry));
+    DMM_TRAILER(mnt, right)->entry_count = cap + 1 - left;
+    DMM_TRAILER(mnt, right)->extender_lba = leaf->extender_lba;
+    out = dmm_write(mnt, right_lba, right);
+    if (out != PBFS_RES_SUCCESS) return out;
+
+    memset(entries, 0, cap * sizeof(PBFS_DMM_Entry));
+    memcpy(entries, all, left * sizeof(PBFS_DMM_Entry));
+    leaf->entry_count = left;
+    leaf->extender_lba = uint128_from_u64(right_lba);
+    out = dmm_write(mnt, leaf_lba, block);
+    if (out != PBFS_RES_SUCCESS) return out;
+
+    // Entries changed blocks
+    dcache_invalidate_dir(mnt, dir_lba);
+
+    // Push the separator up, splitting full nodes on the way
+    PBFS_DMM_Node_Key key = {0};
+    memcpy(key.name, all[left].name, PBFS_MAX_NAME_LEN);
+    key.child = right_lba;
+
+    uint64_t node_cap = DMM_NODE_KEYS(mnt);
+    PBFS_DMM_Node* node = (PBFS_DMM_Node*)block;
+    PBFS_DMM_Node_Key* keys = DMM_NODE_KEYS_OF(block);
+    for (int level = (int)head->btree_depth - 1; level >= 0; level--) {
+        out = pbfs_read(mnt, path[level], mnt->header64.block_size, block);
+        if (out != PBFS_RES_SUCCESS) return out;
+        if (node->key_count > node_cap) return PBFS_ERR_DMM_Corrupted;
+
+        uint64_t kpos = btree_node_pos(keys, node->key_count, key.name);
+        if (node->key_count < node_cap) {
+            memmove(&keys[kpos + 1], &keys[kpos], (node->key_count - kpos) * sizeof(PBFS_DMM_Node_Key));
+            keys[kpos] = key;
+            node->key_count++;
+            return pbfs_write(mnt, path[level], mnt->header64.block_size, block);
+        }
+
+        PBFS_DMM_Node_Key all_keys[node_cap + 1];
+        memcpy(all_keys, keys, kpos * sizeof(PBFS_DMM_Node_Key));
+        all_keys[kpos] = key;
+        memcpy(&all_keys[kpos + 1], &keys[kpos], (node_cap - kpos) * sizeof(PBFS_DMM_Node_Key));
+        uint64_t mid = (node_cap + 1) / 2; // Moves up, its child becomes the new node's first child
+
+        uint64_t node_lba = btree_alloc(mnt);
+        if (node_lba <= 1) return PBFS_ERR_No_Space_Left;
+
+        memset(right, 0, mnt->header64.block_size);
+        ((PBFS_DMM_Node*)right)->key_count = node_cap - mid;
+        ((PBFS_DMM_Node*)right)->first_child = all_keys[mid].child;
+        memcpy(DMM_NODE_KEYS_OF(right), &all_keys[mid + 1], (node_cap - mid) * sizeof(PBFS_DMM_Node_Key));
+        out = pbfs_write(mnt, node_lba, mnt->header64.block_size, right);
+        if (out != PBFS_RES_SUCCESS) return out;
+
+        memset(keys, 0, node_cap * sizeof(PBFS_DMM_Node_Key));
+        memcpy(keys, all_keys, mid * sizeof(PBFS_DMM_Node_Key));
+        node->key_count = mid;
+        out = pbfs_write(mnt, path[level], mnt->header64.block_size, block);
+        if (out != PBFS_RES_SUCCESS) return out;
+
+        key = all_keys[mid];
+        key.child = node_lba;
+    }
+
+    // The root split, grow the tree by one level
+    if (head->btree_depth >= PBFS_MAX_BTREE_DEPTH) return PBFS_ERR_No_Space_Left;
+    uint64_t root_lba = btree_alloc(mnt);
+    if (root_lba <= 1) return PBFS_ERR_No_Space_Left;
+
+    memset(block, 0, mnt->header64.block_size);
+    node->key_count = 1;
+    node->first_child = head->btree_root;
+    keys[0] = key;
+    out = pbfs_write(mnt, root_lba, mnt->header64.block_size, block);
+    if (out != PBFS_RES_SUCCESS) return out;
+
+    head->btree_root = root_lba;
+    head->btree_depth++;
+    return dmm_write(mnt, dir_lba, head_block);
+}
+
+// Frees the internal nodes of a B+tree, a level at a time
+static int btree_free_nodes(struct pbfs_mount* mnt, PBFS_DMM_Trailer* head, struct discard_batch* batch) {
+    if (head->btree_root <= 1 || head->btree_depth == 0) return PBFS_RES_SUCCESS;
+    if (head->btree_depth > PBFS_MAX_BTREE_DEPTH) return PBFS_ERR_DMM_Corrupted;
+
+    uint64_t* level = funcs.malloc(sizeof(uint64_t));
+    if (!level) return PBFS_ERR_Allocation_Failed;
+    level[0] = head->btree_root;
+    uint64_t count = 1;
+
+    DMM_BLOCK(mnt, block);
+    PBFS_DMM_Node* node = (PBFS_DMM_Node*)block;
+    for (uint32_t depth = 0; depth < head->btree_depth; depth++) {
+        bool children_internal = depth + 1 < head->btree_depth;
+        uint64_t* next = NULL;
+        uint64_t next_count = 0;
+
+        for (uint64_t i = 0; i < count; i++) {
+            if (children_internal) {
+                int out = pbfs_read(mnt, level[i], mnt->header64.block_size, block);
+                if (out == PBFS_RES_SUCCESS && node->key_count > DMM_NODE_KEYS(mnt)) out = PBFS_ERR_DMM_Corrupted;
+
+                uint64_t* nptr = out == PBFS_RES_SUCCESS ? funcs.realloc(next, (next_count + node->key_count + 1) * sizeof(uint64_t)) : NULL;
+                if (!nptr) {
+                    funcs.free(next);
+                    funcs.free(level);
+                    return out != PBFS_RES_SUCCESS ? out : PBFS_ERR_Allocation_Failed;
+                }
+                next = nptr;
+                next[next_count++] = node->first_child;
+                for (uint64_t k = 0; k < node->key_count; k++) next[next_count++] = DMM_NODE_KEYS_OF(block)[k].child;
+            }
+            free_blocks(mnt, level[i], 1, batch);
+        }
+
+        funcs.free(level);
+        level = next;
+        count = next_count;
+    }
+    funcs.free(level);
+    return PBFS_RES_SUCCESS;
+}
+
+static void heap_swap(uint8_t* a, uint8_t* b, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        uint8_t tmp = a[i];
+        a[i] = b[i];
+        b[i] = tmp;
+    }
+}
+
+static void heap_sift(uint8_t* base, size_t size, int (*cmp)(const void*, const void*), uint64_t root, uint64_t end) {
+    while (root * 2 + 1 < end) {
+        uint64_t child = root * 2 + 1;
+        if (child + 1 < end && cmp(base + child * size, base + (child + 1) * size) < 0) child++;
+        if (cmp(base + root * size, base + child * size) >= 0) return;
+
+        heap_swap(base + root * size, base + child * size, size);
+        root = child;
+    }
+}
+
+// Heapsort, since there is no qsort when freestanding
+static void heap_sort(void* base, uint64_t n, size_t size, int (*cmp)(const void*, const void*)) {
+    uint8_t* b = base;
+    for (uint64_t start = n / 2; start > 0; start--) heap_sift(b, size, cmp, start - 1, n);
+    for (uint64_t end = n; end > 1; end--) {
+        heap_swap(b, b + (end - 1) * size, size);
+        heap_sift(b, size, cmp, 0, end - 1);
+    }
+}
+
+static int dmm_entry_cmp(const void* a, const void* b) {
+    return strncmp(((const PBFS_DMM_Entry*)a)->name, ((const PBFS_DMM_Entry*)b)->name, PBFS_MAX_NAME_LEN);
+}
+
+struct btree_build_node {
+    uint64_t lba;
+    char name[PBFS_MAX_NAME_LEN]; // Lowest name under the node
+};
+
+// Writes sorted entries out as leaves packed 3/4 full (so inserts don't split straight away) and the internal
+// levels above them. level has room for one node per leaf.
+static int btree_bulk_load(struct pbfs_mount* mnt, PBFS_DMM_Entry* all, uint64_t count, struct btree_build_node* level, uint64_t leaves, uint64_t* first_leaf, uint32_t* depth) {
+    uint64_t per_leaf = (count + leaves - 1) / leaves;
+
+    // Leaves go in one extent when there is room, so in-order streaming reads are sequential
+    uint64_t extent = bitmap_find_blocks(&mnt->root_bitmap64, mnt->header64.data_start_lba, leaves, mnt);
+    for (uint64_t i = 0; i < leaves; i++) {
+        if (extent > 1) {
+            level[i].lba = extent + i;
+            bitmap_set(&mnt->root_bitmap, level[i].lba, mnt->header64.bitmap_lba, 0, mnt, 1);
+        } else {
+            level[i].lba = btree_alloc(mnt);
+        }
+        if (level[i].lba <= 1) return PBFS_ERR_No_Space_Left;
+    }
+    *first_leaf = level[0].lba;
+
+    DMM_BLOCK(mnt, block);
+    PBFS_DMM_Trailer* dmm = DMM_TRAILER(mnt, block);
+    for (uint64_t i = 0; i < leaves; i++) {
+        uint64_t first = i * per_leaf;
+        uint64_t n = first < count ? (count - first < per_leaf ? count - first : per_leaf) : 0;
+
+        memset(block, 0, mnt->header64.block_size);
+        memcpy(DMM_ENTRIES_OF(block), &all[first], n * sizeof(PBFS_DMM_Entry));
+        dmm->entry_count = n;
+        if (i + 1 < leaves) dmm->extender_lba = uint128_from_u64(level[i + 1].lba);
+        if (n > 0) memcpy(level[i].name, all[first].name, PBFS_MAX_NAME_LEN);
+
+        int out = dmm_write(mnt, level[i].lba, block);
+        if (out != PBFS_RES_SUCCESS) return out;
+    }
+
+    uint64_t per_node = DMM_NODE_KEYS(mnt) * 3 / 4 + 1; // Children per node
+    if (per_node < 2) per_node = 2;
+    PBFS_DMM_Node* node = (PBFS_DMM_Node*)block;
+    uint64_t level_count = leaves;
+    *depth = 0;
+    while (level_count > 1) {
+        if (*depth >= PBFS_MAX_BTREE_DEPTH) return PBFS_ERR_No_Space_Left;
+
+        uint64_t nodes = (level_count + per_node - 1) / per_node;
+        for (uint64_t n = 0; n < nodes; n++) {
+            uint64_t first = n * per_node;
+            uint64_t children = level_count - first < per_node ? level_count - first : per_node;
+
+            memset(block, 0, mnt->header64.block_size);
+            node->first_child = level[first].lba;
+            node->key_count = children - 1;
+            for (uint64_t k = 1; k < children; k++) {
+                memcpy(DMM_NODE_KEYS_OF(block)[k - 1].name, level[first + k].name, PBFS_MAX_NAME_LEN);
+                DMM_NODE_KEYS_OF(block)[k - 1].child = level[first + k].lba;
+            }
+
+            uint64_t node_lba = btree_alloc(mnt);
+            if (node_lba <= 1) return PBFS_ERR_No_Space_Left;
+            int out = pbfs_write(mnt, node_lba, mnt->header64.block_size, block);
+            if (out != PBFS_RES_SUCCESS) return out;
+
+            // Built in place, node n only overwrites slots already consumed
+            level[n].lba = node_lba;
+            memmove(level[n].name, level[first].name, PBFS_MAX_NAME_LEN);
+        }
+        level_count = nodes;
+        (*depth)++;
+    }
+    return PBFS_RES_SUCCESS;
+}
+
+// Rebuilds the directory at dir_lba as a B+tree holding all its entries
+// Copies out every entry of a directory and the lba of every block it walked (first DMM block included)
+static int dmm_gather(struct pbfs_mount* mnt, uint64_t dir_lba, PBFS_DMM_Entry** all_out, uint64_t* count_out, uint64_t** lbas_out, uint64_t* lba_count_out) {
+    PBFS_DMM_Entry* all = NULL;
+    uint64_t count = 0;
+    uint64_t* lbas = NULL;
+    uint64_t lba_count = 0;
+
+    DMM_BLOCK(mnt, block);
+    PBFS_DMM_Trailer* dmm = DMM_TRAILER(mnt, block);
+    uint64_t iter_lba = dir_lba;
+    for (uint64_t chain = 0; chain < mnt->header64.total_blocks && iter_lba > 1; chain++) {
+        int out = dmm_read(mnt, iter_lba, block);
+        void* nall = out == PBFS_RES_SUCCESS ? funcs.realloc(all, (count + dmm->entry_count + 1) * sizeof(PBFS_DMM_Entry)) : NULL;
+        if (nall) all = nall;
+        void* nlbas = nall ? funcs.realloc(lbas, (lba_count + 1) * sizeof(uint64_t)) : NULL;
+        if (!nlbas) {
+            funcs.free(all);
+            funcs.free(lbas);
+            return out != PBFS_RES_SUCCESS ? out : PBFS_ERR_Allocation_Failed;
+        }
+        lbas = nlbas;
+
+        memcpy(&all[count], DMM_ENTRIES_OF(block), dmm->entry_count * sizeof(PBFS_DMM_Entry));
+        count += dmm->entry_count;
+        lbas[lba_count++] = iter_lba;
+        iter_lba = uint128_to_u64(dmm->extender_lba);
+    }
+
+    *all_out = all;
+    *count_out = count;
+    *lbas_out = lbas;
+    *lba_count_out = lba_count;
+    return PBFS_RES_SUCCESS;
+}
+
+static int btree_build(struct pbfs_mount* mnt, uint64_t dir_lba) {
+    // Volumes without PBFS_FEATURE_DIR_BTREE never convert a directory
+    if (!(mnt->header64.features & PBFS_FEATURE_DIR_BTREE)) return PBFS_RES_SUCCESS;
+
+    DMM_BLOCK(mnt, head_block);
+    int out = dmm_read(mnt, dir_lba, head_block);
+    if (out != PBFS_RES_SUCCESS) return out;
+    PBFS_DMM_Trailer* head = DMM_TRAILER(mnt, head_block);
+
+    // Gather every entry plus the blocks they sit in now (plain chain or old leaves)
+    PBFS_DMM_Entry* all = NULL;
+    uint64_t count = 0;
+    uint64_t* old = NULL;
+    uint64_t old_count = 0;
+    out = dmm_gather(mnt, dir_lba, &all, &count, &old, &old_count);
+    if (out != PBFS_RES_SUCCESS) return out;
+    heap_sort(all, count, sizeof(PBFS_DMM_Entry), dmm_entry_cmp);
+
+    uint64_t per_leaf = mnt->header64.dmm_entries * 3 / 4;
+    if (per_leaf < 1) per_leaf = 1;
+    uint64_t leaves = (count + per_leaf - 1) / per_leaf;
+    if (leaves < 1) leaves = 1;
+
+    uint32_t depth = 0;
+    uint64_t first_leaf = 0;
+    struct btree_build_node* level = funcs.malloc(leaves * sizeof(struct btree_build_node));
+    if (!level) out = PBFS_ERR_Allocation_Failed;
+    else {
+        memset(level, 0, leaves * sizeof(struct btree_build_node));
+        out = btree_bulk_load(mnt, all, count, level, leaves, &first_leaf, &depth);
+    }
+
+    if (out == PBFS_RES_SUCCESS) {
+        // Only now let go of the old layout
+        struct discard_batch batch = {0};
+        btree_free_nodes(mnt, head, &batch);
+        for (uint64_t i = 1; i < old_count; i++) free_blocks(mnt, old[i], 1, &batch);
+        if (head->index_lba > 1) free_blocks(mnt, head->index_lba, head->index_blocks, &batch);
+        discard_flush(mnt, &batch);
+
+        memset(head_block, 0, mnt->header64.dmm_entries * sizeof(PBFS_DMM_Entry));
+        head->entry_count = 0;
+        head->index_lba = 0;
+        head->index_blocks = 0;
+        head->index_used = 0;
+        head->btree_root = level[0].lba;
+        head->btree_depth = depth;
+        head->extender_lba = uint128_from_u64(first_leaf);
+        out = dmm_write(mnt, dir_lba, head_block);
+        dcache_invalidate_dir(mnt, dir_lba);
+    }
+
+    funcs.free(level);
+    funcs.free(all);
+    funcs.free(old);
+    return out;
+}
+
+// Packs a plain chain into the fewest blocks and frees the extenders left over, B+tree directories get rebuilt
+static int dmm_compact(struct pbfs_mount* mnt, uint64_t dir_lba) {
+    DMM_BLOCK(mnt, head_block);
+    int out = dmm_read(mnt, dir_lba, head_block);
+    if (out != PBFS_RES_SUCCESS) return out;
+    PBFS_DMM_Trailer* head = DMM_TRAILER(mnt, head_block);
+    if (head->btree_root > 1) return btree_build(mnt, dir_lba);
+
+    PBFS_DMM_Entry* all = NULL;
+    uint64_t count = 0;
+    uint64_t* lbas = NULL;
+    uint64_t lba_count = 0;
+    out = dmm_gather(mnt, dir_lba, &all, &count, &lbas, &lba_count);
+    if (out != PBFS_RES_SUCCESS) return out;
+
+    uint64_t per_block = mnt->header64.dmm_entries;
+    uint64_t used = (count + per_block - 1) / per_block;
+    if (used < 1) used = 1;
+    if (used >= lba_count) {
+        funcs.free(all);
+        funcs.free(lbas);
+        return PBFS_RES_SUCCESS;
+    }
+
+    // Rewrite from the last block kept back to the head so the chain never links to a half written block
+    DMM_BLOCK(mnt, block);
+    PBFS_DMM_Trailer* dmm = DMM_TRAILER(mnt, block);
+    for (uint64_t b = used; b-- > 0;) {
+        uint64_t first = b * per_block;
+        uint64_t n = count - first < per_block ? count - first : per_block;
+        if (b == 0) memcpy(block, head_block, mnt->header64.block_size);
+        else memset(block, 0, mnt->header64.block_size);
+
+        memset(DMM_ENTRIES_OF(block), 0, per_block * sizeof(PBFS_DMM_Entry));
+        memcpy(DMM_ENTRIES_OF(block), &all[first], n * sizeof(PBFS_DMM_Entry));
+        dmm->entry_count = n;
+        dmm->extender_lba = uint128_from_u64(b + 1 < used ? lbas[b + 1] : 0);
+        if (b == 0 && head->index_lba > 1 && used < PBFS_DMM_INDEX_THRESHOLD) {
+            dmm->index_lba = 0;
+            dmm->index_blocks = 0;
+            dmm->index_used = 0;
+        }
+
+        out = dmm_write(mnt, lbas[b], block);
+        if (out != PBFS_RES_SUCCESS) break;
+    }
+
+    if (out == PBFS_RES_SUCCESS) {
+        struct discard_batch batch = {0};
+        for (uint64_t i = used; i < lba_count; i++) free_blocks(mnt, lbas[i], 1, &batch);
+        if (head->index_lba > 1 && used < PBFS_DMM_INDEX_THRESHOLD) free_blocks(mnt, head->index_lba, head->index_blocks, &batch);
+        discard_flush(mnt, &batch);
+
+        // Entries moved between blocks, the index has to point at their new homes
+        if (head->index_lba > 1 && used >= PBFS_DMM_INDEX_THRESHOLD) out = dmm_index_build(mnt, dir_lba);
+        dcache_invalidate_dir(mnt, dir_lba);
+    }
+
+    funcs.free(all);
+    funcs.free(lbas);
+    return out;
+}
+
+// Frees everything a directory owns besides its first DMM block: hashed index, B+tree nodes and the rest of the chain
+static int free_dir_blocks(struct pbfs_mount* mnt, uint64_t dir_lba, struct discard_batch* batch) {
+    DMM_BLOCK(mnt, block);
+    int out = dmm_read(mnt, dir_lba, block);
+    if (out != PBFS_RES_SUCCESS) return out;
+
+    PBFS_DMM_Trailer* dmm = DMM_TRAILER(mnt, block);
+    if (dmm->index_lba > 1) free_blocks(mnt, dmm->index_lba, dmm->index_blocks, batch);
+    out = btree_free_nodes(mnt, dmm, batch);
+    if (out != PBFS_RES_SUCCESS) return out;
+
+    // B+tree leaves can outnumber PBFS_MAX_DMM_CHAIN, only the volume bounds them
+    uint64_t iter_lba = uint128_to_u64(dmm->extender_lba);
+    for (uint64_t chain = 1; chain < mnt->header64.total_blocks && iter_lba > 1; chain++) {
+        out = dmm_read(mnt, iter_lba, block);
+        if (out != PBFS_RES_SUCCESS) return out;
+
+        free_blocks(mnt, iter_lba, 1, batch);
+        iter_lba = uint128_to_u64(dmm->extender_lba);
+    }
+    return PBFS_RES_SUCCESS;
+}
+
+static int add_dmm_entry(struct pbfs_mount* mnt, uint64_t dir_lba, uint64_t lba, char* name, PBFS_Metadata_Flags type, PBFS_Permission_Flags perms, uint64_t created_ts, uint64_t modified_ts) {
+    DMM_BLOCK(mnt, block);
+    PBFS_DMM_Entry* entries = DMM_ENTRIES_OF(block);
+    PBFS_DMM_Trailer* dmm = DMM_TRAILER(mnt, block);
+    uint64_t cur_lba = dir_lba;
+    dcache_invalidate(mnt, dir_lba, name);
+    bloom_add(mnt, dir_lba, name);
+
+    for (int depth = 0; depth < PBFS_MAX_DMM_CHAIN; depth++) {
+        int out = dmm_read(mnt, cur_lba, block);
+        if (out != PBFS_RES_SUCCESS) return out;
+
+        if (depth == 0 && dmm->btree_root > 1) {
+            PBFS_DMM_Entry entry = {0};
+            fill_dmm_entry(&entry, lba, name, type, perms, created_ts, modified_ts);
+            return btree_insert(mnt, dir_lba, block, &entry);
+        }
+
+        // If there is space in current DMM, add the entry
+        if (dmm->entry_count < mnt->header64.dmm_entries) {
+            fill_dmm_entry(&entries[dmm->entry_count], lba, name, type, perms, created_ts, modified_ts);
+            dmm->entry_count++;
+
+            out = dmm_write(mnt, cur_lba, block);
+            if (out != PBFS_RES_SUCCESS) return out;
+
+            // Removals leave free slots mid-chain, the blocks past this one count toward the chain too
+            uint64_t chain_blocks = depth + 1;
+            for (uint64_t next = uint128_to_u64(dmm->extender_lba); next > 1 && chain_blocks < PBFS_DMM_BTREE_THRESHOLD; chain_blocks++) {
+                out = dmm_read(mnt, next, block);
+                if (out != PBFS_RES_SUCCESS) return out;
+                next = uint128_to_u64(dmm->extender_lba);
+            }
+
+            if (chain_blocks >= PBFS_DMM_BTREE_THRESHOLD && (mnt->header64.features & PBFS_FEATURE_DIR_BTREE)) return btree_build(mnt, dir_lba);
+            return dmm_index_insert(mnt, dir_lba, name, cur_lba, chain_blocks);
+        }
+
+        // If current DMM is full, check for extender
+        uint64_t ext_lba = uint128_to_u64(dmm->extender_lba);
+        if (ext_lba > 1) {
+            cur_lba = ext_lba;
+            continue;
+        }
+
+        // Need to allocate a new extender block
+        DMM_BLOCK(mnt, new_extender);
+        memset(new_extender, 0, mnt->header64.block_size);
+        DMM_TRAILER(mnt, new_extender)->entry_count = 1;
+        fill_dmm_entry(&DMM_ENTRIES_OF(new_extender)[0], lba, name, type, perms, created_ts, modified_ts);
+
+        uint64_t new_ext_lba = bitmap_find_blocks(&mnt->root_bitmap64, mnt->header64.data_start_lba, 1, mnt);
+        if (new_ext_lba <= 1) return PBFS_ERR_No_Space_Left;
+
+        // Write new extender to disk
+        out = dmm_write(mnt, new_ext_lba, new_extender);
+        if (out != PBFS_RES_SUCCESS) return out;
+        bitmap_set(&mnt->root_bitmap, new_ext_lba, mnt->header64.bitmap_lba, 0, mnt, 1);
+
+        // Link current DMM to extender
+        dmm->extender_lba = uint128_from_u64(new_ext_lba);
+        out = dmm_write(mnt, cur_lba, block);
+        if (out != PBFS_RES_SUCCESS) return out;
+
+        // The new extender is the tail, so the chain is exactly depth + 2 blocks long
+        uint64_t chain_blocks = depth + 2;
+        if (chain_blocks >= PBFS_DMM_BTREE_THRESHOLD && (mnt->header64.features & PBFS_FEATURE_DIR_BTREE)) return btree_build(mnt, dir_lba);
+        return dmm_index_insert(mnt, dir_lba, name, new_ext_lba, chain_blocks);
+    }
+
+    return PBFS_ERR_No_Space_Left;
+}
+
+// dir_lba = first DMM block of the directory, cur_dmm_lba = DMM block to start searching from
+// Unlinks and frees the (now empty) extender at lba from a plain chain, B+tree leaves are left to dmm_compact
+static int dmm_unlink_block(struct pbfs_mount* mnt, uint64_t dir_lba, uint64_t lba, uint64_t next_lba) {
+    DMM_BLOCK(mnt, block);
+    PBFS_DMM_Trailer* dmm = DMM_TRAILER(mnt, block);
+    uint64_t iter_lba = dir_lba;
+    for (int chain = 0; chain < PBFS_MAX_DMM_CHAIN && iter_lba > 1; chain++) {
+        int out = dmm_read(mnt, iter_lba, block);
+        if (out != PBFS_RES_SUCCESS) return out;
+        if (chain == 0 && dmm->btree_root > 1) return PBFS_RES_SUCCESS;
+
+        if (uint128_to_u64(dmm->extender_lba) == lba) {
+            dmm->extender_lba = uint128_from_u64(next_lba);
+            out = dmm_write(mnt, iter_lba, block);
+            if (out != PBFS_RES_SUCCESS) return out;
+
+            struct discard_batch batch = {0};
+            free_blocks(mnt, lba, 1, &batch);
+            discard_flush(mnt, &batch);
+            return PBFS_RES_SUCCESS;
+        }
+        iter_lba = uint128_to_u64(dmm->extender_lba);
+    }
+    return PBFS_ERR_DMM_Corrupted;
+}
+
+static int remove_dmm_entry(struct pbfs_mount* mnt, char* name_, uint64_t dir_lba, uint64_t cur_dmm_lba) {
+    DMM_BLOCK(mnt, block);
+    PBFS_DMM_Entry* entries = DMM_ENTRIES_OF(block);
+    PBFS_DMM_Trailer* dmm = DMM_TRAILER(mnt, block);
+
+    uint64_t current_lba = cur_dmm_lba;
+    char name[PBFS_MAX_NAME_LEN];
+    path_basename(name_, name, PBFS_MAX_NAME_LEN);
+    dcache_invalidate(mnt, dir_lba, name);
+    uint32_t hash = dmm_name_hash(name);
+
+    for (int depth = 0; depth < PBFS_MAX_DMM_CHAIN; depth++) {
+        int out = dmm_read(mnt, current_lba, block);
+        if (out != PBFS_RES_SUCCESS) return out;
+
+        int found_idx = dmm_block_find(mnt, block, name, hash);
+
+        if (found_idx != -1 && dmm->entry_count > 0) {
+            // Shift entries left to fill the gap
+            for (uint32_t i = found_idx; i < dmm->entry_count - 1; i++) {
+                entries[i] = entries[i + 1];
+            }
+            dmm->entry_count--;
+			memset(&entries[dmm->entry_count], 0, sizeof(PBFS_DMM_Entry));
+
+            // Write updated DMM block
+            out = dmm_write(mnt, current_lba, block);
+            if (out != PBFS_RES_SUCCESS) return out;
+            out = dmm_index_remove(mnt, dir_lba, name, current_lba);
+            if (out != PBFS_RES_SUCCESS || dmm->entry_count > 0 || current_lba == dir_lba) return out;
+
+            // Nothing left in this extender, take it out of the chain
+            return dmm_unlink_block(mnt, dir_lba, current_lba, uint128_to_u64(dmm->extender_lba));
+        }
+
+        if (UINT128_GT(dmm->extender_lba, UINT128_ZERO)) {
+            current_lba = uint128_to_u64(dmm->extender_lba);
+        } else {
+            break;
+        }
+    }
+
+    return PBFS_ERR_File_Not_Found;
+}
+
+// Looks a name up in one directory on the device, through its hashed index when it has one
+static int scan_dir(struct pbfs_mount* mnt, uint64_t dir_lba, const char* name, PBFS_DMM_Entry* out, uint64_t* out_lba) {
+    uint64_t iter_lba = dir_lba;
+    DMM_BLOCK(mnt, block);
+    PBFS_DMM_Entry* entries = DMM_ENTRIES_OF(block);
+    PBFS_DMM_Trailer* dmm = DMM_TRAILER(mnt, block);
+    uint32_t hash = dmm_name_hash(name);
+    for (int chain = 0; chain < PBFS_MAX_DMM_CHAIN && iter_lba > 0; chain++) {
+        int res = dmm_read(mnt, iter_lba, block);
+        if (res != PBFS_RES_SUCCESS) return res;
+
+        if (chain == 0 && dmm->btree_root > 1) return btree_find(mnt, dmm, name, out, out_lba);
+        if (chain == 0 && dmm->index_lba > 1) return dmm_index_find(mnt, dmm, name, out, out_lba);
+
+        int i = dmm_block_find(mnt, block, name, hash);
+        if (i >= 0) {
+            *out = entries[i];
+            *out_lba = iter_lba;
+            return PBFS_RES_SUCCESS;
+        }
+        iter_lba = uint128_to_u64(dmm->extender_lba);
+    }
+    if (iter_lba > 0) return PBFS_ERR_DMM_Corrupted;
+    return PBFS_ERR_File_Not_Found;
+}
+
+// First DMM block of the directory described by entry, only volumes without PBFS_FEATURE_DIR_ADJACENT need the metadata for it
+static int dir_dmm_lba(struct pbfs_mount* mnt, PBFS_DMM_Entry* entry, uint64_t* out) {
+    if (mnt->header64.features & PBFS_FEATURE_DIR_ADJACENT) {
+        *out = uint128_to_u64(entry->lba) + 1;
+        return PBFS_RES_SUCCESS;
+    }
+
+    PBFS_Metadata md = {0};
+    int res = pbfs_read(mnt, uint128_to_u64(entry->lba), sizeof(PBFS_Metadata), &md);
+    if (res != PBFS_RES_SUCCESS) return res;
+    if (md.data_offset < 1) return PBFS_ERR_Invalid_File_Or_Directory;
+
+    *out = uint128_to_u64(entry->lba) + md.data_offset;
+    return PBFS_RES_SUCCESS;
+}
+
+// A name that stays inside the directory it is used in: no separators, not "." or ".."
+static bool is_plain_name(const char* name) {
+    size_t len = strlen(name);
+    if (len >= PBFS_MAX_NAME_LEN) return false;
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) return false;
+    for (size_t i = 0; i < len; i++) {
+        if (name[i] == '/') return false;
+    }
+    return true;
+}
+
+// Looks name up in one directory, dentry cache first. *child_lba = its first DMM block when the cache knows it (0 otherwise)
+static int dir_lookup(struct pbfs_mount* mnt, uint64_t dir_lba, const char* name, PBFS_DMM_Entry* out, uint64_t* out_lba, uint64_t* child_lba) {
+    struct pbfs_dcache_entry de;
+    *child_lba = 0;
+    if (dcache_lookup(mnt, dir_lba, name, &de)) {
+        if (de.negative) return PBFS_ERR_File_Not_Found;
+        *out = de.entry;
+        *out_lba = de.dmm_lba;
+        *child_lba = de.child_lba;
+        return PBFS_RES_SUCCESS;
+    }
+
+    // Most misses never touch the device, the first one in a directory pays for its filter
+    int filter = bloom_test(mnt, dir_lba, dmm_name_hash(name));
+    int out_res = filter == 0 ? PBFS_ERR_File_Not_Found : scan_dir(mnt, dir_lba, name, out, out_lba);
+    if (out_res != PBFS_RES_SUCCESS && out_res != PBFS_ERR_File_Not_Found) return out_res;
+    if (out_res == PBFS_ERR_File_Not_Found && filter < 0) bloom_build(mnt, dir_lba);
+
+    memset(&de, 0, sizeof(de));
+    de.dir_lba = dir_lba;
+    strncpy(de.name, name, PBFS_MAX_NAME_LEN);
+    de.negative = out_res == PBFS_ERR_File_Not_Found;
+    if (!de.negative) {
+        de.entry = *out;
+        de.dmm_lba = *out_lba;
+    }
+    dcache_store(mnt, &de);
+    return out_res;
+}
+
+// Target path of a symlink (its file data), cached per link
+static int symlink_target(struct pbfs_mount* mnt, PBFS_DMM_Entry* link, char* target, size_t target_size) {
+    uint64_t link_lba = uint128_to_u64(link->lba);
+    if (symlink_cached_target(mnt, link_lba, target, target_size)) return PBFS_RES_SUCCESS;
+
+    PBFS_Metadata md = {0};
+    int res = pbfs_read(mnt, link_lba, sizeof(PBFS_Metadata), &md);
+    if (res != PBFS_RES_SUCCESS) return res;
+
+    // Appends may have spread it over extenders
+    struct pbfs_file file = {0};
+    res = file_map(mnt, link_lba, &md, &file);
+    if (res == PBFS_RES_SUCCESS && file.size < 1) res = PBFS_ERR_Invalid_File_Or_Directory;
+    if (res == PBFS_RES_SUCCESS && file.size >= target_size) res = PBFS_ERR_Invalid_Path;
+    for (uint64_t i = 0; i < file.extent_count && res == PBFS_RES_SUCCESS; i++) {
+        res = extent_io(mnt, &file.extents[i], 0, file.extents[i].size, (uint8_t*)target + file.extents[i].file_offset, false);
+    }
+    if (file.extents) funcs.free(file.extents);
+    if (res != PBFS_RES_SUCCESS) return res;
+    target[file.size] = 0;
+
+    symlink_store_target(mnt, link_lba, target);
+    return PBFS_RES_SUCCESS;
+}
+
+// Resolves path against the directory whose first DMM block is base_lba (absolute paths start at the root).
+// out_lba = DMM block holding the entry, out_dir_lba (optional) = first DMM block of the directory holding it,
+// -1 = path names base_lba or the root itself (*out_dir_lba = it).
+// Symlinks met on the way are always followed, follow decides for the last component.
+// not_under (0 = unused) = first DMM block of a directory the result must not lie in (at any depth).
+static int find_dmm_entry_at(struct pbfs_mount* mnt, uint64_t base_lba, const char* path, PBFS_DMM_Entry* out, uint64_t* out_lba, uint64_t* out_dir_lba, bool follow, uint64_t not_under) {
+    char normalized[PBFS_MAX_PATH_LEN];
+    path_normalize((char*)path, normalized, PBFS_MAX_PATH_LEN);
+    if (normalized[0] == '/') base_lba = mnt->header64.dmm_root_lba;
+
+    // Directories walked so far and where their names start in normalized, for ".."
+    // (per call, lookups share nothing but the dentry and symlink caches)
+    uint64_t parents[PBFS_MAX_PATH_DEPTH];
+    int name_pos[PBFS_MAX_PATH_DEPTH];
+    parents[0] = base_lba;
+    uint64_t current_dmm_lba = parents[0];
+    char part[PBFS_MAX_NAME_LEN];
+    int depth = 0;
+    int pos = 0;
+    bool found = false;
+
+    // Symlinks followed, as (link, rest of the path) so coming back to one with the same rest is a loop
+    uint32_t max_hops = mnt->symlink_hops < PBFS_MAX_SYMLINK_HOPS ? mnt->symlink_hops : PBFS_MAX_SYMLINK_HOPS;
+    uint64_t seen_link[PBFS_MAX_SYMLINK_HOPS];
+    uint32_t seen_rest[PBFS_MAX_SYMLINK_HOPS];
+    uint32_t hops = 0;
+    uint64_t gen = dcache_gen(mnt);
+    uint64_t cache_link = 0; // Last component symlink with an absolute target, gets the final result cached
+
+    for (int start = pos; path_next(normalized, &pos, part, PBFS_MAX_NAME_LEN) > 0; start = pos) {
+        found = false;
+
+		if (strcmp(part, ".") == 0) {
+			continue;
+		} else if (strcmp(part, "..") == 0) {
+			if (depth > 0) depth--;
+			current_dmm_lba = parents[depth];
+			continue;
+		}
+
+        uint64_t child_lba = 0;
+        int out_res = dir_lookup(mnt, current_dmm_lba, part, out, out_lba, &child_lba);
+        if (out_res != PBFS_RES_SUCCESS) return out_res;
+        if (out_dir_lba) *out_dir_lba = current_dmm_lba;
+        found = true;
+
+        bool last = normalized[pos] == 0;
+        if ((out->type & METADATA_FLAG_SYMLINK) && (follow || !last)) {
+            uint64_t link_lba = uint128_to_u64(out->lba);
+            if (last && not_under == 0 && symlink_cached_final(mnt, link_lba, gen, out, out_lba, out_dir_lba)) return PBFS_RES_SUCCESS;
+
+            uint32_t rest = crc32(normalized + pos, strlen(normalized + pos));
+            for (uint32_t i = 0; i < hops; i++) {
+                if (seen_link[i] == link_lba && seen_rest[i] == rest) return PBFS_ERR_Too_Many_Symlinks;
+            }
+            if (hops >= max_hops) return PBFS_ERR_Too_Many_Symlinks;
+            seen_link[hops] = link_lba;
+            seen_rest[hops] = rest;
+            hops++;
+
+            // Put the target where the link's name was: absolute targets restart at the root,
+            // relative ones go on from the link's directory with the walk so far intact
+            char spliced[PBFS_MAX_PATH_LEN];
+            out_res = symlink_target(mnt, out, spliced, PBFS_MAX_PATH_LEN);
+            if (out_res != PBFS_RES_SUCCESS) return out_res;
+
+            while (normalized[start] == '/') start++;
+            bool absolute = spliced[0] == '/';
+            size_t prefix = absolute ? 0 : (size_t)start;
+            size_t target_len = strlen(spliced);
+            size_t rest_len = strlen(normalized + pos);
+            if (prefix + target_len + 1 + rest_len >= PBFS_MAX_PATH_LEN) return PBFS_ERR_Invalid_Path;
+
+            memmove(spliced + prefix, spliced, target_len + 1);
+            memcpy(spliced, normalized, prefix);
+            if (rest_len > 0) {
+                spliced[prefix + target_len] = '/';
+                memcpy(spliced + prefix + target_len + 1, normalized + pos, rest_len + 1);
+            }
+            path_normalize(spliced, normalized, PBFS_MAX_PATH_LEN);
+
+            if (last && absolute && cache_link == 0) cache_link = link_lba;
+            if (absolute) {
+                depth = 0;
+                parents[0] = mnt->header64.dmm_root_lba;
+            }
+            current_dmm_lba = parents[depth];
+            pos = (int)prefix;
+            found = false;
+            continue;
+        }
+
+        // If we have more parts to go, this must be a directory
+        if (!last) {
+            if (!(out->type & METADATA_FLAG_DIR)) return PBFS_ERR_Invalid_Path;
+            if (depth + 1 >= PBFS_MAX_PATH_DEPTH) return PBFS_ERR_Invalid_Path;
+
+            if (child_lba == 0) {
+                out_res = dir_dmm_lba(mnt, out, &child_lba);
+                if (out_res != PBFS_RES_SUCCESS) return out_res;
+                dcache_set_child(mnt, current_dmm_lba, part, child_lba);
+            }
+
+            current_dmm_lba = child_lba;
+			parents[++depth] = current_dmm_lba;
+            while (normalized[start] == '/') start++;
+            name_pos[depth] = start;
+            found = false;
+        }
+    }
+
+    if (!found) {
+        // Path ended on "." or "..", look the directory we are in up again under its own name
+        if (depth == 0) {
+            if (out_dir_lba) *out_dir_lba = parents[0];
+            return -1;
+        }
+
+        int p = name_pos[depth];
+        path_next(normalized, &p, part, PBFS_MAX_NAME_LEN);
+        uint64_t child_lba = 0;
+        int out_res = dir_lookup(mnt, parents[depth - 1], part, out, out_lba, &child_lba);
+        if (out_res != PBFS_RES_SUCCESS) return out_res;
+        if (out_dir_lba) *out_dir_lba = parents[depth - 1];
+    }
+
+    // parents holds the real chain down to the result, whatever links were followed
+    for (int i = 0; not_under != 0 && i <= depth; i++) {
+        if (parents[i] == not_under) return PBFS_ERR_Invalid_Path;
+    }
+
+    if (cache_link != 0) {
+        // out_dir_lba is optional for the caller, the cache needs it: the entry was found in parents[depth]
+        // unless the walk re-looked a directory up under its own name
+        symlink_store_final(mnt, cache_link, gen, out, *out_lba, found ? current_dmm_lba : parents[depth - 1]);
+    }
+	return PBFS_RES_SUCCESS;
+}
+
+// Absolute lookup following symlinks, -1 = root dmm
+static int find_dmm_entry(const char* path, PBFS_DMM_Entry* out, uint64_t* out_lba, uint64_t* out_dir_lba, struct pbfs_mount* mnt) {
+    return find_dmm_entry_at(mnt, mnt->header64.dmm_root_lba, path, out, out_lba, out_dir_lba, true, 0);
+}
+
+// Same, but a symlink at the end of path is returned itself
+static int find_dmm_entry_nofollow(const char* path, PBFS_DMM_Entry* out, uint64_t* out_lba, uint64_t* out_dir_lba, struct pbfs_mount* mnt) {
+    return find_dmm_entry_at(mnt, mnt->header64.dmm_root_lba, path, out, out_lba, out_dir_lba, false, 0);
+}
+
+// Kernel tables keep name tags the same way DMM blocks do
+static int kernel_table_write(struct pbfs_mount* mnt, uint64_t lba, PBFS_Kernel_Table* kt) {
+    if (mnt->header64.features & PBFS_FEATURE_NAME_TAGS) {
+        memset(kt->name_tags, 0, sizeof(kt->name_tags));
+        for (uint64_t i = 0; i < kt->entry_count && i < PBFS_KERNEL_TABLE_ENTRIES; i++) {
+            kt->name_tags[i] = PBFS_NAME_TAG(dmm_name_hash(kt->entries[i].name));
+        }
+    }
+    return pbfs_write(mnt, lba, sizeof(PBFS_Kernel_Table), kt);
+}
+
+static int kernel_table_find(struct pbfs_mount* mnt, PBFS_Kernel_Table* kt, const char* name, uint32_t hash) {
+    bool tagged = mnt->header64.features & PBFS_FEATURE_NAME_TAGS;
+    for (uint32_t i = 0; i < kt->entry_count && i < PBFS_KERNEL_TABLE_ENTRIES; i++) {
+        if (tagged && kt->name_tags[i] != PBFS_NAME_TAG(hash)) continue;
+        if (strcmp(kt->entries[i].name, name) == 0) return i;
+    }
+    return -1;
+}
+
+static int add_kernel_entry(struct pbfs_mount* mnt, PBFS_Kernel_Table* cur_kt, uint64_t cur_kt_lba, uint64_t lba, uint64_t blocks, const char* name, PBFS_Kernel_Flags flags) {
+    PBFS_Kernel_Table kt = *cur_kt;
+    PBFS_Kernel_Table64 kt64 = {0};
+    kernel_table_to_kernel_table64(&kt, &kt64);
+    PBFS_Kernel_Table* current = &kt;
+    PBFS_Kernel_Table64* current64 = &kt64;
+    uint64_t cur_lba = cur_kt_lba;
+
+    for (int depth = 0; depth < PBFS_MAX_KERNEL_CHAIN; depth++) {
+        // If there is space in current KT, add the entry
+        if (current->entry_count < PBFS_KERNEL_TABLE_ENTRIES) {
+            PBFS_Kernel_Entry* entry = &current->entries[current->entry_count];
+            entry->lba = uint128_from_u64(lba);
+            entry->count = uint128_from_u64(blocks);
+			entry->flags = flags;
+            strncpy(entry->name, name, sizeof(entry->name) - 1);
+            entry->name[sizeof(entry->name) - 1] = '\0';
+            current->entry_count++;
+
+            return kernel_table_write(mnt, cur_lba, current);
+        }
+
+        // If current KT is full, check for extender
+        if (current64->extender_lba > 0) {
+            cur_lba = current64->extender_lba;
+            int out = pbfs_read(mnt, cur_lba, sizeof(PBFS_Kernel_Table), &kt);
+            if (out != PBFS_RES_SUCCESS) return out;
+            continue;
+        }
+
+        // Need to allocate a new extender block
+        PBFS_Kernel_Table new_extender = {0};
+        new_extender.entry_count = 1;
+        PBFS_Kernel_Entry* entry = &new_extender.entries[0];
+        entry->lba = uint128_from_u64(lba);
+        entry->count = uint128_from_u64(blocks);
+		entry->flags = flags;
+        strncpy(entry->name, name, sizeof(entry->name) - 1);
+        entry->name[sizeof(entry->name) - 1] = '\0';
+
+        uint64_t new_ext_lba = bitmap_find_blocks(&mnt->root_bitmap64, mnt->header64.data_start_lba, 1, mnt);
+        if (new_ext_lba == 0) return PBFS_ERR_No_Space_Left;
+
+        // Write new extender to disk
+        int out = kernel_table_write(mnt, new_ext_lba, &new_extender);
+        if (out != PBFS_RES_SUCCESS) return out;
+        bitmap_set(&mnt->root_bitmap, new_ext_lba, mnt->header64.bitmap_lba, 0, mnt, 1);
+
+        // Link current DMM to extender
+        current->extender_lba = uint128_from_u64(new_ext_lba);
+
+        out = kernel_table_write(mnt, cur_lba, current);
+        if (out != PBFS_RES_SUCCESS) return out;
+
+        return PBFS_RES_SUCCESS;
+    }
+
+    return PBFS_ERR_No_Space_Left;
+}
+
+static int remove_kernel_entry(struct pbfs_mount* mnt, char* name_, uint64_t cur_kt_lba) {
+    PBFS_Kernel_Table kt = {0};
+
+    uint64_t current_lba = cur_kt_lba;
+    char name[PBFS_MAX_NAME_LEN];
+    path_basename(name_, name, PBFS_MAX_NAME_LEN);
+    uint32_t hash = dmm_name_hash(name);
+
+    for (int depth = 0; depth < PBFS_MAX_KERNEL_CHAIN; depth++) {
+        int out = pbfs_read(mnt, current_lba, sizeof(PBFS_Kernel_Table), &kt);
+        if (out != PBFS_RES_SUCCESS) return out;
+
+        int found_idx = kernel_table_find(mnt, &kt, name, hash);
+
+        if (found_idx != -1) {
+            // Shift entries left to fill the gap
+            for (uint32_t i = found_idx; i < kt.entry_count - 1; i++) {
+                kt.entries[i] = kt.entries[i + 1];
+            }
+            kt.entry_count--;
+
+            // Write updated KT block
+            return kernel_table_write(mnt, current_lba, &kt);
+        }
+
+        if (UINT128_GT(kt.extender_lba, UINT128_ZERO)) {
+            current_lba = uint128_to_u64(kt.extender_lba);
+        } else {
+            break;
+        }
+    }
+
+    return PBFS_ERR_File_Not_Found;
+}
+
+static int find_kernel_entry(const char* path, PBFS_Kernel_Entry* out, uint64_t* out_lba, struct pbfs_mount* mnt) {
+    char normalized[PBFS_MAX_PATH_LEN];
+    path_normalize((char*)path, normalized, PBFS_MAX_PATH_LEN);
+
+    // Root
+    if (strcmp(normalized, "/") == 0) {
+        return -1; // Root dmm
+    }
+
+    uint64_t current_kt_lba = mnt->header64.kernel_table_lba;
+    char part[PBFS_MAX_NAME_LEN];
+    int depth = 0;
+    int found = 0;
+    int pos = 0;
+
+    while (depth++ < PBFS_MAX_KERNEL_CHAIN) {
+        if (path_next(normalized, &pos, part, PBFS_MAX_NAME_LEN) == 0) break;
+
+        found = 0;
+        uint32_t hash = dmm_name_hash(part);
+        uint64_t iter_lba = current_kt_lba;
+        while (iter_lba > 0) {
+            PBFS_Kernel_Table kt;
+            int out_res = pbfs_read(mnt, iter_lba, sizeof(PBFS_Kernel_Table), &kt);
+            if (out_res != PBFS_RES_SUCCESS) return out_res;
+
+            int i = kernel_table_find(mnt, &kt, part, hash);
+            if (i >= 0) {
+                *out = kt.entries[i];
+                *out_lba = iter_lba;
+                found = 1;
+                break;
+            }
+            iter_lba = uint128_to_u64(kt.extender_lba);
+        }
+
+        if (!found) return PBFS_ERR_File_Not_Found;
+    }
+    return PBFS_RES_SUCCESS;
+}
 
-        return pbfs_read(mnt, *out_lba, sizeof(PBFS_DMM), out);
+// First DMM block of the directory find_dmm_entry returned find_res/dmme for (-1 = root)
+static int retrieve_dir_dmm(int find_res, PBFS_DMM_Entry* dmme, uint64_t* out_lba, struct pbfs_mount* mnt) {
+    if (find_res != -1 && find_res != PBFS_RES_SUCCESS) return find_res;
+    if (find_res == -1) {
+        *out_lba = mnt->header64.dmm_root_lba;
+        return PBFS_RES_SUCCESS;
     }
-    return PBFS_ERR_UNKNOWN;
+    return dir_dmm_lba(mnt, dmme, out_lba);
 }
 
 static void write_le32(unsigned char *buf, uint32_t x) {
@@ -836,6 +3456,8 @@ int pbfs_format(struct block_device* dev, uint8_t reserve_kernel_table, uint64_t
     hdr->dmm_root_lba = dmm_lba;
     hdr->sysinfo_lba = sysinfo_lba;
     hdr->data_start_lba = data_lba;
+    hdr->features = PBFS_FEATURE_DMM_FILL | PBFS_FEATURE_DIR_ADJACENT | PBFS_FEATURE_NAME_TAGS | PBFS_FEATURE_EXTENTS | PBFS_FEATURE_REFLINK | PBFS_FEATURE_INLINE_DATA | PBFS_FEATURE_SPARSE | PBFS_FEATURE_COMPRESSION | PBFS_FEATURE_DIR_INDEX | PBFS_FEATURE_DIR_BTREE;
+    hdr->dmm_entries = (dev->block_size - sizeof(PBFS_DMM_Trailer)) / sizeof(PBFS_DMM_Entry);
     if (boot_part_size > 0) {
         hdr->boot_partition_lba = boot_part_lba;
         hdr->boot_partition_size = boot_part_size;
@@ -861,22 +3483,30 @@ int pbfs_format(struct block_device* dev, uint8_t reserve_kernel_table, uint64_t
         }
     }
 
-    dev->flush(dev);
-    return PBFS_RES_SUCCESS;
+    return pbfs_unmount(&mnt);
 }
 
 int pbfs_mount(struct block_device* dev, struct pbfs_mount* mnt) {
     // Validate info
     if (dev->block_count < 10) return PBFS_ERR_Device_Capacity_Too_Small;
     if (dev->block_size < 512) return PBFS_ERR_Device_Block_Size_Too_Small;
-    dev->read_block(dev, PBFS_HDR_START_LBA, &mnt->header);
+
+    // Blocks can be larger than the structs they hold
+    uint64_t block[dev->block_size / sizeof(uint64_t)];
+    dev->read_block(dev, PBFS_HDR_START_LBA, block);
+    memcpy(&mnt->header, block, sizeof(PBFS_Header));
 
     if (!validate_hdr_magic(&mnt->header)) return PBFS_ERR_Invalid_Header;
     if (mnt->header.block_size != dev->block_size) return PBFS_ERR_Header_Unaligned;
+    if (mnt->header.features & ~PBFS_FEATURES_SUPPORTED) return PBFS_ERR_Invalid_Header;
 
     // Convert Header to 64-bit to save resources
     hdr_to_hdr64(&mnt->header, &mnt->header64);
     if (mnt->header64.total_blocks > dev->block_count) return PBFS_ERR_Header_Unaligned;
+    if (
+        mnt->header64.dmm_entries < 1 ||
+        mnt->header64.dmm_entries * sizeof(PBFS_DMM_Entry) + sizeof(PBFS_DMM_Trailer) > mnt->header64.block_size
+    ) return PBFS_ERR_Invalid_Header;
 
     if (
         mnt->header64.bitmap_lba <= 1 ||
@@ -885,28 +3515,97 @@ int pbfs_mount(struct block_device* dev, struct pbfs_mount* mnt) {
         mnt->header64.sysinfo_lba <= 1
     ) return PBFS_ERR_Invalid_Header;
 
-    // Get Bitmap/DMM/Kernel Table (if present)
-    dev->read_block(dev, mnt->header64.bitmap_lba, &mnt->root_bitmap);
-    dev->read_block(dev, mnt->header64.dmm_root_lba, &mnt->root_dmm);
-    if (mnt->header64.kernel_table_lba > 1) {
-        dev->read_block(dev, mnt->header64.kernel_table_lba, &mnt->root_kernel_table);
-        mnt->kernel_table_present = true;
-    }
+    // Get Bitmap/DMM
+    dev->read_block(dev, mnt->header64.bitmap_lba, block);
+    memcpy(&mnt->root_bitmap, block, sizeof(PBFS_Bitmap));
+
+    // root_dmm only has room for the first PBFS_DMM_ENTRIES entries of a filled block
+    dev->read_block(dev, mnt->header64.dmm_root_lba, block);
+    memset(&mnt->root_dmm, 0, sizeof(PBFS_DMM));
+    PBFS_DMM_Trailer* root_t = (PBFS_DMM_Trailer*)((uint8_t*)block + mnt->header64.dmm_entries * sizeof(PBFS_DMM_Entry));
+    uint64_t root_count = root_t->entry_count < PBFS_DMM_ENTRIES ? root_t->entry_count : PBFS_DMM_ENTRIES;
+    memcpy(&mnt->root_dmm.entries, block, root_count * sizeof(PBFS_DMM_Entry));
+    dmm_trailer_mask(mnt->header64.features, root_t);
+    memcpy(&mnt->root_dmm.entry_count, root_t, sizeof(PBFS_DMM_Trailer));
+    mnt->root_dmm.entry_count = root_count;
 
     // Convert these too
     bitmap_to_bitmap64(&mnt->root_bitmap, &mnt->root_bitmap64);
     dmm_to_dmm64(&mnt->root_dmm, &mnt->root_dmm64);
-    if (mnt->kernel_table_present)
-        kernel_table_to_kernel_table64(&mnt->root_kernel_table, &mnt->root_kernel_table64);
 
     // Done!
     mnt->dev = dev;
     mnt->active = true;
     mnt->partition_start_lba = 0; // No parition support currently, will add soon
+    mnt->dcache = NULL;
+    mnt->blooms = NULL;
+    mnt->bloom_retired = NULL;
+    mnt->ns_gen = 0;
+    mnt->symlinks = NULL;
+    mnt->symlink_hops = PBFS_SYMLINK_HOPS;
+    mnt->refcounts = NULL;
+    mnt->refcount_count = 0;
+    mnt->refcount_blocks = NULL;
+    mnt->refcount_block_count = 0;
+    mnt->refcount_dirty = false;
+
+    // The kernel table can be larger than a block, read it the way kernel_table_write stores it
+    if (mnt->header64.kernel_table_lba > 1) {
+        pbfs_read(mnt, mnt->header64.kernel_table_lba, sizeof(PBFS_Kernel_Table), &mnt->root_kernel_table);
+        kernel_table_to_kernel_table64(&mnt->root_kernel_table, &mnt->root_kernel_table64);
+        mnt->kernel_table_present = true;
+    }
+
+    int res = refcount_load(mnt);
+    if (res != PBFS_RES_SUCCESS) {
+        if (mnt->refcounts) funcs.free(mnt->refcounts);
+        if (mnt->refcount_blocks) funcs.free(mnt->refcount_blocks);
+        mnt->refcounts = NULL;
+        mnt->refcount_blocks = NULL;
+        mnt->active = false;
+        return res;
+    }
     
     return PBFS_RES_SUCCESS;
 }
 
+int pbfs_unmount(struct pbfs_mount* mnt) {
+    if (!mnt->active) return PBFS_ERR_Mount_Inactive;
+
+    refcount_sync(mnt);
+    mnt->dev->flush(mnt->dev);
+
+    if (mnt->blooms) {
+        for (uint32_t i = 0; i < PBFS_BLOOM_DIRS; i++) {
+            if (mnt->blooms[i].words) funcs.free(mnt->blooms[i].words);
+        }
+        funcs.free(mnt->blooms);
+    }
+    while (mnt->bloom_retired) {
+        uint64_t* words = mnt->bloom_retired;
+        mnt->bloom_retired = (uint64_t*)(uintptr_t)words[1];
+        funcs.free(words);
+    }
+    if (mnt->dcache) funcs.free(mnt->dcache);
+    if (mnt->symlinks) funcs.free(mnt->symlinks);
+    if (mnt->bitmaps) funcs.free(mnt->bitmaps);
+    if (mnt->refcounts) funcs.free(mnt->refcounts);
+    if (mnt->refcount_blocks) funcs.free(mnt->refcount_blocks);
+    mnt->blooms = NULL;
+    mnt->symlinks = NULL;
+    mnt->dcache = NULL;
+    mnt->bitmaps = NULL;
+    mnt->bitmap_count = 0;
+    mnt->bitmap_cap = 0;
+    mnt->refcounts = NULL;
+    mnt->refcount_count = 0;
+    mnt->refcount_blocks = NULL;
+    mnt->refcount_block_count = 0;
+
+    mnt->active = false;
+    return PBFS_RES_SUCCESS;
+}
+
 int pbfs_read_block(struct pbfs_mount* mnt, uint64_t fs_block, void* buffer) {
     if (!mnt->active) return PBFS_ERR_Mount_Inactive;
 
@@ -934,49 +3633,606 @@ int pbfs_read(struct pbfs_mount* mnt, uint64_t fs_block, size_t size, void* buff
         uint64_t lba = mnt->partition_start_lba + fs_block + i;
         mnt->dev->read_block(mnt->dev, lba, buf);
 
-        if (total_read_size + mnt->header64.block_size > size) {
-            uint64_t remaining_size = size - total_read_size;
-            memcpy(buffer + total_read_size, buf, remaining_size);
-            break;
-        } else {
-            memcpy(buffer + total_read_size, buf, mnt->header64.block_size);
-            total_read_size += mnt->header64.block_size;
+        if (total_read_size + mnt->header64.block_size > size) {
+            uint64_t remaining_size = size - total_read_size;
+            memcpy(buffer + total_read_size, buf, remaining_size);
+            break;
+        } else {
+            memcpy(buffer + total_read_size, buf, mnt->header64.block_size);
+            total_read_size += mnt->header64.block_size;
+        }
+    }
+    return PBFS_RES_SUCCESS;
+}
+
+int pbfs_write(struct pbfs_mount* mnt, uint64_t fs_block, size_t size, void* buffer) {
+    if (!mnt->active) return PBFS_ERR_Mount_Inactive;
+
+    uint8_t buf[mnt->header64.block_size];
+    uint64_t required_blocks = ALIGN_UP(size, mnt->header64.block_size) / mnt->header64.block_size;
+
+    uint64_t total_write_size = 0;
+    for (uint64_t i = 0; i < required_blocks; i++) {
+        uint64_t lba = mnt->partition_start_lba + fs_block + i;
+
+        if (total_write_size + mnt->header64.block_size > size) {
+            uint64_t remaining_size = size - total_write_size;
+            memcpy(buf, buffer + total_write_size, remaining_size);
+            memset(buf + remaining_size, 0, mnt->header64.block_size - remaining_size);
+            mnt->dev->write_block(mnt->dev, lba, buf);
+            break;
+        } else {
+            memcpy(buf, buffer + total_write_size, mnt->header64.block_size);
+            total_write_size += mnt->header64.block_size;
+        }
+
+        mnt->dev->write_block(mnt->dev, lba, buf);
+    }
+
+    return PBFS_RES_SUCCESS;
+}
+
+int pbfs_flush(struct pbfs_mount* mnt) {
+    if (!mnt->active) return PBFS_ERR_Mount_Inactive;
+
+    mnt->dev->flush(mnt->dev);
+    return PBFS_RES_SUCCESS;
+}
+
+// Writes metadata and data of a new entry and links it into the directory whose first DMM block is parent_dmm_lba
+// Metadata block anywhere, data in as few runs as are free, listed in the metadata block (PBFS_DATA_OFFSET_EXTENTS)
+static int add_extents(struct pbfs_mount* mnt, PBFS_Metadata* md, uint8_t* data, size_t data_size, uint64_t* md_lba) {
+    uint32_t bs = mnt->header64.block_size;
+    uint64_t lba = bitmap_find_blocks(&mnt->root_bitmap64, mnt->header64.data_start_lba, 1, mnt);
+    if (lba <= 1) return PBFS_ERR_No_Space_Left;
+    bitmap_set(&mnt->root_bitmap, lba, mnt->header64.bitmap_lba, 0, mnt, 1);
+
+    PBFS_Extent* exts = NULL;
+    uint64_t count = 0;
+    int out = alloc_extents(mnt, ALIGN_UP(data_size, bs) / bs, &exts, &count);
+    if (out != PBFS_RES_SUCCESS) {
+        bitmap_set(&mnt->root_bitmap, lba, mnt->header64.bitmap_lba, 0, mnt, 0);
+        return out;
+    }
+
+    // One write per extent
+    size_t off = 0;
+    for (uint64_t i = 0; i < count && out == PBFS_RES_SUCCESS; i++) {
+        size_t len = exts[i].count * bs < data_size - off ? exts[i].count * bs : data_size - off;
+        out = write_new_blocks(mnt, exts[i].lba, data + off, len);
+        off += len;
+    }
+
+    struct discard_batch batch = {0};
+    md->data_offset = PBFS_DATA_OFFSET_EXTENTS;
+    if (out == PBFS_RES_SUCCESS) out = extents_store(mnt, lba, md, exts, count, true, &batch);
+    discard_flush(mnt, &batch);
+    funcs.free(exts);
+
+    *md_lba = lba;
+    return out;
+}
+
+// Writes metadata and data of a new entry and links it into the directory whose first DMM block is parent_dmm_lba.
+// The data is stored as given: packed data (METADATA_FLAG_COMPRESSED) never goes inline.
+static int add_stored(struct pbfs_mount* mnt, uint64_t parent_dmm_lba, char* name, uint32_t uid, uint32_t gid, PBFS_Metadata_Flags type, PBFS_Permission_Flags permissions, uint8_t* data, size_t data_size, bool packed) {
+    uint64_t required_blocks = ALIGN_UP(data_size, mnt->header64.block_size) / mnt->header64.block_size;
+
+    PBFS_Metadata md = {0};
+    memcpy(&md.name, name, strlen(name));
+    md.uid = uid;
+    md.gid = gid;
+    md.permission_offset = 0;
+    md.created_timestamp = 0;
+    md.modified_timestamp = 0;
+    md.data_size = uint128_from_u64(data_size);
+    md.data_offset = 1;
+    md.flags = type;
+    md.ex_flags = permissions;
+    md.extender_lba = UINT128_ZERO;
+
+    // Small enough to share the metadata block: one block, one write
+    if (!packed && !(type & METADATA_FLAG_DIR) && data_size <= inline_cap(mnt)) {
+        uint64_t lba = bitmap_find_blocks(&mnt->root_bitmap64, mnt->header64.data_start_lba, 1, mnt);
+        if (lba <= 1) return PBFS_ERR_No_Space_Left;
+
+        int out = inline_store(mnt, lba, &md, data, data_size);
+        if (out != PBFS_RES_SUCCESS) return out;
+        bitmap_set(&mnt->root_bitmap, lba, mnt->header64.bitmap_lba, 0, mnt, 1);
+        return add_dmm_entry(mnt, parent_dmm_lba, lba, name, type & ~METADATA_FLAG_COMPRESSED, permissions, md.created_timestamp, md.modified_timestamp);
+    }
+
+    uint64_t lba = bitmap_find_blocks(&mnt->root_bitmap64, mnt->header64.data_start_lba, required_blocks + 1, mnt);
+    if (lba <= 1) {
+        // No single run is long enough, anything but a directory can still take several
+        if (!(mnt->header64.features & PBFS_FEATURE_EXTENTS) || (type & METADATA_FLAG_DIR)) return PBFS_ERR_No_Space_Left;
+
+        int out = add_extents(mnt, &md, data, data_size, &lba);
+        if (out != PBFS_RES_SUCCESS) return out;
+        return add_dmm_entry(mnt, parent_dmm_lba, lba, name, type & ~METADATA_FLAG_COMPRESSED, permissions, md.created_timestamp, md.modified_timestamp);
+    }
+
+    int out = pbfs_write(mnt, lba, sizeof(PBFS_Metadata), &md);
+    if (out != PBFS_RES_SUCCESS) return out;
+
+    out = pbfs_write(mnt, lba + 1, data_size, data);
+    if (out != PBFS_RES_SUCCESS) return out;
+
+    for (uint64_t i = 0; i < required_blocks + 1; i++) {
+        bitmap_set(&mnt->root_bitmap, lba + i, mnt->header64.bitmap_lba, 0, mnt, 1);
+    }
+
+    return add_dmm_entry(mnt, parent_dmm_lba, lba, name, type & ~METADATA_FLAG_COMPRESSED, permissions, md.created_timestamp, md.modified_timestamp);
+}
+
+// Volumes without PBFS_FEATURE_COMPRESSION, directories and symlinks keep their data as it is
+static PBFS_Metadata_Flags packed_type(struct pbfs_mount* mnt, PBFS_Metadata_Flags type) {
+    if (!(mnt->header64.features & PBFS_FEATURE_COMPRESSION) || (type & (METADATA_FLAG_DIR | METADATA_FLAG_SYMLINK))) return type & ~METADATA_FLAG_COMPRESSED;
+    return type;
+}
+
+// Name of a new entry at path and the first DMM block of the directory it goes in, path must not exist yet
+static int new_entry_dir(struct pbfs_mount* mnt, char* path, char* name, uint64_t* dir_lba) {
+    PBFS_DMM_Entry tmp = {0};
+    uint64_t tmp_lba = 0;
+    if (find_dmm_entry_nofollow(path, &tmp, &tmp_lba, NULL, mnt) == PBFS_RES_SUCCESS) return PBFS_ERR_File_Already_Exists;
+
+    char dname[PBFS_MAX_PATH_LEN];
+    path_basename(path, name, PBFS_MAX_NAME_LEN);
+    path_dirname(path, dname, PBFS_MAX_PATH_LEN);
+
+    PBFS_DMM_Entry parent = {0};
+    uint64_t parent_lba = {0};
+    int out = find_dmm_entry(dname, &parent, &parent_lba, NULL, mnt);
+    if (out != -1 && out != PBFS_RES_SUCCESS) return out;
+
+    if (out != -1) {
+        // check perms
+        if (!(parent.perms & PERM_WRITE)) return PBFS_ERR_Wrong_Permissions;
+    }
+
+    return retrieve_dir_dmm(out, &parent, dir_lba, mnt);
+}
+
+// Streaming writer: without a size hint, blocks are taken in runs that double up to this many at a time
+#define PBFS_WRITER_GROW 1024
+
+// Takes at least blocks more free blocks for the writer: the last run (the first one right after the metadata block)
+// grows while the blocks after it are free, the rest comes from alloc_extents (PBFS_FEATURE_EXTENTS)
+static int writer_take(struct pbfs_writer* w, uint64_t blocks) {
+    struct pbfs_mount* mnt = w->mnt;
+    uint64_t want = blocks;
+    if (w->hint_blocks > w->reserved) {
+        if (w->hint_blocks - w->reserved > want) want = w->hint_blocks - w->reserved;
+    } else {
+        uint64_t grow = w->reserved < PBFS_WRITER_GROW ? w->reserved : PBFS_WRITER_GROW;
+        if (grow > want) want = grow;
+    }
+
+    uint64_t next = w->md_lba + 1;
+    for (uint64_t i = w->run_count; i > 0; i--) {
+        if (w->runs[i - 1].lba == PBFS_EXTENT_HOLE) continue;
+        next = w->runs[i - 1].lba + w->runs[i - 1].count;
+        break;
+    }
+    uint64_t got = 0;
+    while (got < want && bitmap_test(mnt, next + got) == 0) {
+        bitmap_set(&mnt->root_bitmap, next + got, mnt->header64.bitmap_lba, 0, mnt, 1);
+        got++;
+    }
+    int res = extent_push(&w->runs, &w->run_count, &w->run_cap, next, got);
+    if (res != PBFS_RES_SUCCESS) {
+        for (uint64_t i = 0; i < got; i++) bitmap_set(&mnt->root_bitmap, next + i, mnt->header64.bitmap_lba, 0, mnt, 0);
+        return res;
+    }
+    w->reserved += got;
+    if (got >= want) return PBFS_RES_SUCCESS;
+    if (!(mnt->header64.features & PBFS_FEATURE_EXTENTS)) return got >= blocks ? PBFS_RES_SUCCESS : PBFS_ERR_No_Space_Left;
+
+    // What was asked for beyond blocks is only a guess, a full volume still gives the blocks needed
+    PBFS_Extent* exts = NULL;
+    uint64_t count = 0;
+    res = alloc_extents(mnt, want - got, &exts, &count);
+    if (res == PBFS_ERR_No_Space_Left && blocks > got) res = alloc_extents(mnt, blocks - got, &exts, &count);
+    if (res != PBFS_RES_SUCCESS) return got >= blocks && res == PBFS_ERR_No_Space_Left ? PBFS_RES_SUCCESS : res;
+
+    uint64_t i = 0;
+    for (; i < count && res == PBFS_RES_SUCCESS; i++) {
+        res = extent_push(&w->runs, &w->run_count, &w->run_cap, exts[i].lba, exts[i].count);
+        if (res == PBFS_RES_SUCCESS) w->reserved += exts[i].count;
+    }
+    if (res != PBFS_RES_SUCCESS) {
+        for (i--; i < count; i++) {
+            for (uint64_t j = 0; j < exts[i].count; j++) bitmap_set(&mnt->root_bitmap, exts[i].lba + j, mnt->header64.bitmap_lba, 0, mnt, 0);
+        }
+    }
+    funcs.free(exts);
+    return res;
+}
+
+// Writes blocks whole blocks of data to the writer's next unwritten blocks, taking more first if it needs to
+static int writer_put(struct pbfs_writer* w, const uint8_t* data, uint64_t blocks) {
+    if (w->reserved - w->written < blocks) {
+        int res = writer_take(w, blocks - (w->reserved - w->written));
+        if (res != PBFS_RES_SUCCESS) return res;
+    }
+
+    while (blocks > 0) {
+        if (w->pos_off == w->runs[w->pos_run].count) {
+            w->pos_run++;
+            w->pos_off = 0;
+        }
+        PBFS_Extent* run = &w->runs[w->pos_run];
+        uint64_t n = run->count - w->pos_off < blocks ? run->count - w->pos_off : blocks;
+        int res = write_span(w->mnt, run->lba + w->pos_off, n, data);
+        if (res != PBFS_RES_SUCCESS) return res;
+        data += n * w->mnt->header64.block_size;
+        w->pos_off += n;
+        w->written += n;
+        blocks -= n;
+    }
+    return PBFS_RES_SUCCESS;
+}
+
+static int writer_insert(struct pbfs_writer* w, uint64_t idx, uint64_t lba, uint64_t count) {
+    if (w->run_count >= w->run_cap) {
+        uint64_t new_cap = w->run_cap ? w->run_cap * 2 : 8;
+        void* nptr = funcs.realloc(w->runs, new_cap * sizeof(PBFS_Extent));
+        if (!nptr) return PBFS_ERR_Allocation_Failed;
+        w->runs = nptr;
+        w->run_cap = new_cap;
+    }
+    memmove(w->runs + idx + 1, w->runs + idx, (w->run_count - idx) * sizeof(PBFS_Extent));
+    w->runs[idx].lba = lba;
+    w->runs[idx].count = count;
+    w->run_count++;
+    return PBFS_RES_SUCCESS;
+}
+
+// Skips blocks zero blocks (PBFS_FEATURE_SPARSE): a hole goes in at the write position,
+// splitting the run there when part of it is still unwritten
+static int writer_hole(struct pbfs_writer* w, uint64_t blocks) {
+    if (w->run_count == 0) {
+        int res = writer_insert(w, 0, PBFS_EXTENT_HOLE, blocks);
+        if (res == PBFS_RES_SUCCESS) w->pos_off = blocks;
+        return res;
+    }
+
+    PBFS_Extent* cur = &w->runs[w->pos_run];
+    if (cur->lba == PBFS_EXTENT_HOLE) {
+        cur->count += blocks;
+        w->pos_off += blocks;
+        return PBFS_RES_SUCCESS;
+    }
+    if (w->pos_off == 0) {
+        // Nothing written yet, the hole goes first
+        int res = writer_insert(w, w->pos_run, PBFS_EXTENT_HOLE, blocks);
+        if (res == PBFS_RES_SUCCESS) w->pos_off = blocks;
+        return res;
+    }
+    if (w->pos_off < cur->count) {
+        int res = writer_insert(w, w->pos_run + 1, cur->lba + w->pos_off, cur->count - w->pos_off);
+        if (res != PBFS_RES_SUCCESS) return res;
+        w->runs[w->pos_run].count = w->pos_off;
+    }
+    int res = writer_insert(w, w->pos_run + 1, PBFS_EXTENT_HOLE, blocks);
+    if (res != PBFS_RES_SUCCESS) return res;
+    w->pos_run++;
+    w->pos_off = blocks;
+    return PBFS_RES_SUCCESS;
+}
+
+// Whole block of zeros? Eight words a step, a loop the compiler vectorizes, ending at the first step that isn't
+static bool block_is_zero(const uint8_t* data, uint32_t bs) {
+    uint64_t w[8];
+    for (uint32_t off = 0; off < bs; off += sizeof(w)) {
+        memcpy(w, data + off, sizeof(w));
+        if ((w[0] | w[1] | w[2] | w[3] | w[4] | w[5] | w[6] | w[7]) != 0) return false;
+    }
+    return true;
+}
+
+// Writes blocks whole blocks of data, runs of zero blocks become holes on sparse volumes
+static int writer_blocks(struct pbfs_writer* w, const uint8_t* data, uint64_t blocks) {
+    struct pbfs_mount* mnt = w->mnt;
+    uint32_t bs = mnt->header64.block_size;
+    if ((mnt->header64.features & (PBFS_FEATURE_SPARSE | PBFS_FEATURE_EXTENTS)) != (PBFS_FEATURE_SPARSE | PBFS_FEATURE_EXTENTS)) {
+        return writer_put(w, data, blocks);
+    }
+
+    while (blocks > 0) {
+        bool zero = block_is_zero(data, bs);
+        uint64_t n = 1;
+        while (n < blocks && block_is_zero(data + n * bs, bs) == zero) n++;
+        int res = zero ? writer_hole(w, n) : writer_put(w, data, n);
+        if (res != PBFS_RES_SUCCESS) return res;
+        data += n * bs;
+        blocks -= n;
+    }
+    return PBFS_RES_SUCCESS;
+}
+
+// Frees the blocks the writer took but didn't write, the runs end at the write position
+static void writer_trim(struct pbfs_writer* w) {
+    if (w->run_count == 0) return;
+    struct discard_batch batch = {0};
+    PBFS_Extent* run = &w->runs[w->pos_run];
+    if (run->lba != PBFS_EXTENT_HOLE) free_blocks(w->mnt, run->lba + w->pos_off, run->count - w->pos_off, &batch);
+    for (uint64_t i = w->pos_run + 1; i < w->run_count; i++) free_blocks(w->mnt, w->runs[i].lba, w->runs[i].count, &batch);
+    discard_flush(w->mnt, &batch);
+
+    w->reserved -= run->count - w->pos_off;
+    for (uint64_t i = w->pos_run + 1; i < w->run_count; i++) {
+        if (w->runs[i].lba != PBFS_EXTENT_HOLE) w->reserved -= w->runs[i].count;
+    }
+    run->count = w->pos_off;
+    w->run_count = w->pos_run + 1;
+}
+
+// Gives back the writer's memory and, if drop_all, every block it took (otherwise only the unwritten ones)
+static void writer_release(struct pbfs_writer* w, bool drop_all) {
+    writer_trim(w);
+    if (drop_all) {
+        struct discard_batch batch = {0};
+        for (uint64_t i = 0; i < w->run_count; i++) free_blocks(w->mnt, w->runs[i].lba, w->runs[i].count, &batch);
+        if (w->md_lba > 1) free_blocks(w->mnt, w->md_lba, 1, &batch);
+        discard_flush(w->mnt, &batch);
+    }
+
+    if (w->runs) funcs.free(w->runs);
+    if (w->tail) funcs.free(w->tail);
+    if (w->zbuf) funcs.free(w->zbuf);
+    if (w->zoffsets) funcs.free(w->zoffsets);
+    w->runs = NULL;
+    w->tail = NULL;
+    w->zbuf = NULL;
+    w->zoffsets = NULL;
+    w->mnt = NULL;
+}
+
+// Sets up w (zeroed, name and dir_lba filled in) to write a new entry there
+static int writer_open(struct pbfs_mount* mnt, uint32_t uid, uint32_t gid, PBFS_Metadata_Flags type, PBFS_Permission_Flags permissions, uint64_t size_hint, struct pbfs_writer* w) {
+    uint32_t bs = mnt->header64.block_size;
+    type = packed_type(mnt, type);
+    w->tail = funcs.malloc(bs);
+    if (!w->tail) return PBFS_ERR_Allocation_Failed;
+    w->mnt = mnt;
+    if (type & METADATA_FLAG_COMPRESSED) {
+        // The chunk being gathered, then the chunk packed, then the codec's hash table
+        w->zbuf = funcs.malloc(2 * PBFS_COMPRESS_CHUNK + sizeof(PBFS_Compressed_Chunk) + LZ_TABLE_SIZE);
+        if (!w->zbuf) {
+            writer_release(w, true);
+            return PBFS_ERR_Allocation_Failed;
+        }
+    }
+    w->hint_blocks = ALIGN_UP(size_hint, bs) / bs;
+
+    // A hinted size that fits one run goes right after the metadata block, like pbfs_add lays a file out
+    uint64_t lba = w->hint_blocks ? bitmap_find_blocks(&mnt->root_bitmap64, mnt->header64.data_start_lba, w->hint_blocks + 1, mnt) : 0;
+    if (lba <= 1) lba = bitmap_find_blocks(&mnt->root_bitmap64, mnt->header64.data_start_lba, 1, mnt);
+    if (lba <= 1) {
+        writer_release(w, true);
+        return PBFS_ERR_No_Space_Left;
+    }
+    bitmap_set(&mnt->root_bitmap, lba, mnt->header64.bitmap_lba, 0, mnt, 1);
+    w->md_lba = lba;
+
+    PBFS_Metadata* md = &w->md;
+    memcpy(md->name, w->name, strlen(w->name));
+    md->uid = uid;
+    md->gid = gid;
+    md->flags = type;
+    md->ex_flags = permissions;
+    md->data_offset = 1;
+    md->extender_lba = UINT128_ZERO;
+    return PBFS_RES_SUCCESS;
+}
+
+int pbfs_create(struct pbfs_mount* mnt, char* path, uint32_t uid, uint32_t gid, PBFS_Metadata_Flags type, PBFS_Permission_Flags permissions, uint64_t size_hint, struct pbfs_writer* w) {
+    if (!mnt->active) return PBFS_ERR_Mount_Inactive;
+    if (w == NULL) return PBFS_ERR_Argument_Invalid;
+    if (strlen(path) < 1) return PBFS_ERR_No_Path;
+    if (type == METADATA_FLAG_INVALID || (type & METADATA_FLAG_DIR)) return PBFS_ERR_Wrong_Type;
+    if (permissions == PERM_INVALID) return PBFS_ERR_Wrong_Permissions;
+
+    memset(w, 0, sizeof(struct pbfs_writer));
+    int out = new_entry_dir(mnt, path, w->name, &w->dir_lba);
+    if (out != PBFS_RES_SUCCESS) return out;
+    return writer_open(mnt, uid, gid, type, permissions, size_hint, w);
+}
+
+// Writes len bytes as they are to be stored
+static int writer_emit(struct pbfs_writer* w, const uint8_t* src, size_t len) {
+    uint32_t bs = w->mnt->header64.block_size;
+    while (len > 0) {
+        // Whole blocks go straight from the caller's buffer, the rest waits in the tail block
+        if (w->tail_len == 0 && len >= bs) {
+            uint64_t blocks = len / bs;
+            int res = writer_blocks(w, src, blocks);
+            if (res != PBFS_RES_SUCCESS) return res;
+            src += blocks * bs;
+            len -= blocks * bs;
+            w->size += blocks * bs;
+            continue;
+        }
+
+        size_t part = bs - w->tail_len < len ? bs - w->tail_len : len;
+        memcpy(w->tail + w->tail_len, src, part);
+        w->tail_len += part;
+        src += part;
+        len -= part;
+        w->size += part;
+        if (w->tail_len == bs) {
+            int res = writer_blocks(w, w->tail, 1);
+            if (res != PBFS_RES_SUCCESS) return res;
+            w->tail_len = 0;
+        }
+    }
+    return PBFS_RES_SUCCESS;
+}
+
+// Packs the gathered chunk and writes it, noting where it starts
+static int writer_pack(struct pbfs_writer* w) {
+    if (w->zcount >= w->zcap) {
+        uint64_t new_cap = w->zcap ? w->zcap * 2 : 64;
+        void* nptr = funcs.realloc(w->zoffsets, new_cap * sizeof(uint64_t));
+        if (!nptr) return PBFS_ERR_Allocation_Failed;
+        w->zoffsets = nptr;
+        w->zcap = new_cap;
+    }
+    w->zoffsets[w->zcount++] = w->size;
+
+    uint8_t* packed = w->zbuf + PBFS_COMPRESS_CHUNK;
+    uint16_t* table = (uint16_t*)(packed + PBFS_COMPRESS_CHUNK + sizeof(PBFS_Compressed_Chunk));
+    size_t n = pack_chunk(w->zbuf, w->zlen, packed, table);
+    w->zsize += w->zlen;
+    w->zlen = 0;
+    return writer_emit(w, packed, n);
+}
+
+// Ends packed data: the last chunk, the zero header, the chunk table and the trailer
+static int writer_seal(struct pbfs_writer* w) {
+    int res = w->zlen > 0 ? writer_pack(w) : PBFS_RES_SUCCESS;
+    PBFS_Compressed_Chunk end = {0, 0};
+    if (res == PBFS_RES_SUCCESS) res = writer_emit(w, (const uint8_t*)&end, sizeof(end));
+    if (res == PBFS_RES_SUCCESS && w->zcount > 0) res = writer_emit(w, (const uint8_t*)w->zoffsets, w->zcount * sizeof(uint64_t));
+    PBFS_Compressed_Trailer t = {w->zsize, w->zcount, PBFS_COMPRESS_CHUNK, PBFS_COMPRESS_MAGIC};
+    if (res == PBFS_RES_SUCCESS) res = writer_emit(w, (const uint8_t*)&t, sizeof(t));
+    return res;
+}
+
+// Gathers data into chunks, packing each one as it fills
+static int writer_gather(struct pbfs_writer* w, const uint8_t* src, size_t len) {
+    while (len > 0) {
+        size_t part = PBFS_COMPRESS_CHUNK - w->zlen < len ? PBFS_COMPRESS_CHUNK - w->zlen : len;
+        memcpy(w->zbuf + w->zlen, src, part);
+        w->zlen += part;
+        src += part;
+        len -= part;
+        if (w->zlen == PBFS_COMPRESS_CHUNK) {
+            int res = writer_pack(w);
+            if (res != PBFS_RES_SUCCESS) return res;
         }
     }
     return PBFS_RES_SUCCESS;
 }
 
-int pbfs_write(struct pbfs_mount* mnt, uint64_t fs_block, size_t size, void* buffer) {
+int pbfs_write_chunk(struct pbfs_writer* w, const void* data, size_t len) {
+    if (w == NULL || w->mnt == NULL) return PBFS_ERR_Argument_Invalid;
+    if (data == NULL && len > 0) return PBFS_ERR_Argument_Invalid;
+    if (!w->mnt->active) return PBFS_ERR_Mount_Inactive;
+    if (w->error != PBFS_RES_SUCCESS) return w->error;
+
+    // A failed write leaves the data short of what was passed in, so the writer stays failed
+    w->error = w->zbuf ? writer_gather(w, data, len) : writer_emit(w, data, len);
+    return w->error;
+}
+
+int pbfs_finish(struct pbfs_writer* w) {
+    if (w == NULL || w->mnt == NULL) return PBFS_ERR_Argument_Invalid;
+    struct pbfs_mount* mnt = w->mnt;
     if (!mnt->active) return PBFS_ERR_Mount_Inactive;
+    if (w->error != PBFS_RES_SUCCESS) {
+        int res = w->error;
+        writer_release(w, true);
+        return res;
+    }
 
-    uint8_t buf[mnt->header64.block_size];
-    uint64_t required_blocks = ALIGN_UP(size, mnt->header64.block_size) / mnt->header64.block_size;
+    // The name may have been taken while the data streamed in
+    PBFS_DMM_Entry tmp = {0};
+    uint64_t tmp_lba = 0;
+    int out = scan_dir(mnt, w->dir_lba, w->name, &tmp, &tmp_lba);
+    if (out == PBFS_RES_SUCCESS) out = PBFS_ERR_File_Already_Exists;
+    else if (out == PBFS_ERR_File_Not_Found) out = PBFS_RES_SUCCESS;
+
+    // Packed files that fit inline are kept there as they are
+    bool packed = w->zbuf && (w->zcount > 0 || w->zlen > inline_cap(mnt));
+    if (w->zbuf && !packed) {
+        memcpy(w->tail, w->zbuf, w->zlen);
+        w->tail_len = w->zlen;
+        w->size = w->zlen;
+    } else if (packed && out == PBFS_RES_SUCCESS) {
+        out = writer_seal(w);
+    }
 
-    uint64_t total_write_size = 0;
-    for (uint64_t i = 0; i < required_blocks; i++) {
-        uint64_t lba = mnt->partition_start_lba + fs_block + i;
+    PBFS_Metadata* md = &w->md;
+    md->data_size = uint128_from_u64(w->size);
+    bool inline_data = out == PBFS_RES_SUCCESS && !packed && w->written == 0 && w->size <= inline_cap(mnt);
+    if (inline_data) {
+        out = inline_store(mnt, w->md_lba, md, w->tail, w->size);
+    } else if (out == PBFS_RES_SUCCESS && w->size == 0) {
+        out = PBFS_ERR_Argument_Invalid;
+    } else if (out == PBFS_RES_SUCCESS && w->tail_len > 0) {
+        memset(w->tail + w->tail_len, 0, mnt->header64.block_size - w->tail_len);
+        out = writer_put(w, w->tail, 1);
+    }
 
-        if (total_write_size + mnt->header64.block_size > size) {
-            uint64_t remaining_size = size - total_write_size;
-            memcpy(buf, buffer + total_write_size, remaining_size);
-            mnt->dev->write_block(mnt->dev, lba, buf);
-            break;
+    // One run right after the metadata block is a plain file, anything else an extent list of the written blocks
+    // (whatever wasn't written is free again first, the list may need blocks of its own)
+    if (out == PBFS_RES_SUCCESS && !inline_data) {
+        writer_trim(w);
+        if (w->run_count == 1 && w->runs[0].lba == w->md_lba + 1) {
+            out = pbfs_write(mnt, w->md_lba, sizeof(PBFS_Metadata), md);
         } else {
-            memcpy(buf, buffer + total_write_size, mnt->header64.block_size);
-            total_write_size += mnt->header64.block_size;
+            struct discard_batch batch = {0};
+            md->data_offset = PBFS_DATA_OFFSET_EXTENTS;
+            out = extents_store(mnt, w->md_lba, md, w->runs, w->run_count, true, &batch);
+            discard_flush(mnt, &batch);
         }
+    }
 
-        mnt->dev->write_block(mnt->dev, lba, buf);
+    if (out == PBFS_RES_SUCCESS) {
+        out = add_dmm_entry(mnt, w->dir_lba, w->md_lba, w->name, md->flags & ~(METADATA_FLAG_INLINE | METADATA_FLAG_COMPRESSED), md->ex_flags, md->created_timestamp, md->modified_timestamp);
     }
+    writer_release(w, out != PBFS_RES_SUCCESS);
+    return out;
+}
 
+int pbfs_cancel(struct pbfs_writer* w) {
+    if (w == NULL || w->mnt == NULL) return PBFS_ERR_Argument_Invalid;
+    writer_release(w, true);
     return PBFS_RES_SUCCESS;
 }
 
-int pbfs_flush(struct pbfs_mount* mnt) {
-    if (!mnt->active) return PBFS_ERR_Mount_Inactive;
+// Any whole block of zeros in data that a sparse volume could leave out?
+static bool has_zero_block(struct pbfs_mount* mnt, const uint8_t* data, size_t data_size) {
+    uint32_t bs = mnt->header64.block_size;
+    if ((mnt->header64.features & (PBFS_FEATURE_SPARSE | PBFS_FEATURE_EXTENTS)) != (PBFS_FEATURE_SPARSE | PBFS_FEATURE_EXTENTS)) return false;
+    for (size_t off = 0; off + bs <= data_size; off += bs) {
+        if (block_is_zero(data + off, bs)) return true;
+    }
+    return false;
+}
 
-    mnt->dev->flush(mnt->dev);
-    return PBFS_RES_SUCCESS;
+// add_stored, packing the data first for METADATA_FLAG_COMPRESSED unless it fits inline.
+// Files with zero blocks go through the writer on sparse volumes, which leaves holes for them.
+static int add_in_dir(struct pbfs_mount* mnt, uint64_t parent_dmm_lba, char* name, uint32_t uid, uint32_t gid, PBFS_Metadata_Flags type, PBFS_Permission_Flags permissions, uint8_t* data, size_t data_size) {
+    type = packed_type(mnt, type);
+    if (!(type & (METADATA_FLAG_DIR | METADATA_FLAG_SYMLINK | METADATA_FLAG_COMPRESSED)) && data_size > inline_cap(mnt) && has_zero_block(mnt, data, data_size)) {
+        struct pbfs_writer w;
+        memset(&w, 0, sizeof(struct pbfs_writer));
+        strcpy(w.name, name);
+        w.dir_lba = parent_dmm_lba;
+        int out = writer_open(mnt, uid, gid, type, permissions, data_size, &w);
+        if (out != PBFS_RES_SUCCESS) return out;
+        out = pbfs_write_chunk(&w, data, data_size);
+        if (out != PBFS_RES_SUCCESS) {
+            pbfs_cancel(&w);
+            return out;
+        }
+        return pbfs_finish(&w);
+    }
+    if (!(type & METADATA_FLAG_COMPRESSED) || data_size <= inline_cap(mnt)) {
+        return add_stored(mnt, parent_dmm_lba, name, uid, gid, type, permissions, data, data_size, false);
+    }
+
+    uint8_t* packed = NULL;
+    size_t packed_size = 0;
+    int out = pack_image(data, data_size, 1, &packed, &packed_size);
+    if (out != PBFS_RES_SUCCESS) return out;
+    out = add_stored(mnt, parent_dmm_lba, name, uid, gid, type, permissions, packed, packed_size, true);
+    funcs.free(packed);
+    return out;
 }
 
 int pbfs_add(struct pbfs_mount* mnt, char* path, uint32_t uid, uint32_t gid, PBFS_Metadata_Flags type, PBFS_Permission_Flags permissions, uint8_t* data, size_t data_size) {
@@ -987,65 +4243,60 @@ int pbfs_add(struct pbfs_mount* mnt, char* path, uint32_t uid, uint32_t gid, PBF
     if (data_size < 1) return PBFS_ERR_Argument_Invalid;
     if (data == NULL) return PBFS_ERR_Argument_Invalid;
 
-    PBFS_DMM_Entry tmp = {0};
-    uint64_t tmp_lba = 0;
-    if (find_dmm_entry(path, &tmp, &tmp_lba, mnt) == PBFS_RES_SUCCESS) return PBFS_ERR_File_Already_Exists;
+    char name[PBFS_MAX_NAME_LEN];
+    uint64_t parent_dmm_lba = {0};
+    int out = new_entry_dir(mnt, path, name, &parent_dmm_lba);
+    if (out != PBFS_RES_SUCCESS) return out;
 
-    uint64_t required_blocks = ALIGN_UP(data_size, mnt->header64.block_size) / mnt->header64.block_size;
-    
-    uint64_t lba = bitmap_find_blocks(&mnt->root_bitmap64, mnt->header64.data_start_lba, required_blocks + 1, mnt);
-    if (lba <= 1) return PBFS_ERR_No_Space_Left;
+    return add_in_dir(mnt, parent_dmm_lba, name, uid, gid, type, permissions, data, data_size);
+}
 
-    char dname[PBFS_MAX_PATH_LEN];
-    char name[PBFS_MAX_NAME_LEN];
-    path_basename(path, name, PBFS_MAX_NAME_LEN);
-    path_dirname(path, dname, PBFS_MAX_PATH_LEN);
+int pbfs_add_dir(struct pbfs_mount* mnt, char* path, uint32_t uid, uint32_t gid, PBFS_Permission_Flags permissions) {
+    return pbfs_add_dir_ex(mnt, path, uid, gid, permissions, 0);
+}
 
-    PBFS_DMM_Entry parent = {0};
-    uint64_t parent_lba = {0};
-    int out = find_dmm_entry(dname, &parent, &parent_lba, mnt);
-    if (out != -1 && out != PBFS_RES_SUCCESS) return out;
+int pbfs_add_dir_ex(struct pbfs_mount* mnt, char* path, uint32_t uid, uint32_t gid, PBFS_Permission_Flags permissions, PBFS_Dir_Flags flags) {
+    if (!mnt->active) return PBFS_ERR_Mount_Inactive;
+    if (flags && !(mnt->header64.features & PBFS_FEATURE_DIR_BTREE)) return PBFS_ERR_Argument_Invalid;
 
-    if (out != -1) {
-        // check perms
-        if (!(parent.perms & PERM_WRITE)) return PBFS_ERR_Wrong_Permissions;
-    }
+    DMM_BLOCK(mnt, dmm);
+    memset(dmm, 0, mnt->header64.block_size);
+    DMM_TRAILER(mnt, dmm)->dir_flags = flags;
+    int out = pbfs_add(mnt, path, uid, gid, METADATA_FLAG_DIR, permissions, (uint8_t*)dmm, mnt->header64.block_size);
+    if (out != PBFS_RES_SUCCESS || !(flags & DIR_FLAG_SORTED)) return out;
 
-    PBFS_DMM parent_dmm = {0};
-    uint64_t parent_dmm_lba = {0};
-    out = retrieve_dir_dmm(out, &parent, &parent_dmm, &parent_dmm_lba, mnt);
+    PBFS_DMM_Entry e = {0};
+    uint64_t e_lba = 0;
+    uint64_t dir_lba = 0;
+    out = find_dmm_entry(path, &e, &e_lba, NULL, mnt);
+    if (out != PBFS_RES_SUCCESS) return out;
+    out = dir_dmm_lba(mnt, &e, &dir_lba);
     if (out != PBFS_RES_SUCCESS) return out;
+    return btree_build(mnt, dir_lba);
+}
 
-    PBFS_Metadata md = {0};
-    memcpy(&md.name, name, strlen(name));
-    md.uid = uid;
-    md.gid = gid;
-    md.permission_offset = 0;
-    md.created_timestamp = 0;
-    md.modified_timestamp = 0;
-    md.data_size = uint128_from_u64(data_size);
-    md.data_offset = 1;
-    md.flags = type;
-    md.ex_flags = permissions;
-    md.extender_lba = UINT128_ZERO;
+// Unlinks e (found in the DMM block dmm_lba of the directory at dir_lba) and frees everything it owns
+static int remove_found(struct pbfs_mount* mnt, char* path, PBFS_DMM_Entry* e, uint64_t dmm_lba, uint64_t dir_lba) {
+    if (e->perms & PERM_LOCKED) return PBFS_ERR_Wrong_Permissions;
 
-    out = pbfs_write(mnt, lba, sizeof(PBFS_Metadata), &md);
+    int out = remove_dmm_entry(mnt, path, dir_lba, dmm_lba);
     if (out != PBFS_RES_SUCCESS) return out;
 
-    out = pbfs_write(mnt, lba + 1, data_size, data);
-    if (out != PBFS_RES_SUCCESS) return out;
+    struct discard_batch batch = {0};
+    if (e->type & METADATA_FLAG_DIR) {
+        uint64_t child_lba = 0;
+        out = dir_dmm_lba(mnt, e, &child_lba);
+        if (out != PBFS_RES_SUCCESS) return out;
 
-    for (uint64_t i = 0; i < required_blocks + 1; i++) {
-        bitmap_set(&mnt->root_bitmap, lba + i, mnt->header64.bitmap_lba, 0, mnt, 1);
+        dcache_invalidate_dir(mnt, child_lba);
+        bloom_drop(mnt, child_lba);
+        out = free_dir_blocks(mnt, child_lba, &batch);
+        if (out != PBFS_RES_SUCCESS) { discard_flush(mnt, &batch); return out; }
     }
-
-    return add_dmm_entry(mnt, &parent_dmm, parent_dmm_lba, lba, name, type, permissions, md.created_timestamp, md.modified_timestamp);
-}
-
-int pbfs_add_dir(struct pbfs_mount* mnt, char* path, uint32_t uid, uint32_t gid, PBFS_Permission_Flags permissions) {
-    PBFS_DMM dmm;
-    memset(&dmm, 0, sizeof(PBFS_DMM));
-    return pbfs_add(mnt, path, uid, gid, METADATA_FLAG_DIR, permissions, (uint8_t*)&dmm, sizeof(PBFS_DMM));
+    symlink_forget(mnt, uint128_to_u64(e->lba));
+    out = free_file_blocks(mnt, uint128_to_u64(e->lba), &batch);
+    discard_flush(mnt, &batch);
+    return out;
 }
 
 int pbfs_remove(struct pbfs_mount* mnt, char* path) {
@@ -1053,37 +4304,68 @@ int pbfs_remove(struct pbfs_mount* mnt, char* path) {
     if (strlen(path) < 1) return PBFS_ERR_No_Path;
 
     PBFS_DMM_Entry e = {0};
-    uint64_t e_lba = 0;
-    int out = find_dmm_entry(path, &e, &e_lba, mnt);
+    uint64_t dmm_lba = 0;
+    uint64_t dir_lba = 0;
+    int out = find_dmm_entry_nofollow(path, &e, &dmm_lba, &dir_lba, mnt);
     if (out != -1 && out != PBFS_RES_SUCCESS) return out;
     if (out == -1) return PBFS_ERR_Cannot_Remove_Root;
-    if (e.perms & PERM_LOCKED) return PBFS_ERR_Wrong_Permissions;
+    return remove_found(mnt, path, &e, dmm_lba, dir_lba);
+}
 
-    PBFS_Metadata md = {0};
-    e_lba = uint128_to_u64(e.lba);
-    out = pbfs_read(mnt, e_lba, sizeof(PBFS_Metadata), &md);
-    if (out != PBFS_RES_SUCCESS) return out;
-    uint64_t ext_lba = uint128_to_u64(md.extender_lba);
-    uint64_t md_data_size = uint128_to_u64(md.data_size);
+// Rewrites a file of one extent whose blocks can hold data_size: blocks are compared chunk by chunk and only
+// the ones that change are written, the metadata only when the size does, blocks no longer needed are freed.
+// The DMM entry stays as it is.
+static int update_in_place(struct pbfs_mount* mnt, uint64_t md_lba, PBFS_Metadata* md, uint8_t* data, size_t data_size) {
+    uint32_t bs = mnt->header64.block_size;
+    uint64_t old_size = uint128_to_u64(md->data_size);
+    uint64_t old_blocks = ALIGN_UP(old_size, bs) / bs;
+    uint64_t new_blocks = ALIGN_UP(data_size, bs) / bs;
+    uint64_t data_lba = md_lba + md->data_offset;
+
+    uint8_t* chunk = funcs.malloc((new_blocks < PBFS_UPDATE_CHUNK ? new_blocks : PBFS_UPDATE_CHUNK) * bs);
+    if (!chunk) return PBFS_ERR_Allocation_Failed;
+
+    int out = PBFS_RES_SUCCESS;
+    for (uint64_t first = 0; first < new_blocks && out == PBFS_RES_SUCCESS; first += PBFS_UPDATE_CHUNK) {
+        uint64_t count = new_blocks - first < PBFS_UPDATE_CHUNK ? new_blocks - first : PBFS_UPDATE_CHUNK;
+        out = read_span(mnt, data_lba + first, count, chunk);
+        if (out != PBFS_RES_SUCCESS) break;
+
+        // Turn the chunk into the new contents (the last block zero padded), then write the runs that changed
+        bool dirty[PBFS_UPDATE_CHUNK];
+        for (uint64_t i = 0; i < count; i++) {
+            uint64_t off = (first + i) * bs;
+            size_t len = data_size - off < bs ? data_size - off : bs;
+            uint8_t* blk = chunk + i * bs;
+
+            dirty[i] = memcmp(blk, data + off, len) != 0;
+            for (size_t j = len; j < bs && !dirty[i]; j++) dirty[i] = blk[j] != 0;
+            if (dirty[i]) {
+                memcpy(blk, data + off, len);
+                memset(blk + len, 0, bs - len);
+            }
+        }
 
-    if (md.data_offset < 1 && md_data_size > 0) return PBFS_ERR_Invalid_File_Or_Directory;
-    for (uint64_t i = 0; i < (md_data_size / mnt->header64.block_size) + 1; i++) {
-        bitmap_set(&mnt->root_bitmap, i + e_lba, mnt->header64.bitmap_lba, 0, mnt, 1);
+        for (uint64_t i = 0; i < count && out == PBFS_RES_SUCCESS; ) {
+            if (!dirty[i]) { i++; continue; }
+            uint64_t run = 1;
+            while (i + run < count && dirty[i + run]) run++;
+            out = write_span(mnt, data_lba + first + i, run, chunk + i * bs);
+            i += run;
+        }
     }
-    
-    while (ext_lba != 0) {
-        e_lba = ext_lba;
-        out = pbfs_read(mnt, e_lba, sizeof(PBFS_Metadata), &md);
-        if (out != PBFS_RES_SUCCESS) return out;
-        ext_lba = uint128_to_u64(md.extender_lba);
+    funcs.free(chunk);
+    if (out != PBFS_RES_SUCCESS) return out;
 
-        if (md.data_offset < 1 && md_data_size > 0) return PBFS_ERR_Invalid_File_Or_Directory;
-        for (uint64_t i = 0; i < (md_data_size / mnt->header64.block_size) + 1; i++) {
-            bitmap_set(&mnt->root_bitmap, i + e_lba, mnt->header64.bitmap_lba, 0, mnt, 1);
-        }
+    if (new_blocks < old_blocks) {
+        struct discard_batch batch = {0};
+        free_blocks(mnt, data_lba + new_blocks, old_blocks - new_blocks, &batch);
+        discard_flush(mnt, &batch);
     }
 
-    return remove_dmm_entry(mnt, path, e_lba);
+    if (old_size == data_size) return PBFS_RES_SUCCESS;
+    md->data_size = uint128_from_u64(data_size);
+    return pbfs_write(mnt, md_lba, sizeof(PBFS_Metadata), md);
 }
 
 int pbfs_update_file(struct pbfs_mount* mnt, char* path, uint8_t* data, size_t data_size) {
@@ -1094,40 +4376,40 @@ int pbfs_update_file(struct pbfs_mount* mnt, char* path, uint8_t* data, size_t d
 
     PBFS_DMM_Entry e = {0};
     uint64_t e_lba = 0;
-    int out = find_dmm_entry(path, &e, &e_lba, mnt);
+    uint64_t dir_lba = 0;
+    int out = find_dmm_entry(path, &e, &e_lba, &dir_lba, mnt);
     if (out != -1 && out != PBFS_RES_SUCCESS) return out;
-    if (out != -1) return PBFS_ERR_Invalid_Path;
-    if (!(e.perms != PERM_WRITE)) return PBFS_ERR_Wrong_Permissions;
+    if (out == -1) return PBFS_ERR_Invalid_Path;
+    if (e.type & METADATA_FLAG_DIR) return PBFS_ERR_Wrong_Type;
+    if (!(e.perms & PERM_WRITE)) return PBFS_ERR_Wrong_Permissions;
 
     PBFS_Metadata og_md = {0};
-    PBFS_Metadata md = {0};
-    e_lba = uint128_to_u64(e.lba);
-    out = pbfs_read(mnt, e_lba, sizeof(PBFS_Metadata), &og_md);
-    memcpy(&md, &og_md, sizeof(PBFS_Metadata));
+    uint64_t md_lba = uint128_to_u64(e.lba);
+    out = pbfs_read(mnt, md_lba, sizeof(PBFS_Metadata), &og_md);
     if (out != PBFS_RES_SUCCESS) return out;
-    uint64_t ext_lba = uint128_to_u64(md.extender_lba);
 
-    uint64_t md_data_size = uint128_to_u64(md.data_size);
-    if (md.data_offset < 1 && md_data_size > 0) return PBFS_ERR_Invalid_File_Or_Directory;
-    for (uint64_t i = 0; i < (md_data_size / mnt->header64.block_size) + 1; i++) {
-        bitmap_set(&mnt->root_bitmap, i + e_lba, mnt->header64.bitmap_lba, 0, mnt, 1);
+    // A symlink's target is its data
+    symlink_forget(mnt, md_lba);
+
+    if ((og_md.flags & METADATA_FLAG_INLINE) && data_size <= inline_cap(mnt)) {
+        return inline_store(mnt, md_lba, &og_md, data, data_size);
     }
-    
-    while (ext_lba != 0) {
-        e_lba = ext_lba;
-        out = pbfs_read(mnt, e_lba, sizeof(PBFS_Metadata), &md);
-        if (out != PBFS_RES_SUCCESS) return out;
-        ext_lba = uint128_to_u64(md.extender_lba);
-        md_data_size = uint128_to_u64(md.data_size);
 
-        if (md.data_offset < 1 && md_data_size > 0) return PBFS_ERR_Invalid_File_Or_Directory;
-        for (uint64_t i = 0; i < (md_data_size / mnt->header64.block_size) + 1; i++) {
-            bitmap_set(&mnt->root_bitmap, i + e_lba, mnt->header64.bitmap_lba, 0, mnt, 1);
-        }
+    uint32_t bs = mnt->header64.block_size;
+    if (!md_packed(&og_md) && uint128_is_zero(&og_md.extender_lba) && og_md.data_offset >= 1 && og_md.data_offset != PBFS_DATA_OFFSET_EXTENTS &&
+        ALIGN_UP(data_size, bs) <= ALIGN_UP(uint128_to_u64(og_md.data_size), bs) && !has_zero_block(mnt, data, data_size)) {
+        return update_in_place(mnt, md_lba, &og_md, data, data_size);
     }
 
-    remove_dmm_entry(mnt, path, e_lba);
-    return pbfs_add(mnt, path, og_md.uid, og_md.gid, og_md.flags, og_md.ex_flags, data, data_size);
+    struct discard_batch batch = {0};
+    out = free_file_blocks(mnt, md_lba, &batch);
+    discard_flush(mnt, &batch);
+    if (out != PBFS_RES_SUCCESS) return out;
+
+    // path may have gone through symlinks, e is the entry that gets replaced
+    out = remove_dmm_entry(mnt, e.name, dir_lba, e_lba);
+    if (out != PBFS_RES_SUCCESS) return out;
+    return add_in_dir(mnt, dir_lba, e.name, og_md.uid, og_md.gid, og_md.flags & ~METADATA_FLAG_INLINE, og_md.ex_flags, data, data_size);
 }
 
 int pbfs_change_permissions(struct pbfs_mount* mnt, char* path, PBFS_Permission_Flags new_permissions) {
@@ -1136,26 +4418,12 @@ int pbfs_change_permissions(struct pbfs_mount* mnt, char* path, PBFS_Permission_
 
     if (new_permissions == PERM_INVALID) return PBFS_ERR_Wrong_Permissions;
 
-    char dname[PBFS_MAX_PATH_LEN];
-    char name[PBFS_MAX_NAME_LEN];
-    path_basename(path, name, PBFS_MAX_NAME_LEN);
-    path_dirname(path, dname, PBFS_MAX_PATH_LEN);
-
-    PBFS_DMM_Entry parent = {0};
-    uint64_t parent_lba = {0};
-    int out = find_dmm_entry(dname, &parent, &parent_lba, mnt);
-    if (out != -1 && out != PBFS_RES_SUCCESS) return out;
-
-    PBFS_DMM parent_dmm = {0};
-    uint64_t parent_dmm_lba = {0};
-    out = retrieve_dir_dmm(out, &parent, &parent_dmm, &parent_dmm_lba, mnt);
-    if (out != PBFS_RES_SUCCESS) return out;
-
     PBFS_DMM_Entry e = {0};
     uint64_t e_lba = 0;
-    out = find_dmm_entry(path, &e, &e_lba, mnt);
-    if (out != -1 && out != PBFS_RES_SUCCESS) return out;
-    if (out != -1) return PBFS_ERR_Invalid_Path;
+    uint64_t dir_lba = 0;
+    int out = find_dmm_entry(path, &e, &e_lba, &dir_lba, mnt);
+    if (out == -1) return PBFS_ERR_Invalid_Path;
+    if (out != PBFS_RES_SUCCESS) return out;
     
     PBFS_Metadata md = {0};
     uint64_t md_lba = uint128_to_u64(e.lba);
@@ -1163,13 +4431,20 @@ int pbfs_change_permissions(struct pbfs_mount* mnt, char* path, PBFS_Permission_
     if (out != PBFS_RES_SUCCESS) return out;
 
     md.ex_flags = new_permissions;
-    out = pbfs_write(mnt, md_lba, sizeof(PBFS_Metadata), &md);
+    out = md_write(mnt, md_lba, &md);
     if (out != PBFS_RES_SUCCESS) return out;
 
-    out = remove_dmm_entry(mnt, path, e_lba);
+    // Update the entry where it is, it keeps its place in the chain and the index
+    DMM_BLOCK(mnt, block);
+    out = dmm_read(mnt, e_lba, block);
     if (out != PBFS_RES_SUCCESS) return out;
 
-    return add_dmm_entry(mnt, &parent_dmm, parent_dmm_lba, e_lba, name, md.flags, new_permissions, md.created_timestamp, md.modified_timestamp);
+    dcache_invalidate(mnt, dir_lba, e.name);
+    int i = dmm_block_find(mnt, block, e.name, dmm_name_hash(e.name));
+    if (i < 0) return PBFS_ERR_DMM_Corrupted;
+
+    DMM_ENTRIES_OF(block)[i].perms = new_permissions;
+    return dmm_write(mnt, e_lba, block);
 }
 
 int pbfs_read_file(struct pbfs_mount* mnt, char* path, uint8_t** data_out, size_t* data_size) {
@@ -1185,50 +4460,206 @@ int pbfs_read_file(struct pbfs_mount* mnt, char* path, uint8_t** data_out, size_
 
     PBFS_DMM_Entry e = {0};
     uint64_t e_lba = 0;
-    int out = find_dmm_entry(path, &e, &e_lba, mnt);
+    int out = find_dmm_entry(path, &e, &e_lba, NULL, mnt);
     if (out != -1 && out != PBFS_RES_SUCCESS) return out;
     if (!(e.perms & PERM_READ)) return PBFS_ERR_Wrong_Permissions;
     
+    // The whole metadata block: inline data comes with it
+    uint8_t block[mnt->header64.block_size];
     PBFS_Metadata md = {0};
     uint64_t md_lba = uint128_to_u64(e.lba);
-    out = pbfs_read(mnt, md_lba, sizeof(PBFS_Metadata), &md);
+    out = pbfs_read_block(mnt, md_lba, block);
     if (out != PBFS_RES_SUCCESS) return out;
+    memcpy(&md, block, sizeof(PBFS_Metadata));
+
+    if (md.flags & METADATA_FLAG_INLINE) {
+        uint64_t size = uint128_to_u64(md.data_size);
+        if (size > mnt->header64.block_size - PBFS_INLINE_DATA_OFFSET) return PBFS_ERR_Invalid_File_Or_Directory;
+        uint8_t* data = funcs.malloc(size > 0 ? size : 1);
+        if (data == NULL) return PBFS_ERR_Allocation_Failed;
+        memcpy(data, block + PBFS_INLINE_DATA_OFFSET, size);
+        *data_size = size;
+        *data_out = data;
+        return PBFS_RES_SUCCESS;
+    }
 
-    uint64_t md_data_size = uint128_to_u64(md.data_size);
+    struct pbfs_file file = {0};
+    out = file_map(mnt, md_lba, &md, &file);
+    if (out != PBFS_RES_SUCCESS) {
+        if (file.extents) funcs.free(file.extents);
+        return out;
+    }
 
-    if (md.data_offset < 1 && md_data_size > 0) return PBFS_ERR_Invalid_File_Or_Directory;
+    // Packed: the trailer has the size to allocate, the chunks are unpacked straight into it
+    if (md_packed(&md)) {
+        PBFS_Compressed_Trailer t;
+        file.mnt = mnt;
+        out = file.size >= sizeof(t) ? file_read_stored(&file, file.size - sizeof(t), sizeof(t), &t) : PBFS_ERR_Invalid_File_Or_Directory;
+        if (out == PBFS_RES_SUCCESS) out = trailer_check(&t, file.size);
+        uint8_t* data = out == PBFS_RES_SUCCESS ? funcs.malloc(t.size > 0 ? t.size : 1) : NULL;
+        if (out == PBFS_RES_SUCCESS && data == NULL) out = PBFS_ERR_Allocation_Failed;
+
+        struct unpack u = {0};
+        u.dst = data;
+        u.dst_size = t.size;
+        if (out == PBFS_RES_SUCCESS) out = unpack_read(mnt, file.extents, file.extent_count, 0, NULL, NULL, 0, &u);
+        if (out == PBFS_RES_SUCCESS && u.size != t.size) out = PBFS_ERR_Invalid_File_Or_Directory;
+        if (file.extents) funcs.free(file.extents);
+        if (out != PBFS_RES_SUCCESS) {
+            if (data) funcs.free(data);
+            return out;
+        }
+        *data_size = t.size;
+        *data_out = data;
+        return PBFS_RES_SUCCESS;
+    }
 
-	PBFS_Metadata md_t = md;
-	while (!uint128_is_zero(&md.extender_lba)) {
-        out = pbfs_read(mnt, uint128_to_u64(md_t.extender_lba), sizeof(PBFS_Metadata), &md_t);
-        if (out != PBFS_RES_SUCCESS) return out;
-        md_data_size += uint128_to_u64(md_t.data_size);
-		if (md_t.data_offset < 1 && md_data_size > 0) return PBFS_ERR_Invalid_File_Or_Directory;
-	}
-    
-    uint8_t* data = funcs.malloc(md_data_size);
-    if (data == NULL) return PBFS_ERR_Allocation_Failed;
-    *data_size = md_data_size;
+    uint8_t* data = funcs.malloc(file.size);
+    if (data == NULL) {
+        if (file.extents) funcs.free(file.extents);
+        return PBFS_ERR_Allocation_Failed;
+    }
+    *data_size = file.size;
     *data_out = data;
 
-    out = pbfs_read(mnt, md.data_offset + md_lba, uint128_to_u64(md.data_size), data);
+    // One request per extent (extender or extent list run)
+    for (uint64_t i = 0; i < file.extent_count && out == PBFS_RES_SUCCESS; i++) {
+        struct pbfs_file_extent* ext = &file.extents[i];
+        out = extent_io(mnt, ext, 0, ext->size, data + ext->file_offset, false);
+    }
+    if (file.extents) funcs.free(file.extents);
+    return out;
+}
+
+// Looks up a readable file for the zero allocation readers and reads its whole metadata block into block
+static int read_head(struct pbfs_mount* mnt, const char* path, uint8_t* block, uint64_t* md_lba) {
+    if (path == NULL || strlen(path) < 1) return PBFS_ERR_No_Path;
+
+    PBFS_DMM_Entry e = {0};
+    uint64_t e_lba = 0;
+    int out = find_dmm_entry(path, &e, &e_lba, NULL, mnt);
+    if (out == -1) return PBFS_ERR_Wrong_Type;
     if (out != PBFS_RES_SUCCESS) return out;
-    
-	md_t = md;
-	uint64_t ext_lba = 0;
-	uint64_t cOff = uint128_to_u64(md.data_size);
-    while (!uint128_is_zero(&md_t.extender_lba)) {
-		ext_lba = uint128_to_u64(md_t.extender_lba);
-        out = pbfs_read(mnt, ext_lba, sizeof(PBFS_Metadata), &md_t);
-        if (out != PBFS_RES_SUCCESS) return out;
+    if (e.type & METADATA_FLAG_DIR) return PBFS_ERR_Wrong_Type;
+    if (!(e.perms & PERM_READ)) return PBFS_ERR_Wrong_Permissions;
+
+    *md_lba = uint128_to_u64(e.lba);
+    return pbfs_read_block(mnt, *md_lba, block);
+}
 
-        out = pbfs_read(mnt, md_t.data_offset + ext_lba, uint128_to_u64(md_t.data_size), data + cOff);
+int pbfs_read_file_into(struct pbfs_mount* mnt, const char* path, void* buf, size_t buf_size, size_t* data_size) {
+    if (!mnt->active) return PBFS_ERR_Mount_Inactive;
+    if (data_size == NULL) return PBFS_ERR_Argument_Invalid;
+    if (buf == NULL && buf_size > 0) return PBFS_ERR_Argument_Invalid;
+    *data_size = 0;
+
+    uint8_t block[mnt->header64.block_size];
+    uint64_t md_lba = 0;
+    int out = read_head(mnt, path, block, &md_lba);
+    if (out != PBFS_RES_SUCCESS) return out;
+
+    PBFS_Metadata md;
+    memcpy(&md, block, sizeof(PBFS_Metadata));
+    if (md_packed(&md)) {
+        struct unpack u = {0};
+        u.dst = buf;
+        u.dst_size = buf_size;
+        out = unpack_read(mnt, NULL, 0, md_lba, block, NULL, 0, &u);
         if (out != PBFS_RES_SUCCESS) return out;
+        *data_size = u.size;
+        return u.size > buf_size ? PBFS_ERR_Buffer_Too_Small : PBFS_RES_SUCCESS;
+    }
+
+    struct read_into r = {buf, buf_size, 0};
+    out = extents_each(mnt, md_lba, block, read_into_extent, &r);
+    if (out != PBFS_RES_SUCCESS) return out;
+    *data_size = r.total;
+    return r.total > buf_size ? PBFS_ERR_Buffer_Too_Small : PBFS_RES_SUCCESS;
+}
+
+int pbfs_read_file_stream(struct pbfs_mount* mnt, const char* path, void* buf, size_t buf_size, pbfs_sink sink, void* ctx) {
+    if (!mnt->active) return PBFS_ERR_Mount_Inactive;
+    if (buf == NULL || buf_size == 0 || sink == NULL) return PBFS_ERR_Argument_Invalid;
+
+    uint8_t block[mnt->header64.block_size];
+    uint64_t md_lba = 0;
+    int out = read_head(mnt, path, block, &md_lba);
+    if (out != PBFS_RES_SUCCESS) return out;
 
-		cOff += uint128_to_u64(md_t.data_size);
+    PBFS_Metadata md;
+    memcpy(&md, block, sizeof(PBFS_Metadata));
+    if (md_packed(&md)) {
+        struct unpack u = {0};
+        u.sink = sink;
+        u.sink_ctx = ctx;
+        return unpack_read(mnt, NULL, 0, md_lba, block, buf, buf_size, &u);
     }
 
-    return PBFS_RES_SUCCESS;
+    struct read_stream s = {buf, stream_chunk(mnt, buf_size), sink, ctx};
+    return extents_each(mnt, md_lba, block, read_stream_extent, &s);
+}
+
+// Copy sharing the source's data blocks (PBFS_FEATURE_REFLINK): the source becomes an extent list file if it
+// isn't one, the copy gets a metadata block with the same list and every block in it one more reference
+static int reflink_copy(struct pbfs_mount* mnt, char* path, char* new_path) {
+    char name[PBFS_MAX_NAME_LEN];
+    uint64_t dir_lba = 0;
+    int out = new_entry_dir(mnt, new_path, name, &dir_lba);
+    if (out != PBFS_RES_SUCCESS) return out;
+
+    struct pbfs_file file = {0};
+    out = pbfs_open(mnt, path, &file);
+    if (out != PBFS_RES_SUCCESS) return out;
+    if (file.chunks) file.size = file.stored_size; // Packed data is shared as it is stored
+    out = file_make_listed(&file);
+
+    uint32_t bs = mnt->header64.block_size;
+    PBFS_Extent* exts = NULL;
+    if (out == PBFS_RES_SUCCESS) {
+        exts = funcs.malloc(file.extent_count * sizeof(PBFS_Extent));
+        if (!exts) out = PBFS_ERR_Allocation_Failed;
+    }
+
+    uint64_t shared = 0;
+    while (out == PBFS_RES_SUCCESS && shared < file.extent_count) {
+        exts[shared].lba = file.extents[shared].data_lba;
+        exts[shared].count = ALIGN_UP(file.extents[shared].size, bs) / bs;
+        if (exts[shared].lba != PBFS_EXTENT_HOLE) out = refcount_adjust(mnt, exts[shared].lba, exts[shared].count, 1);
+        if (out == PBFS_RES_SUCCESS) shared++;
+    }
+
+    uint64_t lba = 0;
+    if (out == PBFS_RES_SUCCESS) {
+        lba = bitmap_find_blocks(&mnt->root_bitmap64, mnt->header64.data_start_lba, 1, mnt);
+        if (lba <= 1) out = PBFS_ERR_No_Space_Left;
+        else bitmap_set(&mnt->root_bitmap, lba, mnt->header64.bitmap_lba, 0, mnt, 1);
+    }
+
+    // The extra references are on disk before anything points at the blocks a second time
+    if (out == PBFS_RES_SUCCESS) out = refcount_sync(mnt);
+
+    struct discard_batch batch = {0};
+    PBFS_Metadata md = file.md;
+    memset(md.name, 0, PBFS_MAX_NAME_LEN);
+    memcpy(md.name, name, strlen(name));
+    if (out == PBFS_RES_SUCCESS) out = extents_store(mnt, lba, &md, exts, file.extent_count, true, &batch);
+    if (out == PBFS_RES_SUCCESS) {
+        out = add_dmm_entry(mnt, dir_lba, lba, name, file.entry.type, file.entry.perms, md.created_timestamp, md.modified_timestamp);
+    }
+
+    if (out != PBFS_RES_SUCCESS) {
+        for (uint64_t i = 0; i < shared; i++) free_blocks(mnt, exts[i].lba, exts[i].count, &batch);
+        if (lba > 1) free_blocks(mnt, lba, 1, &batch);
+    }
+    discard_flush(mnt, &batch);
+
+    if (exts) funcs.free(exts);
+    pbfs_close(&file);
+    return out;
+}
+
+static int copy_sink(void* ctx, const uint8_t* data, size_t len) {
+    return pbfs_write_chunk(ctx, data, len);
 }
 
 int pbfs_copy(struct pbfs_mount* mnt, char* path, char* new_path) {
@@ -1238,53 +4669,133 @@ int pbfs_copy(struct pbfs_mount* mnt, char* path, char* new_path) {
 
     PBFS_DMM_Entry e = {0};
     uint64_t e_lba = 0;
-    int out = find_dmm_entry(path, &e, &e_lba, mnt);
+    int out = find_dmm_entry(path, &e, &e_lba, NULL, mnt);
     if (out != -1 && out != PBFS_RES_SUCCESS) return out;
-    if (out != -1) return PBFS_ERR_Invalid_Path;
+    if (out == -1) return PBFS_ERR_Invalid_Path;
 
     PBFS_Metadata md = {0};
     uint64_t md_lba = uint128_to_u64(e.lba);
     out = pbfs_read(mnt, md_lba, sizeof(PBFS_Metadata), &md);
     if (out != PBFS_RES_SUCCESS) return out;
 
-    uint8_t* data = NULL;
-    size_t data_size = 0;
-    out = pbfs_read_file(mnt, path, &data, &data_size);
-    if (out != PBFS_RES_SUCCESS) {
-        if (data_size > 0 || data != NULL) funcs.free(data);
+    // Inline files are cheaper to copy than to share
+    if ((mnt->header64.features & PBFS_FEATURE_REFLINK) && !(e.type & METADATA_FLAG_DIR) && !(md.flags & METADATA_FLAG_INLINE)) {
+        // Only files with a partly used block before their last one can't share, those get copied
+        out = reflink_copy(mnt, path, new_path);
+        if (out != PBFS_ERR_Data_Unaligned) return out;
+    }
+
+    if (e.type & METADATA_FLAG_DIR) {
+        uint8_t* data = NULL;
+        size_t data_size = 0;
+        out = pbfs_read_file(mnt, path, &data, &data_size);
+        if (out != PBFS_RES_SUCCESS) {
+            if (data_size > 0 || data != NULL) funcs.free(data);
+            return out;
+        }
+
+        out = pbfs_add(mnt, new_path, md.uid, md.gid, md.flags & ~METADATA_FLAG_INLINE, md.ex_flags, data, data_size);
+        funcs.free(data);
         return out;
     }
 
-    out = pbfs_add(mnt, new_path, md.uid, md.gid, md.flags, md.ex_flags, data, data_size);
-    funcs.free(data);
-    return out;
+    // Files stream from one to the other a chunk at a time, sized by the head's data (all of it but for extender chains)
+    struct pbfs_writer w;
+    out = pbfs_create(mnt, new_path, md.uid, md.gid, md.flags & ~METADATA_FLAG_INLINE, md.ex_flags, uint128_to_u64(md.data_size), &w);
+    if (out != PBFS_RES_SUCCESS) return out;
+
+    size_t chunk_size = PBFS_UPDATE_CHUNK * mnt->header64.block_size;
+    uint8_t* chunk = funcs.malloc(chunk_size);
+    if (!chunk) {
+        pbfs_cancel(&w);
+        return PBFS_ERR_Allocation_Failed;
+    }
+    out = pbfs_read_file_stream(mnt, path, chunk, chunk_size, copy_sink, &w);
+    funcs.free(chunk);
+    if (out != PBFS_RES_SUCCESS) {
+        pbfs_cancel(&w);
+        return out;
+    }
+    return pbfs_finish(&w);
 }
 
+// Relinks the DMM entry under new_path: metadata, data and a directory's DMM chain stay where they are,
+// only the name in the metadata is rewritten
 int pbfs_move(struct pbfs_mount* mnt, char* path, char* new_path) {
-    int out = pbfs_copy(mnt, path, new_path);
+    if (!mnt->active) return PBFS_ERR_Mount_Inactive;
+    if (strlen(path) < 1) return PBFS_ERR_No_Path;
+    if (strlen(new_path) < 1) return PBFS_ERR_No_Path;
+
+    PBFS_DMM_Entry e = {0};
+    uint64_t dmm_lba = 0;
+    uint64_t dir_lba = 0;
+    int out = find_dmm_entry_nofollow(path, &e, &dmm_lba, &dir_lba, mnt);
+    if (out != -1 && out != PBFS_RES_SUCCESS) return out;
+    if (out == -1) return PBFS_ERR_Cannot_Remove_Root;
+    if (e.perms & PERM_LOCKED) return PBFS_ERR_Wrong_Permissions;
+
+    PBFS_DMM_Entry tmp = {0};
+    uint64_t tmp_lba = 0;
+    if (find_dmm_entry_nofollow(new_path, &tmp, &tmp_lba, NULL, mnt) == PBFS_RES_SUCCESS) return PBFS_ERR_File_Already_Exists;
+
+    char dname[PBFS_MAX_PATH_LEN];
+    char name[PBFS_MAX_NAME_LEN];
+    path_basename(new_path, name, PBFS_MAX_NAME_LEN);
+    path_dirname(new_path, dname, PBFS_MAX_PATH_LEN);
+    if (name[0] == 0 || !is_plain_name(name)) return PBFS_ERR_Invalid_Path;
+
+    // A directory can't be moved anywhere below itself
+    uint64_t child_lba = 0;
+    if (e.type & METADATA_FLAG_DIR) {
+        out = dir_dmm_lba(mnt, &e, &child_lba);
+        if (out != PBFS_RES_SUCCESS) return out;
+    }
+
+    PBFS_DMM_Entry parent = {0};
+    uint64_t parent_lba = 0;
+    out = find_dmm_entry_at(mnt, mnt->header64.dmm_root_lba, dname, &parent, &parent_lba, NULL, true, child_lba);
+    if (out != -1 && out != PBFS_RES_SUCCESS) return out;
+
+    if (out != -1) {
+        if (!(parent.type & METADATA_FLAG_DIR)) return PBFS_ERR_Wrong_Type;
+        if (!(parent.perms & PERM_WRITE)) return PBFS_ERR_Wrong_Permissions;
+    }
+
+    uint64_t new_dir_lba = 0;
+    out = retrieve_dir_dmm(out, &parent, &new_dir_lba, mnt);
     if (out != PBFS_RES_SUCCESS) return out;
-    return pbfs_remove(mnt, path);
-}
+    if (child_lba != 0 && new_dir_lba == child_lba) return PBFS_ERR_Invalid_Path;
 
-int pbfs_rename(struct pbfs_mount* mnt, char* path, char* new_path) {
-    return pbfs_move(mnt, path, new_path);
-}
+    uint64_t md_lba = uint128_to_u64(e.lba);
+    PBFS_Metadata md = {0};
+    out = pbfs_read(mnt, md_lba, sizeof(PBFS_Metadata), &md);
+    if (out != PBFS_RES_SUCCESS) return out;
+    memset(md.name, 0, PBFS_MAX_NAME_LEN);
+    memcpy(md.name, name, strlen(name));
+    out = md_write(mnt, md_lba, &md);
+    if (out != PBFS_RES_SUCCESS) return out;
 
-int pbfs_find_entry(const char* path, PBFS_DMM_Entry* out, uint64_t* out_lba, struct pbfs_mount* mnt) {
-    if (mnt->active != 1) return PBFS_ERR_Mount_Inactive;
-    return find_dmm_entry(path, out, out_lba, mnt);
-}
+    // Link the new name before unlinking the old one, a failure in between leaves the file reachable
+    out = add_dmm_entry(mnt, new_dir_lba, md_lba, name, e.type, e.perms, e.created_timestamp, e.modified_timestamp);
+    if (out != PBFS_RES_SUCCESS) return out;
 
-int pbfs_add_kernel(struct pbfs_mount* mnt, const char* name, PBFS_Kernel_Flags flags, uint8_t* data, size_t data_size) {
-    if (!mnt->active) return PBFS_ERR_Mount_Inactive;
-    if (strlen(name) < 1) return PBFS_ERR_Invalid_Path;
-    if (data_size < 1) return PBFS_ERR_Argument_Invalid;
-    if (data == NULL) return PBFS_ERR_Argument_Invalid;
+    // Adding may have reshuffled the source directory when it is the same one, find the old entry again
+    out = scan_dir(mnt, dir_lba, e.name, &tmp, &dmm_lba);
+    if (out != PBFS_RES_SUCCESS) return out;
+    return remove_dmm_entry(mnt, e.name, dir_lba, dmm_lba);
+}
 
-    PBFS_Kernel_Entry tmp = {0};
-    uint64_t tmp_lba = 0;
-    if (find_kernel_entry(name, &tmp, &tmp_lba, mnt) == PBFS_RES_SUCCESS) return PBFS_ERR_File_Already_Exists;
+int pbfs_rename(struct pbfs_mount* mnt, char* path, char* new_path) {
+    return pbfs_move(mnt, path, new_path);
+}
+
+int pbfs_find_entry(const char* path, PBFS_DMM_Entry* out, uint64_t* out_lba, struct pbfs_mount* mnt) {
+    if (mnt->active != 1) return PBFS_ERR_Mount_Inactive;
+    return find_dmm_entry(path, out, out_lba, NULL, mnt);
+}
 
+// Writes a kernel's data to one free run and lists it in the kernel table
+static int kernel_store(struct pbfs_mount* mnt, const char* name, PBFS_Kernel_Flags flags, uint8_t* data, size_t data_size) {
     uint64_t required_blocks = ALIGN_UP(data_size, mnt->header64.block_size) / mnt->header64.block_size;
     uint64_t blocks = bitmap_find_blocks(&mnt->root_bitmap64, mnt->header64.bitmap_lba, required_blocks, mnt);
     if (blocks <= 1) return PBFS_ERR_No_Space_Left;
@@ -1301,6 +4812,35 @@ int pbfs_add_kernel(struct pbfs_mount* mnt, const char* name, PBFS_Kernel_Flags
     return PBFS_RES_SUCCESS;
 }
 
+int pbfs_add_kernel(struct pbfs_mount* mnt, const char* name, PBFS_Kernel_Flags flags, uint8_t* data, size_t data_size) {
+    if (!mnt->active) return PBFS_ERR_Mount_Inactive;
+    if (strlen(name) < 1) return PBFS_ERR_Invalid_Path;
+    if (data_size < 1) return PBFS_ERR_Argument_Invalid;
+    if (data == NULL) return PBFS_ERR_Argument_Invalid;
+
+    PBFS_Kernel_Entry tmp = {0};
+    uint64_t tmp_lba = 0;
+    if (find_kernel_entry(name, &tmp, &tmp_lba, mnt) == PBFS_RES_SUCCESS) return PBFS_ERR_File_Already_Exists;
+
+    if (!(mnt->header64.features & PBFS_FEATURE_COMPRESSION)) flags &= ~KERNEL_FLAG_COMPRESSED;
+    if (flags & KERNEL_FLAG_COMPRESSED) {
+        uint8_t* packed = NULL;
+        size_t packed_size = 0;
+        int out = pack_image(data, data_size, mnt->header64.block_size, &packed, &packed_size);
+        if (out != PBFS_RES_SUCCESS) return out;
+
+        // Only worth it when it saves blocks, otherwise the kernel is stored as it is
+        if (packed_size < ALIGN_UP(data_size, mnt->header64.block_size)) {
+            out = kernel_store(mnt, name, flags, packed, packed_size);
+            funcs.free(packed);
+            return out;
+        }
+        funcs.free(packed);
+        flags &= ~KERNEL_FLAG_COMPRESSED;
+    }
+    return kernel_store(mnt, name, flags, data, data_size);
+}
+
 int pbfs_find_kernel(struct pbfs_mount* mnt, const char* name, PBFS_Kernel_Entry* kernel_e) {
     if (!mnt->active) return PBFS_ERR_Mount_Inactive;
     if (strlen(name) < 1) return PBFS_ERR_Invalid_Path;
@@ -1310,12 +4850,59 @@ int pbfs_find_kernel(struct pbfs_mount* mnt, const char* name, PBFS_Kernel_Entry
     return find_kernel_entry(name, kernel_e, &out_lba, mnt);
 }
 
+// Kernels are one run of blocks, read like a single file extent (md_lba 0 is never a kernel's)
+static void kernel_extent(struct pbfs_mount* mnt, PBFS_Kernel_Entry* kernel_e, struct pbfs_file_extent* ext) {
+    ext->md_lba = 0;
+    ext->data_lba = uint128_to_u64(kernel_e->lba);
+    ext->file_offset = 0;
+    ext->size = uint128_to_u64(kernel_e->count) * mnt->header64.block_size;
+}
+
+// Unpacked size of a KERNEL_FLAG_COMPRESSED kernel, from the trailer that ends its last block
+static int kernel_packed_size(struct pbfs_mount* mnt, struct pbfs_file_extent* ext, uint64_t* size) {
+    uint32_t bs = mnt->header64.block_size;
+    uint8_t block[bs];
+    if (ext->size < bs) return PBFS_ERR_Invalid_File_Or_Directory;
+    int res = pbfs_read_block(mnt, ext->data_lba + ext->size / bs - 1, block);
+    if (res != PBFS_RES_SUCCESS) return res;
+
+    PBFS_Compressed_Trailer t;
+    memcpy(&t, block + bs - sizeof(t), sizeof(t));
+    res = trailer_check(&t, ext->size);
+    if (res != PBFS_RES_SUCCESS) return res;
+    *size = t.size;
+    return PBFS_RES_SUCCESS;
+}
+
 int pbfs_get_kernel(struct pbfs_mount* mnt, PBFS_Kernel_Entry* kernel_e, uint8_t** data, size_t* data_size) {
     if (!mnt->active) return PBFS_ERR_Mount_Inactive;
     if (data == NULL) return PBFS_ERR_Argument_Invalid;
     if (data_size == NULL) return PBFS_ERR_Argument_Invalid;
     if (kernel_e == NULL) return PBFS_ERR_Argument_Invalid;
 
+    if (kernel_e->flags & KERNEL_FLAG_COMPRESSED) {
+        struct pbfs_file_extent ext;
+        kernel_extent(mnt, kernel_e, &ext);
+        uint64_t size = 0;
+        int out = kernel_packed_size(mnt, &ext, &size);
+        if (out != PBFS_RES_SUCCESS) return out;
+        uint8_t* data_ret = (uint8_t*)funcs.malloc(size);
+        if (!data_ret) return PBFS_ERR_Allocation_Failed;
+
+        struct unpack u = {0};
+        u.dst = data_ret;
+        u.dst_size = size;
+        out = unpack_read(mnt, &ext, 1, 0, NULL, NULL, 0, &u);
+        if (out == PBFS_RES_SUCCESS && u.size != size) out = PBFS_ERR_Invalid_File_Or_Directory;
+        if (out != PBFS_RES_SUCCESS) {
+            funcs.free(data_ret);
+            return out;
+        }
+        *data_size = size;
+        *data = data_ret;
+        return PBFS_RES_SUCCESS;
+    }
+
     uint64_t count = uint128_to_u64(kernel_e->count);
     uint64_t lba = uint128_to_u64(kernel_e->lba);
     uint8_t* data_ret = (uint8_t*)funcs.malloc(count * mnt->header64.block_size);
@@ -1327,6 +4914,46 @@ int pbfs_get_kernel(struct pbfs_mount* mnt, PBFS_Kernel_Entry* kernel_e, uint8_t
     return pbfs_read(mnt, lba, count * mnt->header64.block_size, data_ret);
 }
 
+int pbfs_get_kernel_into(struct pbfs_mount* mnt, PBFS_Kernel_Entry* kernel_e, void* buf, size_t buf_size, size_t* data_size) {
+    if (!mnt->active) return PBFS_ERR_Mount_Inactive;
+    if (kernel_e == NULL || data_size == NULL) return PBFS_ERR_Argument_Invalid;
+    if (buf == NULL && buf_size > 0) return PBFS_ERR_Argument_Invalid;
+
+    struct pbfs_file_extent ext;
+    kernel_extent(mnt, kernel_e, &ext);
+    if (kernel_e->flags & KERNEL_FLAG_COMPRESSED) {
+        struct unpack u = {0};
+        u.dst = buf;
+        u.dst_size = buf_size;
+        *data_size = 0;
+        int out = unpack_read(mnt, &ext, 1, 0, NULL, NULL, 0, &u);
+        if (out != PBFS_RES_SUCCESS) return out;
+        *data_size = u.size;
+        return u.size > buf_size ? PBFS_ERR_Buffer_Too_Small : PBFS_RES_SUCCESS;
+    }
+
+    *data_size = ext.size;
+    if (ext.size > buf_size) return PBFS_ERR_Buffer_Too_Small;
+    return extent_io(mnt, &ext, 0, ext.size, buf, false);
+}
+
+int pbfs_get_kernel_stream(struct pbfs_mount* mnt, PBFS_Kernel_Entry* kernel_e, void* buf, size_t buf_size, pbfs_sink sink, void* ctx) {
+    if (!mnt->active) return PBFS_ERR_Mount_Inactive;
+    if (kernel_e == NULL || buf == NULL || buf_size == 0 || sink == NULL) return PBFS_ERR_Argument_Invalid;
+
+    struct pbfs_file_extent ext;
+    kernel_extent(mnt, kernel_e, &ext);
+    if (kernel_e->flags & KERNEL_FLAG_COMPRESSED) {
+        struct unpack u = {0};
+        u.sink = sink;
+        u.sink_ctx = ctx;
+        return unpack_read(mnt, &ext, 1, 0, NULL, buf, buf_size, &u);
+    }
+
+    struct read_stream s = {buf, stream_chunk(mnt, buf_size), sink, ctx};
+    return read_stream_extent(mnt, &ext, NULL, &s);
+}
+
 int pbfs_remove_kernel(struct pbfs_mount* mnt, char* name) {
     if (!mnt->active) return PBFS_ERR_Mount_Inactive;
     if (strlen(name) < 1) return PBFS_ERR_No_Path;
@@ -1341,9 +4968,9 @@ int pbfs_remove_kernel(struct pbfs_mount* mnt, char* name) {
     out = remove_kernel_entry(mnt, name, mnt->header64.kernel_table_lba);
     if (out != PBFS_RES_SUCCESS) return out;
 
-    for (uint64_t i = e.lba; i < e.lba + e.count; i++) {
-        bitmap_set(&mnt->root_bitmap, i, mnt->header64.bitmap_lba, 0, mnt, 0);
-    }
+    struct discard_batch batch = {0};
+    free_blocks(mnt, e.lba, e.count, &batch);
+    discard_flush(mnt, &batch);
     return PBFS_RES_SUCCESS;
 }
 
@@ -1376,6 +5003,22 @@ int pbfs_list_kernels(struct pbfs_mount* mnt, PBFS_Kernel_Entry* out, size_t max
     return PBFS_RES_SUCCESS;
 }
 
+int pbfs_compact_dir(struct pbfs_mount* mnt, char* path) {
+    if (!mnt->active) return PBFS_ERR_Mount_Inactive;
+    if (strlen(path) < 1) return PBFS_ERR_No_Path;
+
+    PBFS_DMM_Entry e = {0};
+    uint64_t e_lba = 0;
+    int ret = find_dmm_entry(path, &e, &e_lba, NULL, mnt);
+    if (ret == PBFS_RES_SUCCESS && !(e.type & METADATA_FLAG_DIR)) return PBFS_ERR_Invalid_Path;
+
+    uint64_t dir_lba = 0;
+    ret = retrieve_dir_dmm(ret, &e, &dir_lba, mnt);
+    if (ret != PBFS_RES_SUCCESS) return ret;
+
+    return dmm_compact(mnt, dir_lba);
+}
+
 int pbfs_list_items(struct pbfs_mount* mnt, char* path, PBFS_DMM_Entry* out, size_t max_out_len, size_t* out_len) {
     if (!mnt->active) return PBFS_ERR_Mount_Inactive;
     if (strlen(path) < 1) return PBFS_ERR_No_Path;
@@ -1384,50 +5027,674 @@ int pbfs_list_items(struct pbfs_mount* mnt, char* path, PBFS_DMM_Entry* out, siz
 
     PBFS_DMM_Entry e = {0};
     uint64_t e_lba = 0;
-    int ret = find_dmm_entry(path, &e, &e_lba, mnt);
+    int ret = find_dmm_entry(path, &e, &e_lba, NULL, mnt);
     if (ret != -1 && ret != PBFS_RES_SUCCESS) return ret;
 
-    uint64_t dir_dmm_lba = 0;
+    uint64_t dir_lba = 0;
 
     if (ret == -1) {
-        dir_dmm_lba = mnt->header64.dmm_root_lba;
+        dir_lba = mnt->header64.dmm_root_lba;
     } else {
         if (!(e.type & METADATA_FLAG_DIR)) {
             return PBFS_ERR_Invalid_Path;
         }
 
-        PBFS_Metadata md = {0};
-        uint64_t md_lba = uint128_to_u64(e.lba);
+        ret = dir_dmm_lba(mnt, &e, &dir_lba);
+        if (ret != PBFS_RES_SUCCESS) return ret;
+    }
+
+    size_t count = 0;
+    DMM_BLOCK(mnt, block);
+    PBFS_DMM_Entry* entries = DMM_ENTRIES_OF(block);
+    PBFS_DMM_Trailer* dmm = DMM_TRAILER(mnt, block);
 
-        ret = pbfs_read(mnt, md_lba, sizeof(PBFS_Metadata), &md);
+    while (dir_lba > 0 && count < max_out_len) {
+        ret = dmm_read(mnt, dir_lba, block);
         if (ret != PBFS_RES_SUCCESS) return ret;
 
-        if (md.data_offset < 1) {
-            return PBFS_ERR_Invalid_File_Or_Directory;
+        for (uint32_t i = 0; i < dmm->entry_count && count < max_out_len; i++) {
+            out[count++] = entries[i];
         }
 
-        dir_dmm_lba = md_lba + md.data_offset;
+        dir_lba = uint128_to_u64(dmm->extender_lba);
     }
+    *out_len = count;
+    
+    return PBFS_RES_SUCCESS;
+}
 
-    size_t count = 0;
+int pbfs_list_range(struct pbfs_mount* mnt, char* path, const char* from, PBFS_DMM_Entry* out, size_t max_out_len, size_t* out_len) {
+    if (!mnt->active) return PBFS_ERR_Mount_Inactive;
+    if (strlen(path) < 1) return PBFS_ERR_No_Path;
+    if (from == NULL || out == NULL || out_len == NULL) return PBFS_ERR_Argument_Invalid;
+
+    PBFS_DMM_Entry e = {0};
+    uint64_t e_lba = 0;
+    int ret = find_dmm_entry(path, &e, &e_lba, NULL, mnt);
+    if (ret == PBFS_RES_SUCCESS && !(e.type & METADATA_FLAG_DIR)) return PBFS_ERR_Invalid_Path;
+
+    uint64_t dir_lba = 0;
+    ret = retrieve_dir_dmm(ret, &e, &dir_lba, mnt);
+    if (ret != PBFS_RES_SUCCESS) return ret;
+
+    DMM_BLOCK(mnt, block);
+    PBFS_DMM_Entry* entries = DMM_ENTRIES_OF(block);
+    PBFS_DMM_Trailer* dmm = DMM_TRAILER(mnt, block);
+    ret = dmm_read(mnt, dir_lba, block);
+    if (ret != PBFS_RES_SUCCESS) return ret;
+    if (dmm->btree_root <= 1) return PBFS_ERR_Wrong_Type; // Only B+tree directories are ordered
 
-    while (dir_dmm_lba > 0 && count < max_out_len) {
-        PBFS_DMM dmm = {0};
+    uint64_t leaf_lba = 0;
+    ret = btree_find_leaf(mnt, dmm, from, NULL, &leaf_lba);
+    if (ret != PBFS_RES_SUCCESS) return ret;
 
-        ret = pbfs_read(mnt, dir_dmm_lba, sizeof(PBFS_DMM), &dmm);
+    // Start inside the leaf from belongs in, then follow the leaf chain
+    size_t count = 0;
+    for (uint64_t chain = 0; chain < mnt->header64.total_blocks && leaf_lba > 1 && count < max_out_len; chain++) {
+        ret = dmm_read(mnt, leaf_lba, block);
         if (ret != PBFS_RES_SUCCESS) return ret;
 
-        for (uint32_t i = 0; i < dmm.entry_count && count < max_out_len; i++) {
-            out[count++] = dmm.entries[i];
+        uint64_t i = chain == 0 ? btree_leaf_pos(entries, dmm->entry_count, from) : 0;
+        for (; i < dmm->entry_count && count < max_out_len; i++) {
+            out[count++] = entries[i];
+        }
+        leaf_lba = uint128_to_u64(dmm->extender_lba);
+    }
+    *out_len = count;
+
+    return PBFS_RES_SUCCESS;
+}
+
+// Opens path relative to base_lba, base_perms are the permissions of that directory
+static int open_dir_at(struct pbfs_mount* mnt, uint64_t base_lba, PBFS_Permission_Flags base_perms, const char* path, struct pbfs_dir* dir) {
+    PBFS_DMM_Entry e = {0};
+    uint64_t e_lba = 0;
+    uint64_t dir_lba = 0;
+    PBFS_Permission_Flags perms = base_perms;
+    int ret = find_dmm_entry_at(mnt, base_lba, path, &e, &e_lba, &dir_lba, true, 0);
+    if (ret == PBFS_RES_SUCCESS) {
+        if (!(e.type & METADATA_FLAG_DIR)) return PBFS_ERR_Invalid_Path;
+        perms = e.perms;
+        ret = dir_dmm_lba(mnt, &e, &dir_lba);
+    } else if (ret == -1) {
+        // The root has no entry of its own and is always writable
+        if (dir_lba == mnt->header64.dmm_root_lba) perms = PERM_READ | PERM_WRITE;
+        ret = PBFS_RES_SUCCESS;
+    }
+    if (ret != PBFS_RES_SUCCESS) return ret;
+
+    dir->mnt = mnt;
+    dir->dir_lba = dir_lba;
+    dir->perms = perms;
+    dir->cookie.dmm_lba = dir_lba;
+    dir->cookie.index = 0;
+    return PBFS_RES_SUCCESS;
+}
+
+int pbfs_opendir(struct pbfs_mount* mnt, const char* path, struct pbfs_dir* dir) {
+    if (!mnt->active) return PBFS_ERR_Mount_Inactive;
+    if (strlen(path) < 1) return PBFS_ERR_No_Path;
+    if (dir == NULL) return PBFS_ERR_Argument_Invalid;
+
+    return open_dir_at(mnt, mnt->header64.dmm_root_lba, PERM_READ | PERM_WRITE, path, dir);
+}
+
+// Fills out with up to max_out_len entries from the cookie on, *out_len = 0 once the directory is exhausted.
+// Reads only the DMM blocks the batch spans.
+int pbfs_readdir(struct pbfs_dir* dir, PBFS_DMM_Entry* out, size_t max_out_len, size_t* out_len) {
+    if (dir == NULL || dir->mnt == NULL || out == NULL || out_len == NULL) return PBFS_ERR_Argument_Invalid;
+    struct pbfs_mount* mnt = dir->mnt;
+    if (!mnt->active) return PBFS_ERR_Mount_Inactive;
+
+    DMM_BLOCK(mnt, block);
+    PBFS_DMM_Entry* entries = DMM_ENTRIES_OF(block);
+    PBFS_DMM_Trailer* dmm = DMM_TRAILER(mnt, block);
+
+    size_t count = 0;
+    while (dir->cookie.dmm_lba > 1 && count < max_out_len) {
+        int ret = dmm_read(mnt, dir->cookie.dmm_lba, block);
+        if (ret != PBFS_RES_SUCCESS) {
+            *out_len = count;
+            return ret;
+        }
+
+        while (dir->cookie.index < dmm->entry_count && count < max_out_len) {
+            out[count++] = entries[dir->cookie.index++];
         }
 
-        dir_dmm_lba = uint128_to_u64(dmm.extender_lba);
+        if (dir->cookie.index >= dmm->entry_count) {
+            dir->cookie.dmm_lba = uint128_to_u64(dmm->extender_lba);
+            dir->cookie.index = 0;
+        }
     }
+    if (dir->cookie.dmm_lba <= 1) dir->cookie.dmm_lba = 0;
     *out_len = count;
-    
+
+    return PBFS_RES_SUCCESS;
+}
+
+#define PBFS_COALESCE_GAP 8 // Max distance between two metadata blocks read in one request
+#define PBFS_COALESCE_MAX 64 // Max blocks per coalesced request
+
+struct md_ref {
+    uint64_t lba;
+    size_t idx;
+};
+
+static int md_ref_cmp(const void* a, const void* b) {
+    uint64_t x = ((const struct md_ref*)a)->lba;
+    uint64_t y = ((const struct md_ref*)b)->lba;
+    return x < y ? -1 : x > y;
+}
+
+// pbfs_readdir that also returns each entry's metadata. The batch's metadata LBAs are sorted and
+// blocks close to each other are fetched with one read, so a listing costs a few large reads instead of one per entry.
+int pbfs_readdir_plus(struct pbfs_dir* dir, struct pbfs_dirent_plus* out, size_t max_out_len, size_t* out_len) {
+    if (dir == NULL || dir->mnt == NULL || out == NULL || out_len == NULL) return PBFS_ERR_Argument_Invalid;
+    struct pbfs_mount* mnt = dir->mnt;
+    if (!mnt->active) return PBFS_ERR_Mount_Inactive;
+    *out_len = 0;
+
+    // A failed pbfs_readdir still hands back what it read, those entries get their metadata before the error is returned
+    size_t count = 0;
+    int dir_ret = PBFS_RES_SUCCESS;
+    PBFS_DMM_Entry chunk[16];
+    while (count < max_out_len) {
+        size_t want = max_out_len - count < 16 ? max_out_len - count : 16;
+        size_t got = 0;
+        dir_ret = pbfs_readdir(dir, chunk, want, &got);
+
+        for (size_t i = 0; i < got; i++) out[count++].entry = chunk[i];
+        if (dir_ret != PBFS_RES_SUCCESS || got < want) break;
+    }
+    *out_len = count;
+    if (count == 0) return dir_ret;
+
+    struct md_ref* refs = funcs.malloc(count * sizeof(struct md_ref));
+    uint8_t* buf = funcs.malloc(PBFS_COALESCE_MAX * mnt->header64.block_size);
+    if (!refs || !buf) {
+        if (refs) funcs.free(refs);
+        if (buf) funcs.free(buf);
+        return PBFS_ERR_Allocation_Failed;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        refs[i].lba = uint128_to_u64(out[i].entry.lba);
+        refs[i].idx = i;
+    }
+    heap_sort(refs, count, sizeof(struct md_ref), md_ref_cmp);
+
+    int ret = PBFS_RES_SUCCESS;
+    for (size_t i = 0; i < count && ret == PBFS_RES_SUCCESS;) {
+        uint64_t start = refs[i].lba;
+        size_t j = i;
+        while (
+            j + 1 < count &&
+            refs[j + 1].lba - refs[j].lba <= PBFS_COALESCE_GAP &&
+            refs[j + 1].lba - start < PBFS_COALESCE_MAX
+        ) j++;
+
+        ret = read_span(mnt, start, refs[j].lba - start + 1, buf);
+        for (size_t k = i; k <= j && ret == PBFS_RES_SUCCESS; k++) {
+            memcpy(&out[refs[k].idx].md, buf + (refs[k].lba - start) * mnt->header64.block_size, sizeof(PBFS_Metadata));
+        }
+        i = j + 1;
+    }
+
+    funcs.free(refs);
+    funcs.free(buf);
+
+    // data_size is what is stored, packed files keep their real size in the trailer
+    for (size_t i = 0; i < count && ret == PBFS_RES_SUCCESS; i++) {
+        out[i].size = uint128_to_u64(out[i].md.data_size);
+        if (md_packed(&out[i].md)) ret = packed_size(mnt, uint128_to_u64(out[i].entry.lba), &out[i].md, &out[i].size);
+    }
+    return ret != PBFS_RES_SUCCESS ? ret : dir_ret;
+}
+
+int pbfs_telldir(struct pbfs_dir* dir, struct pbfs_dir_cookie* cookie) {
+    if (dir == NULL || dir->mnt == NULL || cookie == NULL) return PBFS_ERR_Argument_Invalid;
+
+    *cookie = dir->cookie;
+    return PBFS_RES_SUCCESS;
+}
+
+// Resumes a listing from a cookie taken with pbfs_telldir, entries removed or moved since may be skipped
+int pbfs_seekdir(struct pbfs_dir* dir, const struct pbfs_dir_cookie* cookie) {
+    if (dir == NULL || dir->mnt == NULL || cookie == NULL) return PBFS_ERR_Argument_Invalid;
+    if (cookie->dmm_lba == 1 || cookie->dmm_lba >= dir->mnt->header64.total_blocks) return PBFS_ERR_Argument_Invalid;
+    if (cookie->index > dir->mnt->header64.dmm_entries) return PBFS_ERR_Argument_Invalid;
+
+    dir->cookie = *cookie;
+    return PBFS_RES_SUCCESS;
+}
+
+int pbfs_closedir(struct pbfs_dir* dir) {
+    if (dir == NULL) return PBFS_ERR_Argument_Invalid;
+
+    dir->mnt = NULL;
+    dir->cookie.dmm_lba = 0;
+    return PBFS_RES_SUCCESS;
+}
+
+int pbfs_find_entry_at(struct pbfs_dir* dir, const char* path, PBFS_DMM_Entry* out, uint64_t* out_lba) {
+    if (dir == NULL || dir->mnt == NULL || out == NULL || out_lba == NULL) return PBFS_ERR_Argument_Invalid;
+    if (!dir->mnt->active) return PBFS_ERR_Mount_Inactive;
+    if (strlen(path) < 1) return PBFS_ERR_No_Path;
+
+    return find_dmm_entry_at(dir->mnt, dir->dir_lba, path, out, out_lba, NULL, true, 0);
+}
+
+int pbfs_opendir_at(struct pbfs_dir* dir, const char* path, struct pbfs_dir* out) {
+    if (dir == NULL || dir->mnt == NULL || out == NULL) return PBFS_ERR_Argument_Invalid;
+    if (!dir->mnt->active) return PBFS_ERR_Mount_Inactive;
+    if (strlen(path) < 1) return PBFS_ERR_No_Path;
+
+    return open_dir_at(dir->mnt, dir->dir_lba, dir->perms, path, out);
+}
+
+int pbfs_add_at(struct pbfs_dir* dir, char* name, uint32_t uid, uint32_t gid, PBFS_Metadata_Flags type, PBFS_Permission_Flags permissions, uint8_t* data, size_t data_size) {
+    if (dir == NULL || dir->mnt == NULL) return PBFS_ERR_Argument_Invalid;
+    struct pbfs_mount* mnt = dir->mnt;
+    if (!mnt->active) return PBFS_ERR_Mount_Inactive;
+    if (strlen(name) < 1) return PBFS_ERR_No_Path;
+    if (!is_plain_name(name)) return PBFS_ERR_Invalid_Path;
+    if (type == METADATA_FLAG_INVALID) return PBFS_ERR_Wrong_Type;
+    if (permissions == PERM_INVALID) return PBFS_ERR_Wrong_Permissions;
+    if (data_size < 1) return PBFS_ERR_Argument_Invalid;
+    if (data == NULL) return PBFS_ERR_Argument_Invalid;
+    if (!(dir->perms & PERM_WRITE)) return PBFS_ERR_Wrong_Permissions;
+
+    PBFS_DMM_Entry tmp = {0};
+    uint64_t tmp_lba = 0;
+    if (find_dmm_entry_at(mnt, dir->dir_lba, name, &tmp, &tmp_lba, NULL, false, 0) == PBFS_RES_SUCCESS) return PBFS_ERR_File_Already_Exists;
+
+    return add_in_dir(mnt, dir->dir_lba, name, uid, gid, type, permissions, data, data_size);
+}
+
+int pbfs_remove_at(struct pbfs_dir* dir, char* name) {
+    if (dir == NULL || dir->mnt == NULL) return PBFS_ERR_Argument_Invalid;
+    struct pbfs_mount* mnt = dir->mnt;
+    if (!mnt->active) return PBFS_ERR_Mount_Inactive;
+    if (strlen(name) < 1) return PBFS_ERR_No_Path;
+    if (!is_plain_name(name)) return PBFS_ERR_Invalid_Path;
+
+    PBFS_DMM_Entry e = {0};
+    uint64_t dmm_lba = 0;
+    uint64_t dir_lba = 0;
+    int out = find_dmm_entry_at(mnt, dir->dir_lba, name, &e, &dmm_lba, &dir_lba, false, 0);
+    if (out != PBFS_RES_SUCCESS) return out;
+    return remove_found(mnt, name, &e, dmm_lba, dir_lba);
+}
+
+// Reads the trailer and chunk table of an open packed file, whose size becomes the unpacked size
+static int file_open_packed(struct pbfs_file* file) {
+    PBFS_Compressed_Trailer t;
+    uint64_t stored = file->size;
+    if (stored < sizeof(t)) return PBFS_ERR_Invalid_File_Or_Directory;
+    int res = file_read_stored(file, stored - sizeof(t), sizeof(t), &t);
+    if (res != PBFS_RES_SUCCESS) return res;
+    res = trailer_check(&t, stored);
+    if (res != PBFS_RES_SUCCESS) return res;
+
+    uint64_t table = stored - sizeof(t) - t.chunk_count * sizeof(uint64_t);
+    file->chunks = funcs.malloc((t.chunk_count + 1) * sizeof(uint64_t));
+    if (!file->chunks) return PBFS_ERR_Allocation_Failed;
+    res = file_read_stored(file, table, t.chunk_count * sizeof(uint64_t), file->chunks);
+    if (res != PBFS_RES_SUCCESS) return res;
+    file->chunks[t.chunk_count] = table - sizeof(PBFS_Compressed_Chunk);
+
+    // Every chunk a header and at most chunk_size bytes, one after the other
+    for (uint64_t i = 0; i < t.chunk_count; i++) {
+        uint64_t start = file->chunks[i];
+        uint64_t next = file->chunks[i + 1];
+        if ((i == 0 && start != 0) || next <= start + sizeof(PBFS_Compressed_Chunk) || next - start > sizeof(PBFS_Compressed_Chunk) + t.chunk_size) {
+            return PBFS_ERR_Invalid_File_Or_Directory;
+        }
+    }
+
+    file->stored_size = stored;
+    file->size = t.size;
+    file->chunk_count = t.chunk_count;
+    file->chunk_size = t.chunk_size;
+    return PBFS_RES_SUCCESS;
+}
+
+// pbfs_pread of a packed file: each chunk the range touches is read whole and unpacked, the last one stays cached
+static int file_pread_packed(struct pbfs_file* file, uint64_t offset, size_t len, uint8_t* buf) {
+    if (!file->chunk_cache) {
+        file->chunk_cache = funcs.malloc(PBFS_COMPRESS_SCRATCH);
+        if (!file->chunk_cache) return PBFS_ERR_Allocation_Failed;
+    }
+    uint8_t* unpacked = file->chunk_cache;
+    uint8_t* stage = unpacked + PBFS_COMPRESS_CHUNK;
+
+    size_t done = 0;
+    while (done < len) {
+        uint64_t pos = offset + done;
+        uint64_t idx = pos / file->chunk_size;
+        uint64_t start = idx * file->chunk_size;
+        size_t size = file->size - start < file->chunk_size ? file->size - start : file->chunk_size;
+
+        if (file->cached_chunk != idx + 1) {
+            file->cached_chunk = 0;
+            size_t stored = file->chunks[idx + 1] - file->chunks[idx];
+            int res = file_read_stored(file, file->chunks[idx], stored, stage);
+            if (res != PBFS_RES_SUCCESS) return res;
+
+            PBFS_Compressed_Chunk hdr;
+            memcpy(&hdr, stage, sizeof(hdr));
+            if (hdr.size != size || hdr.stored != stored - sizeof(hdr)) return PBFS_ERR_Invalid_File_Or_Directory;
+            if (hdr.stored == hdr.size) memcpy(unpacked, stage + sizeof(hdr), size);
+            else res = lz_decompress(stage + sizeof(hdr), hdr.stored, unpacked, size);
+            if (res != PBFS_RES_SUCCESS) return res;
+            file->cached_chunk = idx + 1;
+        }
+
+        size_t in = pos - start;
+        size_t part = size - in < len - done ? size - in : len - done;
+        memcpy(buf + done, unpacked + in, part);
+        done += part;
+    }
+    return PBFS_RES_SUCCESS;
+}
+
+int pbfs_open(struct pbfs_mount* mnt, const char* path, struct pbfs_file* file) {
+    if (!mnt->active) return PBFS_ERR_Mount_Inactive;
+    if (file == NULL) return PBFS_ERR_Argument_Invalid;
+    if (strlen(path) < 1) return PBFS_ERR_No_Path;
+    file->chunks = NULL;
+    file->chunk_cache = NULL;
+    file->cached_chunk = 0;
+
+    PBFS_DMM_Entry e = {0};
+    uint64_t e_lba = 0;
+    int out = find_dmm_entry(path, &e, &e_lba, NULL, mnt);
+    if (out == -1) return PBFS_ERR_Wrong_Type;
+    if (out != PBFS_RES_SUCCESS) return out;
+    if (e.type & METADATA_FLAG_DIR) return PBFS_ERR_Wrong_Type;
+
+    uint64_t md_lba = uint128_to_u64(e.lba);
+    out = pbfs_read(mnt, md_lba, sizeof(PBFS_Metadata), &file->md);
+    if (out != PBFS_RES_SUCCESS) return out;
+
+    out = file_map(mnt, md_lba, &file->md, file);
+    if (out != PBFS_RES_SUCCESS) {
+        if (file->extents) funcs.free(file->extents);
+        file->extents = NULL;
+        return out;
+    }
+
+    file->mnt = mnt;
+    file->entry = e;
+    if (md_packed(&file->md)) {
+        out = file_open_packed(file);
+        if (out != PBFS_RES_SUCCESS) pbfs_close(file);
+    }
+    return out;
+}
+
+int pbfs_pread(struct pbfs_file* file, uint64_t offset, size_t len, void* buf, size_t* out_len) {
+    if (file == NULL || file->mnt == NULL || buf == NULL) return PBFS_ERR_Argument_Invalid;
+    struct pbfs_mount* mnt = file->mnt;
+    if (!mnt->active) return PBFS_ERR_Mount_Inactive;
+    if (!(file->entry.perms & PERM_READ)) return PBFS_ERR_Wrong_Permissions;
+
+    if (out_len) *out_len = 0;
+    if (offset >= file->size) return PBFS_RES_SUCCESS;
+    if (len > file->size - offset) len = file->size - offset;
+
+    int res = file->chunks ? file_pread_packed(file, offset, len, buf) : file_read_stored(file, offset, len, buf);
+    if (res != PBFS_RES_SUCCESS) return res;
+    if (out_len) *out_len = len;
+    return PBFS_RES_SUCCESS;
+}
+
+// Extent list of an open extent list file, from its map (every run but the last is full)
+static int file_store_extents(struct pbfs_file* file, PBFS_Metadata* md) {
+    struct pbfs_mount* mnt = file->mnt;
+    PBFS_Extent* exts = funcs.malloc(file->extent_count * sizeof(PBFS_Extent));
+    if (!exts) return PBFS_ERR_Allocation_Failed;
+    for (uint64_t i = 0; i < file->extent_count; i++) {
+        exts[i].lba = file->extents[i].data_lba;
+        exts[i].count = ALIGN_UP(file->extents[i].size, mnt->header64.block_size) / mnt->header64.block_size;
+    }
+
+    struct discard_batch batch = {0};
+    int res = extents_store(mnt, file->extents[0].md_lba, md, exts, file->extent_count, false, &batch);
+    discard_flush(mnt, &batch);
+    funcs.free(exts);
+    return res;
+}
+
+// Grows an open file by len bytes: the rest of its tail block first, then free blocks right after the tail extent.
+// Whatever is left goes into a new extent chained from the tail's extender_lba, or for extent list files into
+// new runs added to the list. The metadata that makes the new data part of the file is written last.
+static int file_append(struct pbfs_file* file, const uint8_t* data, size_t len) {
+    struct pbfs_mount* mnt = file->mnt;
+    uint32_t bs = mnt->header64.block_size;
+
+    // Inline data grows in place while it fits, then moves out into an extent list
+    if (file->md.flags & METADATA_FLAG_INLINE) {
+        if (file->size + len <= inline_cap(mnt)) {
+            uint8_t block[bs];
+            uint64_t md_lba = file->extents[0].md_lba;
+            int res = pbfs_read_block(mnt, md_lba, block);
+            if (res != PBFS_RES_SUCCESS) return res;
+
+            file->md.data_size = uint128_from_u64(file->size + len);
+            memcpy(block, &file->md, sizeof(PBFS_Metadata));
+            memcpy(block + PBFS_INLINE_DATA_OFFSET + file->size, data, len);
+            res = pbfs_write_block(mnt, md_lba, block);
+            if (res != PBFS_RES_SUCCESS) return res;
+
+            file->size += len;
+            file->extents[0].size = file->size;
+            return PBFS_RES_SUCCESS;
+        }
+
+        int res = file_make_listed(file);
+        if (res != PBFS_RES_SUCCESS) return res;
+    }
+
+    // The rest of the tail block may be shared with a copy
+    if (file->size % bs != 0) {
+        int res = file_unshare(file, file->size - 1, 1);
+        if (res != PBFS_RES_SUCCESS) return res;
+    }
+
+    struct pbfs_file_extent* tail = &file->extents[file->extent_count - 1];
+    bool head = tail->md_lba == file->extents[0].md_lba;
+    bool listed = file->md.data_offset == PBFS_DATA_OFFSET_EXTENTS;
+
+    PBFS_Metadata tail_md = file->md;
+    if (!head) {
+        int res = pbfs_read(mnt, tail->md_lba, sizeof(PBFS_Metadata), &tail_md);
+        if (res != PBFS_RES_SUCCESS) return res;
+    }
+    if (tail_md.data_offset < 1) return PBFS_ERR_Invalid_File_Or_Directory;
+
+    uint64_t cap = ALIGN_UP(tail->size, bs);
+    size_t slack = cap - tail->size;
+    size_t part = slack < len ? slack : len;
+    if (part > 0) {
+        int res = extent_io(mnt, tail, tail->size, part, (uint8_t*)data, true);
+        if (res != PBFS_RES_SUCCESS) return res;
+    }
+    size_t done = part;
+
+    // Blocks taken from here on go back to the bitmap if the append fails before the metadata points at them
+    uint64_t tail_idx = file->extent_count - 1;
+    uint64_t old_count = file->extent_count;
+    uint64_t old_tail_size = tail->size;
+    PBFS_Extent taken[2] = {0}; // Grown tail, chained extent
+    PBFS_Extent* runs = NULL;
+    uint64_t run_count = 0;
+    int res = PBFS_RES_SUCCESS;
+
+    uint64_t need = ALIGN_UP(len - done, bs) / bs;
+    uint64_t next = tail->data_lba + cap / bs;
+    uint64_t grow = 0;
+    while (tail->data_lba != PBFS_EXTENT_HOLE && grow < need && bitmap_test(mnt, next + grow) == 0) grow++;
+    if (grow > 0) {
+        size_t grow_len = grow * bs < len - done ? grow * bs : len - done;
+        res = write_new_blocks(mnt, next, data + done, grow_len);
+        if (res != PBFS_RES_SUCCESS) return res;
+        for (uint64_t i = 0; i < grow; i++) {
+            bitmap_set(&mnt->root_bitmap, next + i, mnt->header64.bitmap_lba, 0, mnt, 1);
+        }
+        taken[0].lba = next;
+        taken[0].count = grow;
+        done += grow_len;
+    }
+    tail->size += done;
+    tail_md.data_size = uint128_from_u64(tail->size);
+
+    if (done < len && listed) {
+        res = alloc_extents(mnt, ALIGN_UP(len - done, bs) / bs, &runs, &run_count);
+        if (res == PBFS_RES_SUCCESS) {
+            void* nptr = funcs.realloc(file->extents, (file->extent_count + run_count) * sizeof(struct pbfs_file_extent));
+            if (!nptr) res = PBFS_ERR_Allocation_Failed;
+            else file->extents = nptr;
+        }
+
+        for (uint64_t i = 0; i < run_count && res == PBFS_RES_SUCCESS; i++) {
+            size_t run_len = runs[i].count * bs < len - done ? runs[i].count * bs : len - done;
+            res = write_new_blocks(mnt, runs[i].lba, data + done, run_len);
+
+            struct pbfs_file_extent* ext = &file->extents[file->extent_count++];
+            ext->md_lba = file->extents[0].md_lba;
+            ext->data_lba = runs[i].lba;
+            ext->file_offset = file->size + done;
+            ext->size = run_len;
+            done += run_len;
+        }
+    } else if (done < len) {
+        size_t rest = len - done;
+        uint64_t blocks = ALIGN_UP(rest, bs) / bs;
+        uint64_t lba = bitmap_find_blocks(&mnt->root_bitmap64, mnt->header64.data_start_lba, blocks + 1, mnt);
+        if (lba <= 1) res = PBFS_ERR_No_Space_Left;
+
+        if (res == PBFS_RES_SUCCESS) {
+            void* nptr = funcs.realloc(file->extents, (file->extent_count + 1) * sizeof(struct pbfs_file_extent));
+            if (!nptr) res = PBFS_ERR_Allocation_Failed;
+            else file->extents = nptr;
+        }
+
+        PBFS_Metadata md = file->md;
+        md.data_size = uint128_from_u64(rest);
+        md.data_offset = 1;
+        md.extender_lba = UINT128_ZERO;
+        if (res == PBFS_RES_SUCCESS) res = pbfs_write(mnt, lba, sizeof(PBFS_Metadata), &md);
+        if (res == PBFS_RES_SUCCESS) res = write_new_blocks(mnt, lba + 1, data + done, rest);
+        if (res == PBFS_RES_SUCCESS) {
+            for (uint64_t i = 0; i < blocks + 1; i++) {
+                bitmap_set(&mnt->root_bitmap, lba + i, mnt->header64.bitmap_lba, 0, mnt, 1);
+            }
+            taken[1].lba = lba;
+            taken[1].count = blocks + 1;
+
+            tail = &file->extents[tail_idx];
+            struct pbfs_file_extent* ext = &file->extents[file->extent_count++];
+            ext->md_lba = lba;
+            ext->data_lba = lba + 1;
+            ext->file_offset = tail->file_offset + tail->size;
+            ext->size = rest;
+            tail_md.extender_lba = uint128_from_u64(lba);
+        }
+    }
+
+    if (res == PBFS_RES_SUCCESS && listed) {
+        tail_md = file->md;
+        tail_md.data_size = uint128_from_u64(file->size + len);
+        res = file_store_extents(file, &tail_md);
+    } else if (res == PBFS_RES_SUCCESS) {
+        res = pbfs_write(mnt, file->extents[tail_idx].md_lba, sizeof(PBFS_Metadata), &tail_md);
+    }
+
+    if (runs) {
+        if (res != PBFS_RES_SUCCESS) release_runs(mnt, runs, run_count);
+        funcs.free(runs);
+    }
+    if (res != PBFS_RES_SUCCESS) {
+        release_runs(mnt, taken, 2);
+        file->extent_count = old_count;
+        file->extents[tail_idx].size = old_tail_size;
+        return res;
+    }
+    if (head) file->md = tail_md;
+    file->size += len;
+    return PBFS_RES_SUCCESS;
+}
+
+int pbfs_pwrite(struct pbfs_file* file, uint64_t offset, size_t len, const void* buf) {
+    if (file == NULL || file->mnt == NULL || buf == NULL) return PBFS_ERR_Argument_Invalid;
+    struct pbfs_mount* mnt = file->mnt;
+    if (!mnt->active) return PBFS_ERR_Mount_Inactive;
+    if (!(file->entry.perms & PERM_WRITE)) return PBFS_ERR_Wrong_Permissions;
+    if (file->md.flags & METADATA_FLAG_COMPRESSED) return PBFS_ERR_Wrong_Type;
+    if (offset > file->size) return PBFS_ERR_Argument_Invalid;
+    if (len == 0) return PBFS_RES_SUCCESS;
+    symlink_forget(mnt, uint128_to_u64(file->entry.lba));
+
+    // Overwrite what exists, append the rest
+    size_t overwrite = file->size - offset < len ? file->size - offset : len;
+    int res = file_unshare(file, offset, overwrite);
+    if (res != PBFS_RES_SUCCESS) return res;
+
+    size_t done = 0;
+    for (uint64_t i = file_extent_at(file, offset); i < file->extent_count && done < overwrite; i++) {
+        struct pbfs_file_extent* ext = &file->extents[i];
+        uint64_t pos = offset + done;
+        if (pos >= ext->file_offset + ext->size) continue;
+
+        uint64_t ext_off = pos - ext->file_offset;
+        size_t part = ext->size - ext_off;
+        if (part > overwrite - done) part = overwrite - done;
+
+        res = extent_io(mnt, ext, ext_off, part, (uint8_t*)buf + done, true);
+        if (res != PBFS_RES_SUCCESS) return res;
+        done += part;
+    }
+
+    if (overwrite == len) return PBFS_RES_SUCCESS;
+    return file_append(file, (const uint8_t*)buf + overwrite, len - overwrite);
+}
+
+int pbfs_close(struct pbfs_file* file) {
+    if (file == NULL) return PBFS_ERR_Argument_Invalid;
+    if (file->extents) funcs.free(file->extents);
+    if (file->chunks) funcs.free(file->chunks);
+    if (file->chunk_cache) funcs.free(file->chunk_cache);
+    file->extents = NULL;
+    file->extent_count = 0;
+    file->chunks = NULL;
+    file->chunk_cache = NULL;
+    file->cached_chunk = 0;
+    file->mnt = NULL;
     return PBFS_RES_SUCCESS;
 }
 
+int pbfs_append(struct pbfs_mount* mnt, char* path, uint8_t* data, size_t data_size) {
+    if (!mnt->active) return PBFS_ERR_Mount_Inactive;
+    if (strlen(path) < 1) return PBFS_ERR_No_Path;
+    if (data == NULL) return PBFS_ERR_Argument_Invalid;
+    if (data_size < 1) return PBFS_RES_SUCCESS;
+
+    struct pbfs_file file = {0};
+    int out = pbfs_open(mnt, path, &file);
+    if (out != PBFS_RES_SUCCESS) return out;
+
+    if (!(file.entry.perms & PERM_WRITE)) out = PBFS_ERR_Wrong_Permissions;
+    else if (file.md.flags & METADATA_FLAG_COMPRESSED) out = PBFS_ERR_Wrong_Type;
+    else {
+        symlink_forget(mnt, uint128_to_u64(file.entry.lba));
+        out = file_append(&file, data, data_size);
+    }
+    pbfs_close(&file);
+    return out;
+}
+
 int pbfs_add_bootloader(struct pbfs_mount *mnt, uint8_t *data, size_t data_size, uint8_t boot_part_type) {
     if (!mnt->active) return PBFS_ERR_Mount_Inactive;
     if (data == NULL || data_size < 1) return PBFS_ERR_Argument_Invalid;
@@ -1580,6 +5847,8 @@ const char* pbfs_get_err_str(enum PBFS_Result return_code) {
         case PBFS_ERR_DMM_Corrupted: return "PBFS_ERR_DMM_Corrupted";
         case PBFS_ERR_Bitmap_Corrupted: return "PBFS_ERR_Bitmap_Corrupted";
         case PBFS_ERR_Sysinfo_Corrupted: return "PBFS_ERR_Sysinfo_Corrupted";
+        case PBFS_ERR_Too_Many_Symlinks: return "PBFS_ERR_Too_Many_Symlinks";
+        case PBFS_ERR_Buffer_Too_Small: return "PBFS_ERR_Buffer_Too_Small";
         
         default: return "Unknown Status Code";
     }
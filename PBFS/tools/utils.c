@@ -309,6 +309,35 @@ void path_part(char* path, int index, char* out, int out_size) {
         out[0] = 0;
 }
 
+// Copies the component at *pos into out and moves *pos past it and the slashes after it, 0 once there are none left.
+// path[*pos] == 0 afterwards means out was the last component.
+int path_next(char* path, int* pos, char* out, int out_size) {
+    int i = *pos;
+
+    while (path[i] == '/')
+        i++;
+
+    int start = i;
+    while (path[i] && path[i] != '/')
+        i++;
+
+    int part_len = i - start;
+    if (part_len >= out_size)
+        part_len = out_size - 1;
+
+    for (int j = 0; j < part_len; j++)
+        out[j] = path[start + j];
+
+    if (out_size > 0)
+        out[part_len] = 0;
+
+    while (path[i] == '/')
+        i++;
+
+    *pos = i;
+    return part_len;
+}
+
 void path_join(char* out, char* p1, char* p2, int out_size) {
     if (out_size < 0) return;
 